@@ -0,0 +1,158 @@
+//
+// Copyright (c) 2012, Takashi TOYOSHIMA <toyoshim@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// - Neither the name of the authors nor the names of its contributors may be
+//   used to endorse or promote products derived from this software with out
+//   specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUE
+// NTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+// GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.
+//
+
+#include "dentry_cache.h"
+
+#include <string.h>
+
+#include "ppapi/cpp/file_ref.h"
+#include "ppapi/cpp/file_system.h"
+
+namespace naclfs {
+
+pthread_once_t DentryCache::once_ = PTHREAD_ONCE_INIT;
+DentryCache* DentryCache::instance_ = NULL;
+
+DentryCache* DentryCache::GetInstance() {
+  pthread_once(&once_, Create);
+  return instance_;
+}
+
+pp::FileRef DentryCache::GetFileRef(pp::FileSystem* filesystem,
+                                    const char* path) {
+  pthread_mutex_lock(&mutex_);
+  EntryMap::iterator found = map_.find(path);
+  if (found != map_.end()) {
+    statistics_.hits++;
+    entries_.splice(entries_.begin(), entries_, found->second);
+    pp::FileRef file_ref(*found->second->file_ref);
+    pthread_mutex_unlock(&mutex_);
+    return file_ref;
+  }
+  statistics_.misses++;
+  pthread_mutex_unlock(&mutex_);
+
+  // Resources are created outside the lock as it may take a while. Only the
+  // main thread adds entries, so nobody else can add |path| meanwhile.
+  pp::FileRef* file_ref = new pp::FileRef(*filesystem, path);
+
+  pthread_mutex_lock(&mutex_);
+  Entry entry;
+  entry.path = path;
+  entry.file_ref = file_ref;
+  memset(&entry.info, 0, sizeof(entry.info));
+  entry.valid = false;
+  entries_.push_front(entry);
+  map_[entry.path] = entries_.begin();
+  std::list<pp::FileRef*> victims;
+  while (entries_.size() > capacity_) {
+    Entry& last = entries_.back();
+    victims.push_back(last.file_ref);
+    map_.erase(last.path);
+    entries_.pop_back();
+    statistics_.evictions++;
+  }
+  statistics_.entries = entries_.size();
+  pp::FileRef result(*file_ref);
+  pthread_mutex_unlock(&mutex_);
+
+  for (std::list<pp::FileRef*>::iterator it = victims.begin();
+       it != victims.end();
+       ++it) {
+    delete *it;
+  }
+  return result;
+}
+
+bool DentryCache::LookupInfo(const char* path, PP_FileInfo* info) {
+  pthread_mutex_lock(&mutex_);
+  EntryMap::iterator found = map_.find(path);
+  if (found == map_.end() || !found->second->valid) {
+    statistics_.misses++;
+    pthread_mutex_unlock(&mutex_);
+    return false;
+  }
+  statistics_.hits++;
+  entries_.splice(entries_.begin(), entries_, found->second);
+  *info = found->second->info;
+  pthread_mutex_unlock(&mutex_);
+  return true;
+}
+
+void DentryCache::UpdateInfo(const char* path, const PP_FileInfo& info) {
+  pthread_mutex_lock(&mutex_);
+  EntryMap::iterator found = map_.find(path);
+  if (found != map_.end()) {
+    found->second->info = info;
+    found->second->valid = true;
+  }
+  pthread_mutex_unlock(&mutex_);
+}
+
+void DentryCache::Invalidate(const char* path) {
+  pthread_mutex_lock(&mutex_);
+  EntryMap::iterator found = map_.find(path);
+  if (found != map_.end() && found->second->valid) {
+    found->second->valid = false;
+    statistics_.invalidations++;
+  }
+  pthread_mutex_unlock(&mutex_);
+}
+
+void DentryCache::SetCapacity(size_t capacity) {
+  pthread_mutex_lock(&mutex_);
+  capacity_ = capacity;
+  pthread_mutex_unlock(&mutex_);
+}
+
+void DentryCache::GetStatistics(Statistics* statistics) {
+  pthread_mutex_lock(&mutex_);
+  *statistics = statistics_;
+  pthread_mutex_unlock(&mutex_);
+}
+
+DentryCache::DentryCache()
+    : capacity_(kDefaultCapacity) {
+  memset(&statistics_, 0, sizeof(statistics_));
+  pthread_mutex_init(&mutex_, NULL);
+}
+
+DentryCache::~DentryCache() {
+  for (EntryList::iterator it = entries_.begin(); it != entries_.end(); ++it)
+    delete it->file_ref;
+  pthread_mutex_destroy(&mutex_);
+}
+
+void DentryCache::Create() {
+  instance_ = new DentryCache();
+}
+
+}  // namespace naclfs
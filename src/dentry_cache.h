@@ -0,0 +1,119 @@
+//
+// Copyright (c) 2012, Takashi TOYOSHIMA <toyoshim@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// - Neither the name of the authors nor the names of its contributors may be
+//   used to endorse or promote products derived from this software with out
+//   specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUE
+// NTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+// GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.
+//
+
+#ifndef NACLFS_DENTRY_CACHE_H_
+#define NACLFS_DENTRY_CACHE_H_
+#pragma once
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <list>
+#include <map>
+#include <string>
+
+#include "ppapi/c/pp_file_info.h"
+
+namespace pp {
+
+class FileRef;
+class FileSystem;
+
+};  // namespace pp
+
+namespace naclfs {
+
+// Bounded LRU cache from normalized full paths to pp::FileRef resources and
+// the last known PP_FileInfo for them, so that hot paths do not create a
+// new FileRef or query the browser again on every open or stat.
+//
+// FileRef resources are created and released on the main thread only, so
+// GetFileRef() must be called there and entries are evicted there. Cached
+// metadata may be looked up and invalidated from any thread.
+class DentryCache {
+ public:
+  struct Statistics {
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t invalidations;
+    uint32_t evictions;
+    uint32_t entries;
+  };
+
+  static const size_t kDefaultCapacity = 256;
+
+  static DentryCache* GetInstance();
+
+  // Main thread only. Returns the FileRef for |path| in |filesystem|,
+  // creating and caching it on a miss.
+  pp::FileRef GetFileRef(pp::FileSystem* filesystem, const char* path);
+  // Copies the cached metadata for |path| into |info|. Returns false if
+  // nothing valid is cached.
+  bool LookupInfo(const char* path, PP_FileInfo* info);
+  // Records |info| for |path| if |path| has an entry.
+  void UpdateInfo(const char* path, const PP_FileInfo& info);
+  // Drops the cached metadata for |path|. The FileRef is kept.
+  void Invalidate(const char* path);
+
+  // Changes the number of entries kept. A smaller capacity takes effect as
+  // entries are added on the main thread.
+  void SetCapacity(size_t capacity);
+  void GetStatistics(Statistics* statistics);
+
+ private:
+  struct Entry {
+    std::string path;
+    pp::FileRef* file_ref;
+    PP_FileInfo info;
+    bool valid;
+  };
+  typedef std::list<Entry> EntryList;
+  typedef std::map<std::string, EntryList::iterator> EntryMap;
+
+  DentryCache();
+  ~DentryCache();
+
+  static void Create();
+
+  static pthread_once_t once_;
+  static DentryCache* instance_;
+
+  // Most recently used first.
+  EntryList entries_;
+  EntryMap map_;
+  size_t capacity_;
+  Statistics statistics_;
+  pthread_mutex_t mutex_;
+};
+
+}  // namespace naclfs
+
+#endif  // NACLFS_DENTRY_CACHE_H_
@@ -0,0 +1,181 @@
+//
+// Copyright (c) 2012, Takashi TOYOSHIMA <toyoshim@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// - Neither the name of the authors nor the names of its contributors may be
+//   used to endorse or promote products derived from this software with out
+//   specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUE
+// NTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+// GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.
+//
+
+#include "descriptor_table.h"
+
+#include <sched.h>
+#include <string.h>
+
+namespace naclfs {
+
+static const size_t kBits = 32;
+
+DescriptorTable::DescriptorTable(size_t limit) {
+  pthread_mutex_init(&mutex_, NULL);
+  memset(const_cast<Segment**>(segments_), 0, sizeof(segments_));
+  limit_ = (limit && limit <= kMaxLimit) ? limit : kMaxLimit;
+  BuildBitmap();
+}
+
+DescriptorTable::~DescriptorTable() {
+  for (size_t i = 0; i < kMaxSegments; ++i)
+    delete segments_[i];
+  pthread_mutex_destroy(&mutex_);
+}
+
+int DescriptorTable::Bind(FileSystem::Delegate* delegate) {
+  pthread_mutex_lock(&mutex_);
+  int fildes = FindFree();
+  if (fildes >= 0) {
+    size_t segment = fildes / kSegmentSize;
+    if (!segments_[segment]) {
+      Segment* new_segment = new Segment;
+      memset(new_segment, 0, sizeof(Segment));
+      // Publish the cleared segment before lock-free readers can see it.
+      __sync_synchronize();
+      segments_[segment] = new_segment;
+    }
+    MarkUsed(fildes);
+    __sync_synchronize();
+    GetSlot(fildes)->delegate = delegate;
+  }
+  pthread_mutex_unlock(&mutex_);
+  return fildes;
+}
+
+FileSystem::Delegate* DescriptorTable::Acquire(int fildes) {
+  if (fildes < 0)
+    return NULL;
+  Slot* slot = GetSlot(fildes);
+  if (!slot)
+    return NULL;
+  // Both atomic operations are full barriers, which pairs with the barrier
+  // in Unbind(): either this reader sees the cleared slot, or Unbind() sees
+  // the reader and waits for it.
+  __sync_fetch_and_add(&slot->readers, 1);
+  FileSystem::Delegate* delegate = slot->delegate;
+  if (delegate)
+    delegate->AddRef();
+  __sync_fetch_and_sub(&slot->readers, 1);
+  return delegate;
+}
+
+FileSystem::Delegate* DescriptorTable::Unbind(int fildes) {
+  if (fildes < 0)
+    return NULL;
+  pthread_mutex_lock(&mutex_);
+  Slot* slot = GetSlot(fildes);
+  FileSystem::Delegate* delegate = slot ? slot->delegate : NULL;
+  if (delegate) {
+    slot->delegate = NULL;
+    __sync_synchronize();
+    while (slot->readers)
+      sched_yield();
+    MarkFree(fildes);
+  }
+  pthread_mutex_unlock(&mutex_);
+  return delegate;
+}
+
+bool DescriptorTable::SetLimit(size_t limit) {
+  if (!limit || limit > kMaxLimit)
+    return false;
+  pthread_mutex_lock(&mutex_);
+  for (size_t i = limit; i < limit_; ++i) {
+    Slot* slot = GetSlot(i);
+    if (slot && slot->delegate) {
+      pthread_mutex_unlock(&mutex_);
+      return false;
+    }
+  }
+  limit_ = limit;
+  BuildBitmap();
+  pthread_mutex_unlock(&mutex_);
+  return true;
+}
+
+DescriptorTable::Slot* DescriptorTable::GetSlot(size_t index) const {
+  if (index >= kMaxLimit)
+    return NULL;
+  Segment* segment = segments_[index / kSegmentSize];
+  if (!segment)
+    return NULL;
+  return &segment->slots[index % kSegmentSize];
+}
+
+void DescriptorTable::BuildBitmap() {
+  levels_.clear();
+  size_t bits = limit_;
+  do {
+    size_t words = (bits + kBits - 1) / kBits;
+    levels_.push_back(std::vector<uint32_t>(words, 0));
+    bits = words;
+  } while (bits > 1);
+  for (size_t i = 0; i < limit_; ++i) {
+    Slot* slot = GetSlot(i);
+    if (!slot || !slot->delegate)
+      MarkFree(i);
+  }
+}
+
+int DescriptorTable::FindFree() const {
+  size_t index = 0;
+  for (size_t level = levels_.size(); level-- > 0; ) {
+    uint32_t word = levels_[level][index];
+    if (!word)
+      return -1;  // Only the top level can be empty.
+    index = index * kBits + __builtin_ctz(word);
+  }
+  return static_cast<int>(index);
+}
+
+void DescriptorTable::MarkUsed(size_t index) {
+  for (size_t level = 0; level < levels_.size(); ++level) {
+    uint32_t& word = levels_[level][index / kBits];
+    word &= ~(1u << (index % kBits));
+    if (word)
+      break;  // Upper levels still see a free bit in this word.
+    index /= kBits;
+  }
+}
+
+void DescriptorTable::MarkFree(size_t index) {
+  for (size_t level = 0; level < levels_.size(); ++level) {
+    uint32_t& word = levels_[level][index / kBits];
+    bool was_empty = !word;
+    word |= 1u << (index % kBits);
+    if (!was_empty)
+      break;  // Upper levels already know about this word.
+    index /= kBits;
+  }
+}
+
+}  // namespace naclfs
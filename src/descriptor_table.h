@@ -0,0 +1,104 @@
+//
+// Copyright (c) 2012, Takashi TOYOSHIMA <toyoshim@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// - Neither the name of the authors nor the names of its contributors may be
+//   used to endorse or promote products derived from this software with out
+//   specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUE
+// NTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+// GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.
+//
+
+#ifndef NACLFS_DESCRIPTOR_TABLE_H_
+#define NACLFS_DESCRIPTOR_TABLE_H_
+#pragma once
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "filesystem.h"
+
+namespace naclfs {
+
+// Maps file descriptors to delegates. Free descriptors are tracked in a
+// hierarchical bitmap with one bit per descriptor on the bottom level and
+// one bit per non-empty word on each level above it, so the lowest free
+// descriptor is found with one find-first-set per level.
+//
+// Lookups take no lock. Slots live in fixed size segments which are never
+// moved or freed while the table exists, and each slot counts the readers
+// that are between loading the delegate and taking a reference to it.
+// Unbind() waits for that count to drain before handing the table's
+// reference back, so a delegate is never freed under a concurrent lookup.
+class DescriptorTable {
+ public:
+  static const size_t kSegmentSize = 256;
+  static const size_t kMaxSegments = 1024;
+  static const size_t kMaxLimit = kSegmentSize * kMaxSegments;
+
+  explicit DescriptorTable(size_t limit);
+  ~DescriptorTable();
+
+  // Binds |delegate| to the lowest free descriptor and returns it, or -1 if
+  // all descriptors are in use. The table takes over the caller's reference.
+  int Bind(FileSystem::Delegate* delegate);
+  // Returns the delegate bound to |fildes| with a new reference, or NULL.
+  FileSystem::Delegate* Acquire(int fildes);
+  // Releases |fildes| and returns the delegate which was bound to it along
+  // with the table's reference.
+  FileSystem::Delegate* Unbind(int fildes);
+
+  // Changes the maximum number of descriptors, up to kMaxLimit. Fails if a
+  // descriptor at or above |limit| is in use.
+  bool SetLimit(size_t limit);
+  size_t limit() const { return limit_; }
+
+ private:
+  struct Slot {
+    FileSystem::Delegate* volatile delegate;
+    volatile uint32_t readers;
+  };
+  struct Segment {
+    Slot slots[kSegmentSize];
+  };
+
+  Slot* GetSlot(size_t index) const;
+  void BuildBitmap();
+  int FindFree() const;
+  void MarkUsed(size_t index);
+  void MarkFree(size_t index);
+
+  // levels_[0] holds a set bit for each free descriptor.
+  std::vector<std::vector<uint32_t> > levels_;
+  // Allocated up to the highest descriptor ever used.
+  Segment* volatile segments_[kMaxSegments];
+  size_t limit_;
+  // Serializes Bind(), Unbind() and SetLimit().
+  pthread_mutex_t mutex_;
+};
+
+}  // namespace naclfs
+
+#endif  // NACLFS_DESCRIPTOR_TABLE_H_
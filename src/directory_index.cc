@@ -0,0 +1,128 @@
+//
+// Copyright (c) 2012, Takashi TOYOSHIMA <toyoshim@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// - Neither the name of the authors nor the names of its contributors may be
+//   used to endorse or promote products derived from this software with out
+//   specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUE
+// NTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+// GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.
+//
+
+#include "directory_index.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+namespace naclfs {
+
+struct DirectoryIndex::NameLess {
+  explicit NameLess(const DirectoryIndex* index) : index(index) {}
+  bool operator()(uint32_t a, uint32_t b) const {
+    return strcmp(index->name(a), index->name(b)) < 0;
+  }
+  const DirectoryIndex* index;
+};
+
+DirectoryIndex::DirectoryIndex()
+    : sorted_(true) {
+}
+
+DirectoryIndex::~DirectoryIndex() {
+}
+
+void DirectoryIndex::Reserve(size_t entries, size_t bytes) {
+  arena_.reserve(arena_.size() + bytes);
+  offsets_.reserve(offsets_.size() + entries);
+  types_.reserve(types_.size() + entries);
+}
+
+void DirectoryIndex::Add(const char* name, size_t length, uint8_t type) {
+  if (sorted_ && !offsets_.empty())
+    sorted_ = strcmp(this->name(offsets_.size() - 1), name) < 0;
+  offsets_.push_back(arena_.size());
+  arena_.insert(arena_.end(), name, name + length);
+  arena_.push_back('\0');
+  types_.push_back(type);
+}
+
+void DirectoryIndex::Sort() {
+  if (sorted_)
+    return;
+  std::vector<uint32_t> order(offsets_.size());
+  for (size_t i = 0; i < order.size(); ++i)
+    order[i] = i;
+  std::sort(order.begin(), order.end(), NameLess(this));
+
+  // Lay the names out again in the new order, so that each name still ends
+  // where the next one starts.
+  std::vector<char> arena;
+  std::vector<uint32_t> offsets;
+  std::vector<uint8_t> types;
+  arena.reserve(arena_.size());
+  offsets.reserve(offsets_.size());
+  types.reserve(types_.size());
+  for (size_t i = 0; i < order.size(); ++i) {
+    const char* name = this->name(order[i]);
+    offsets.push_back(arena.size());
+    arena.insert(arena.end(), name, name + length(order[i]) + 1);
+    types.push_back(types_[order[i]]);
+  }
+  arena_.swap(arena);
+  offsets_.swap(offsets);
+  types_.swap(types);
+  sorted_ = true;
+}
+
+ssize_t DirectoryIndex::Find(const char* name) const {
+  if (!sorted_) {
+    for (size_t i = 0; i < offsets_.size(); ++i) {
+      if (!strcmp(this->name(i), name))
+        return i;
+    }
+    return -1;
+  }
+  size_t low = 0;
+  size_t high = offsets_.size();
+  while (low < high) {
+    size_t middle = low + (high - low) / 2;
+    int result = strcmp(this->name(middle), name);
+    if (!result)
+      return middle;
+    if (result < 0)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  return -1;
+}
+
+void DirectoryIndex::Clear() {
+  arena_.clear();
+  offsets_.clear();
+  types_.clear();
+  sorted_ = true;
+}
+
+}  // namespace naclfs
@@ -0,0 +1,88 @@
+//
+// Copyright (c) 2012, Takashi TOYOSHIMA <toyoshim@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// - Neither the name of the authors nor the names of its contributors may be
+//   used to endorse or promote products derived from this software with out
+//   specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUE
+// NTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+// GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.
+//
+
+#ifndef NACLFS_DIRECTORY_INDEX_H_
+#define NACLFS_DIRECTORY_INDEX_H_
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <vector>
+
+namespace naclfs {
+
+// Names and types of the entries of one directory, kept compact for huge
+// directories. Names are stored back to back with their terminating NUL in
+// a single arena and are addressed by offset, so an entry costs a few bytes
+// more than its name and adding entries allocates only when the arrays
+// grow. Entries are addressed by position, which makes telldir() and
+// seekdir() positions plain indices.
+class DirectoryIndex {
+ public:
+  DirectoryIndex();
+  ~DirectoryIndex();
+
+  // Prepares for |entries| more entries with |bytes| of names in total.
+  void Reserve(size_t entries, size_t bytes);
+  void Add(const char* name, size_t length, uint8_t type);
+  // Orders entries by name so that Find() can use binary search. Positions
+  // taken before are invalidated. Adding entries drops the order.
+  void Sort();
+  // Returns the position of |name|, or -1 if there is no such entry.
+  ssize_t Find(const char* name) const;
+  void Clear();
+
+  size_t size() const { return offsets_.size(); }
+  bool sorted() const { return sorted_; }
+  const char* name(size_t index) const { return &arena_[offsets_[index]]; }
+  // Names are laid out in position order, so a name ends where the next
+  // one starts.
+  size_t length(size_t index) const {
+    size_t end = index + 1 < offsets_.size() ? offsets_[index + 1] :
+                                               arena_.size();
+    return end - offsets_[index] - 1;
+  }
+  uint8_t type(size_t index) const { return types_[index]; }
+
+ private:
+  struct NameLess;
+
+  std::vector<char> arena_;
+  std::vector<uint32_t> offsets_;
+  std::vector<uint8_t> types_;
+  bool sorted_;
+};
+
+}  // namespace naclfs
+
+#endif  // NACLFS_DIRECTORY_INDEX_H_
@@ -31,30 +31,84 @@
 
 #include "filesystem.h"
 
+#include <fcntl.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <string.h>
+#include <sys/param.h>
 
 #include <sstream>
 #include <vector>
 
+#include "descriptor_table.h"
 #include "html5_filesystem.h"
+#include "mem_filesystem.h"
+#include "memory_map.h"
+#include "mount_table.h"
 #include "naclfs.h"
+#include "negative_cache.h"
+#include "path.h"
 #include "port_filesystem.h"
+#include "ppapi/c/pp_errors.h"
 #include "ppapi/cpp/completion_callback.h"
 #include "ppapi/cpp/core.h"
 #include "ppapi/cpp/module.h"
 
+#if !defined(IOV_MAX)
+#  define IOV_MAX 1024
+#endif  // !defined(IOV_MAX)
+
+#if !defined(SSIZE_MAX)
+#  define SSIZE_MAX LONG_MAX
+#endif  // !defined(SSIZE_MAX)
+
+namespace {
+
+// Backend for delegates which keep no state per mount.
+template <class T>
+class StatelessBackend : public naclfs::FileSystem::Backend {
+ public:
+  virtual naclfs::FileSystem::Delegate* CreateDelegate(
+      naclfs::NaClFs* naclfs, const char* mount_point) {
+    return new T(naclfs);
+  }
+};
+
+}  // namespace
+
 namespace naclfs {
 
-static const char kPortFileSystemPrefix[] = "/dev/std";
-static size_t kPortFileSystemPrefixSize = sizeof(kPortFileSystemPrefix) - 1;
+static const char* kPortFileSystemMountPoints[] = {
+  "/dev/stdin",
+  "/dev/stdout",
+  "/dev/stderr"
+};
+static const char kMemFileSystemMountPoint[] = "/tmp";
+static const size_t kDefaultTmpCapacity = 64 * 1024 * 1024;
+static const size_t kDefaultMaxDescriptors = 1024;
+static const size_t kDefaultChunkSize = 1024 * 1024;
+static const size_t kDefaultChunkWindow = 4;
 
 bool FileSystem::Delegate::initialized_ = false;
-pthread_mutex_t FileSystem::Delegate::mutex_ = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t FileSystem::Delegate::cond_ = PTHREAD_COND_INITIALIZER;
 pp::Core* FileSystem::Delegate::core_;
+FileSystem::Delegate::Arguments* volatile FileSystem::Delegate::queue_ = NULL;
+FileSystem::Delegate::Statistics FileSystem::Delegate::statistics_;
+size_t FileSystem::Delegate::chunk_size_ = kDefaultChunkSize;
+size_t FileSystem::Delegate::chunk_window_ = kDefaultChunkWindow;
+
+static void UpdateMax(uint32_t* max, uint32_t value) {
+  for (uint32_t current = *max; current < value; current = *max) {
+    if (__sync_bool_compare_and_swap(max, current, value))
+      break;
+  }
+}
 
-FileSystem::Delegate::Delegate() {
+FileSystem::Delegate::Delegate()
+    : references_(1),
+      active_(0),
+      active_function_(OPEN),
+      backlog_head_(NULL),
+      backlog_tail_(NULL) {
   if (initialized_)
     return;
   initialized_ = true;
@@ -133,6 +187,166 @@ ssize_t FileSystem::Delegate::Write(const void* buf, size_t nbytes) {
   return arguments.result.write;
 }
 
+ssize_t FileSystem::Delegate::PRead(void* buf, size_t nbytes, off_t offset) {
+  if (core_->IsMainThread())
+    return -1;
+  Arguments arguments;
+  arguments.delegate = this;
+  arguments.function = PREAD;
+  arguments.u.pread.buf = buf;
+  arguments.u.pread.nbytes = nbytes;
+  arguments.u.pread.offset = offset;
+  // Local requests have no round trip to overlap.
+  if (chunk_size_ && nbytes > chunk_size_ && !IsLocal(arguments))
+    return Transfer(PREAD, static_cast<char*>(buf), nbytes, offset);
+  Call(arguments);
+  return arguments.result.pread;
+}
+
+ssize_t FileSystem::Delegate::PWrite(const void* buf,
+                                     size_t nbytes,
+                                     off_t offset) {
+  if (core_->IsMainThread())
+    return -1;
+  Arguments arguments;
+  arguments.delegate = this;
+  arguments.function = PWRITE;
+  arguments.u.pwrite.buf = buf;
+  arguments.u.pwrite.nbytes = nbytes;
+  arguments.u.pwrite.offset = offset;
+  if (chunk_size_ && nbytes > chunk_size_ && !IsLocal(arguments)) {
+    return Transfer(PWRITE, const_cast<char*>(static_cast<const char*>(buf)),
+                    nbytes, offset);
+  }
+  Call(arguments);
+  return arguments.result.pwrite;
+}
+
+ssize_t FileSystem::Delegate::Transfer(Function function,
+                                       char* buf,
+                                       size_t nbytes,
+                                       off_t offset) {
+  Arguments probe;
+  probe.function = function;
+  size_t window = chunk_window_;
+  if (!window || !IsConcurrent(probe))
+    window = 1;
+  size_t chunks = (nbytes + chunk_size_ - 1) / chunk_size_;
+  if (window > chunks)
+    window = chunks;
+
+  // Chunk results by index, and one request slot per window entry.
+  std::vector<ssize_t> results(chunks, 0);
+  std::vector<Arguments> slots(window);
+  std::vector<size_t> indices(window);
+  std::vector<Arguments*> idle;
+  for (size_t i = 0; i < window; ++i)
+    idle.push_back(&slots[i]);
+
+  Completion completion;
+  pthread_mutex_init(&completion.mutex, NULL);
+  pthread_cond_init(&completion.cond, NULL);
+  completion.head = NULL;
+  completion.tail = NULL;
+  size_t submitted = 0;
+  size_t inflight = 0;
+  bool stop = false;
+  for (;;) {
+    // Keep the window full until a chunk comes back short.
+    while (!stop && submitted < chunks && !idle.empty()) {
+      Arguments* arguments = idle.back();
+      idle.pop_back();
+      indices[arguments - &slots[0]] = submitted;
+      size_t start = submitted * chunk_size_;
+      size_t size = nbytes - start;
+      if (size > chunk_size_)
+        size = chunk_size_;
+      arguments->function = function;
+      if (function == PREAD) {
+        arguments->u.pread.buf = &buf[start];
+        arguments->u.pread.nbytes = size;
+        arguments->u.pread.offset = offset + start;
+      } else {
+        arguments->u.pwrite.buf = &buf[start];
+        arguments->u.pwrite.nbytes = size;
+        arguments->u.pwrite.offset = offset + start;
+      }
+      submitted++;
+      inflight++;
+      Submit(arguments, &completion);
+    }
+    if (!inflight)
+      break;
+
+    pthread_mutex_lock(&completion.mutex);
+    while (!completion.head)
+      pthread_cond_wait(&completion.cond, &completion.mutex);
+    Arguments* list = completion.head;
+    completion.head = NULL;
+    completion.tail = NULL;
+    pthread_mutex_unlock(&completion.mutex);
+    while (list) {
+      Arguments* arguments = list;
+      list = arguments->next;
+      size_t index = indices[arguments - &slots[0]];
+      size_t size = function == PREAD ? arguments->u.pread.nbytes :
+                                        arguments->u.pwrite.nbytes;
+      results[index] = function == PREAD ? arguments->result.pread :
+                                           arguments->result.pwrite;
+      if (results[index] != static_cast<ssize_t>(size))
+        stop = true;
+      idle.push_back(arguments);
+      inflight--;
+    }
+  }
+  pthread_cond_destroy(&completion.cond);
+  pthread_mutex_destroy(&completion.mutex);
+
+  // Like a single request, report the contiguous prefix which made it.
+  ssize_t total = 0;
+  for (size_t i = 0; i < submitted; ++i) {
+    if (results[i] < 0)
+      return total ? total : -1;
+    total += results[i];
+    if (results[i] != static_cast<ssize_t>(chunk_size_))
+      break;
+  }
+  return total;
+}
+
+ssize_t FileSystem::Delegate::ReadV(const struct iovec* iov, int iovcnt) {
+  if (iovcnt == 1)
+    return Read(iov[0].iov_base, iov[0].iov_len);
+  size_t nbytes = 0;
+  for (int i = 0; i < iovcnt; ++i)
+    nbytes += iov[i].iov_len;
+  std::vector<char> buffer(nbytes + 1);
+  ssize_t result = Read(&buffer[0], nbytes);
+  size_t offset = 0;
+  for (int i = 0; i < iovcnt && result > 0 &&
+       offset < static_cast<size_t>(result); ++i) {
+    size_t size = result - offset;
+    if (size > iov[i].iov_len)
+      size = iov[i].iov_len;
+    memcpy(iov[i].iov_base, &buffer[offset], size);
+    offset += size;
+  }
+  return result;
+}
+
+ssize_t FileSystem::Delegate::WriteV(const struct iovec* iov, int iovcnt) {
+  if (iovcnt == 1)
+    return Write(iov[0].iov_base, iov[0].iov_len);
+  std::vector<char> buffer;
+  for (int i = 0; i < iovcnt; ++i) {
+    const char* base = static_cast<const char*>(iov[i].iov_base);
+    buffer.insert(buffer.end(), base, base + iov[i].iov_len);
+  }
+  if (buffer.empty())
+    return 0;
+  return Write(&buffer[0], buffer.size());
+}
+
 off_t FileSystem::Delegate::Seek(off_t offset, int whence) {
   if (core_->IsMainThread())
     return -1;
@@ -167,6 +381,16 @@ int FileSystem::Delegate::Fcntl(int cmd, va_list* ap) {
   return arguments.result.fcntl;
 }
 
+int FileSystem::Delegate::Fsync() {
+  if (core_->IsMainThread())
+    return EIO;
+  Arguments arguments;
+  arguments.delegate = this;
+  arguments.function = FSYNC;
+  Call(arguments);
+  return arguments.result.fsync;
+}
+
 int FileSystem::Delegate::MkDir(const char* path, mode_t mode) {
   if (core_->IsMainThread())
     return EIO;
@@ -211,6 +435,28 @@ struct dirent* FileSystem::Delegate::ReadDir(DIR* dirp) {
   return arguments.result.readdir;
 }
 
+long FileSystem::Delegate::TellDir(DIR* dirp) {
+  if (core_->IsMainThread())
+    return -1;
+  Arguments arguments;
+  arguments.delegate = this;
+  arguments.function = TELLDIR;
+  arguments.u.telldir.dirp = dirp;
+  Call(arguments);
+  return arguments.result.telldir;
+}
+
+void FileSystem::Delegate::SeekDir(DIR* dirp, long offset) {
+  if (core_->IsMainThread())
+    return;
+  Arguments arguments;
+  arguments.delegate = this;
+  arguments.function = SEEKDIR;
+  arguments.u.seekdir.dirp = dirp;
+  arguments.u.seekdir.offset = offset;
+  Call(arguments);
+}
+
 int FileSystem::Delegate::CloseDir(DIR* dirp) {
   if (core_->IsMainThread())
     return EIO;
@@ -223,25 +469,190 @@ int FileSystem::Delegate::CloseDir(DIR* dirp) {
 }
 
 void FileSystem::Delegate::Call(Arguments& arguments) {
-  callback_ = pp::CompletionCallback(Proxy, &arguments);
-  pthread_mutex_lock(&mutex_);
-  core_->CallOnMainThread(0, pp::CompletionCallback(Proxy, &arguments));
-  pthread_cond_wait(&cond_, &mutex_);
-  pthread_mutex_unlock(&mutex_);
+  if (IsLocal(arguments)) {
+    // Nothing to wait for; skip the completion slot as well.
+    arguments.delegate = this;
+    arguments.result.callback = PP_OK;
+    arguments.chaining = false;
+    arguments.step = 0;
+    Switch(&arguments);
+    return;
+  }
+  Completion completion;
+  pthread_mutex_init(&completion.mutex, NULL);
+  pthread_cond_init(&completion.cond, NULL);
+  completion.head = NULL;
+  completion.tail = NULL;
+  Submit(&arguments, &completion);
+  pthread_mutex_lock(&completion.mutex);
+  while (!arguments.done)
+    pthread_cond_wait(&completion.cond, &completion.mutex);
+  pthread_mutex_unlock(&completion.mutex);
+  pthread_cond_destroy(&completion.cond);
+  pthread_mutex_destroy(&completion.mutex);
 }
 
-void FileSystem::Delegate::Proxy(void* param, int32_t result) {
-  Arguments* arguments = static_cast<Arguments*>(param);
-  arguments->result.callback = result;
+void FileSystem::Delegate::Submit(Arguments* arguments,
+                                  Completion* completion) {
+  arguments->delegate = this;
+  arguments->done = false;
+  arguments->step = 0;
+  arguments->completion = completion;
+  Execute(arguments);
+}
+
+void FileSystem::Delegate::Execute(Arguments* arguments) {
+  if (!IsLocal(*arguments)) {
+    Enqueue(arguments);
+    return;
+  }
+  arguments->result.callback = PP_OK;
   arguments->chaining = false;
-  arguments->delegate->Switch(arguments);
-  if (!arguments->chaining) {
-    pthread_mutex_lock(&mutex_);
-    pthread_cond_signal(&cond_);
-    pthread_mutex_unlock(&mutex_);
+  Switch(arguments);
+  Complete(arguments);
+}
+
+void FileSystem::Delegate::Enqueue(Arguments* arguments) {
+  // Lock-free push onto the submission stack. Only the push which finds the
+  // stack empty schedules a Drain(), so a burst of requests from any number
+  // of threads costs a single main thread wakeup.
+  Arguments* head;
+  do {
+    head = queue_;
+    arguments->next = head;
+  } while (!__sync_bool_compare_and_swap(&queue_, head, arguments));
+  __sync_fetch_and_add(&statistics_.requests, 1);
+  UpdateMax(&statistics_.max_depth,
+            __sync_add_and_fetch(&statistics_.depth, 1));
+  if (!head)
+    core_->CallOnMainThread(0, pp::CompletionCallback(Drain, NULL));
+}
+
+void FileSystem::Delegate::Drain(void* param, int32_t result) {
+  Arguments* stack;
+  do {
+    stack = queue_;
+  } while (!__sync_bool_compare_and_swap(&queue_, stack, NULL));
+
+  // Reverse the stack to run requests in submission order.
+  Arguments* list = NULL;
+  uint32_t count = 0;
+  while (stack) {
+    Arguments* next = stack->next;
+    stack->next = list;
+    list = stack;
+    stack = next;
+    count++;
+  }
+  __sync_fetch_and_add(&statistics_.drains, 1);
+  __sync_fetch_and_sub(&statistics_.depth, count);
+  UpdateMax(&statistics_.max_batch, count);
+
+  while (list) {
+    // Dispatch() may complete the request and release it.
+    Arguments* next = list->next;
+    Dispatch(list);
+    list = next;
   }
 }
 
+void FileSystem::Delegate::Dispatch(Arguments* arguments) {
+  // Requests for a busy delegate wait in its backlog, unless they may join
+  // the requests in flight. Nothing may overtake the backlog, so that a
+  // request never runs before one submitted earlier on the same delegate.
+  Delegate* delegate = arguments->delegate;
+  if (delegate->active_ &&
+      (delegate->backlog_head_ ||
+       arguments->function != delegate->active_function_ ||
+       !delegate->IsConcurrent(*arguments))) {
+    arguments->next = NULL;
+    if (delegate->backlog_tail_)
+      delegate->backlog_tail_->next = arguments;
+    else
+      delegate->backlog_head_ = arguments;
+    delegate->backlog_tail_ = arguments;
+    return;
+  }
+  delegate->active_++;
+  delegate->active_function_ = arguments->function;
+  arguments->next = NULL;
+  Proxy(arguments, PP_OK);
+}
+
+FileSystem::Delegate::Arguments* FileSystem::Delegate::TakeBacklog() {
+  // Starts the head of the backlog, together with the requests behind it
+  // which may run concurrently with it.
+  Arguments* head = backlog_head_;
+  if (!head)
+    return NULL;
+  Arguments* tail = head;
+  active_ = 1;
+  active_function_ = head->function;
+  if (IsConcurrent(*head)) {
+    while (tail->next && tail->next->function == head->function &&
+           IsConcurrent(*tail->next)) {
+      tail = tail->next;
+      active_++;
+    }
+  }
+  backlog_head_ = tail->next;
+  if (!backlog_head_)
+    backlog_tail_ = NULL;
+  tail->next = NULL;
+  return head;
+}
+
+void FileSystem::Delegate::Proxy(void* param, int32_t result) {
+  // Runs |param| and then the requests it unblocks, as a list linked with
+  // |next|, so that a long backlog does not recurse.
+  Arguments* list = static_cast<Arguments*>(param);
+  while (list) {
+    Arguments* arguments = list;
+    list = arguments->next;
+    Delegate* delegate = arguments->delegate;
+    arguments->callback = pp::CompletionCallback(Proxy, arguments);
+    arguments->result.callback = result;
+    arguments->chaining = false;
+    result = PP_OK;
+    delegate->Switch(arguments);
+    if (arguments->chaining) {
+      // Resumed through |callback| as a list of its own.
+      arguments->next = NULL;
+      continue;
+    }
+
+    // Pick the next requests before completing this one, since the caller
+    // may delete an idle delegate as soon as it is woken up.
+    Arguments* ready = NULL;
+    if (!--delegate->active_)
+      ready = delegate->TakeBacklog();
+    Complete(arguments);
+    if (ready) {
+      Arguments* tail = ready;
+      while (tail->next)
+        tail = tail->next;
+      tail->next = list;
+      list = ready;
+    }
+  }
+}
+
+void FileSystem::Delegate::Complete(Arguments* arguments) {
+  // The waiter may release |arguments| as soon as the mutex is unlocked, so
+  // it must not be touched after that.
+  Completion* completion = arguments->completion;
+  pthread_mutex_lock(&completion->mutex);
+  arguments->done = true;
+  arguments->next = NULL;
+  if (completion->tail)
+    completion->tail->next = arguments;
+  else
+    completion->head = arguments;
+  completion->tail = arguments;
+  pthread_cond_broadcast(&completion->cond);
+  pthread_mutex_unlock(&completion->mutex);
+}
+
 void FileSystem::Delegate::Switch(Arguments* arguments) {
   switch (arguments->function) {
     case OPEN:
@@ -278,6 +689,20 @@ void FileSystem::Delegate::Switch(Arguments* arguments) {
                                          arguments->u.write.buf,
                                          arguments->u.write.nbytes);
       break;
+    case PREAD:
+      arguments->result.pread =
+          arguments->delegate->PReadCall(arguments,
+                                         arguments->u.pread.buf,
+                                         arguments->u.pread.nbytes,
+                                         arguments->u.pread.offset);
+      break;
+    case PWRITE:
+      arguments->result.pwrite =
+          arguments->delegate->PWriteCall(arguments,
+                                          arguments->u.pwrite.buf,
+                                          arguments->u.pwrite.nbytes,
+                                          arguments->u.pwrite.offset);
+      break;
     case SEEK:
       arguments->result.seek =
           arguments->delegate->SeekCall(arguments,
@@ -294,6 +719,9 @@ void FileSystem::Delegate::Switch(Arguments* arguments) {
                                          arguments->u.fcntl.cmd,
                                          arguments->u.fcntl.ap);
       break;
+    case FSYNC:
+      arguments->result.fsync = arguments->delegate->FsyncCall(arguments);
+      break;
     case MKDIR:
       arguments->result.mkdir =
           arguments->delegate->MkDirCall(arguments,
@@ -314,6 +742,16 @@ void FileSystem::Delegate::Switch(Arguments* arguments) {
           arguments->delegate->ReadDirCall(arguments,
                                            arguments->u.readdir.dirp);
       break;
+    case TELLDIR:
+      arguments->result.telldir =
+          arguments->delegate->TellDirCall(arguments,
+                                           arguments->u.telldir.dirp);
+      break;
+    case SEEKDIR:
+      arguments->delegate->SeekDirCall(arguments,
+                                       arguments->u.seekdir.dirp,
+                                       arguments->u.seekdir.offset);
+      break;
     case CLOSEDIR:
       arguments->result.closedir =
           arguments->delegate->CloseDirCall(arguments,
@@ -322,140 +760,338 @@ void FileSystem::Delegate::Switch(Arguments* arguments) {
   }
 }
 
-FileSystem::FileSystem(NaClFs* naclfs) : naclfs_(naclfs) {
+FileSystem::FileSystem(NaClFs* naclfs)
+    : descriptors_(new DescriptorTable(kDefaultMaxDescriptors)),
+      negatives_(new NegativeCache),
+      mounts_(new MountTable),
+      tmp_volume_(new MemVolume(kDefaultTmpCapacity)),
+      naclfs_(naclfs) {
   pthread_mutex_init(&mutex_, NULL);
   pthread_mutex_lock(&mutex_);
   core_ = pp::Module::Get()->core();
-  // Current path which doesn't contain the first slash.
-  // E.g., "" means "/".
-  cwd_ = "";
+  mounts_->Mount("/", new StatelessBackend<Html5FileSystem>, 0);
+  for (size_t i = 0; i < sizeof(kPortFileSystemMountPoints) /
+                         sizeof(kPortFileSystemMountPoints[0]); ++i) {
+    mounts_->Mount(kPortFileSystemMountPoints[i],
+                   new StatelessBackend<PortFileSystem>, 0);
+  }
+  // Keep a reference for tmp_volume() in case /tmp is unmounted.
+  tmp_volume_->AddRef();
+  mounts_->Mount(kMemFileSystemMountPoint, tmp_volume_, 0);
+  // Current path is kept normalized so that CreateFullpath() can use it as
+  // is for relative paths.
+  strcpy(cwd_, "/");
+  cwd_length_ = 1;
 }
 
 FileSystem::~FileSystem() {
   pthread_mutex_destroy(&mutex_);
+  tmp_volume_->Release();
+  delete mounts_;
+  delete negatives_;
+  delete descriptors_;
 }
 
 int FileSystem::Open(const char* path, int oflag, mode_t cmode, int* newfd) {
   if (!path)
     return EFAULT;
-  std::string fullpath;
-  CreateFullpath(path, &fullpath);
-  Delegate* delegate = CreateDelegate(fullpath.c_str());
+  char fullpath[MAXPATHLEN];
+  if (CreateFullpath(path, fullpath))
+    return ENAMETOOLONG;
+  if (oflag & O_CREAT)
+    negatives_->Invalidate(fullpath);
+  else if (negatives_->Lookup(fullpath))
+    return ENOENT;
+  int flags;
+  Delegate* delegate = CreateDelegate(fullpath, &flags);
   if (!delegate) {
     naclfs_->Log("FileSystem: can not create delegate\n");
     return ENODEV;
   }
-  int result = delegate->Open(fullpath.c_str(), oflag, cmode);
+  if ((flags & MOUNT_READ_ONLY) && IsModifyingOpen(oflag)) {
+    delegate->Release();
+    return EROFS;
+  }
+  int result = delegate->Open(fullpath, oflag, cmode);
   if (result) {
-    delete delegate;
+    if (result == ENOENT && !(oflag & O_CREAT))
+      negatives_->Insert(fullpath);
+    delegate->Release();
     return result;
   }
-  *newfd = BindToDescriptor(delegate);
+  // A stat() which raced with the create may have recorded the path again.
+  if (oflag & O_CREAT)
+    negatives_->Invalidate(fullpath);
+  int fildes = BindToDescriptor(delegate);
+  if (fildes < 0) {
+    delegate->Close();
+    delegate->Release();
+    return EMFILE;
+  }
+  *newfd = fildes;
   return 0;
 }
 
 int FileSystem::Stat(const char* path, struct stat* buf) {
-  std::string fullpath;
-  CreateFullpath(path, &fullpath);
-  Delegate* delegate = CreateDelegate(fullpath.c_str());
+  char fullpath[MAXPATHLEN];
+  if (CreateFullpath(path, fullpath))
+    return ENAMETOOLONG;
+  if (negatives_->Lookup(fullpath))
+    return ENOENT;
+  Delegate* delegate = CreateDelegate(fullpath, NULL);
   if (!delegate) {
     naclfs_->Log("FileSystem: can not create delegate\n");
     return EBADF;
   }
-  int result = delegate->Stat(fullpath.c_str(), buf);
-  delete delegate;
+  int result = delegate->Stat(fullpath, buf);
+  if (result == ENOENT)
+    negatives_->Insert(fullpath);
+  delegate->Release();
   return result;
 }
 
 int FileSystem::Close(int fildes) {
-  Delegate* delegate = GetDelegate(fildes);
+  // Take the descriptor over before closing, so that a concurrent close()
+  // gets EBADF, and a descriptor reused meanwhile is not unbound.
+  Delegate* delegate = UnbindDescriptor(fildes);
   if (!delegate)
     return EBADF;
   int result = delegate->Close();
-  if (result != 0)
-    return result;
-  DeleteDescriptor(fildes);
+  delegate->Release();
   return result;
 }
 
 int FileSystem::Fstat(int fildes, struct stat* buf) {
-  Delegate* delegate = GetDelegate(fildes);
+  Delegate* delegate = AcquireDelegate(fildes);
   if (!delegate)
     return EBADF;
-  return delegate->Fstat(buf);
+  int result = delegate->Fstat(buf);
+  delegate->Release();
+  return result;
 }
 
 ssize_t FileSystem::Read(int fildes, void* buf, size_t nbytes) {
-  Delegate* delegate = GetDelegate(fildes);
+  Delegate* delegate = AcquireDelegate(fildes);
   if (!delegate)
     return -1;
+  ssize_t result;
   for (;;) {
     // TODO: Move lock related code into PortFileSystem.
     // Shoud remove magic number -2 for blocking.
-    ssize_t result = delegate->Read(buf, nbytes);
+    result = delegate->Read(buf, nbytes);
     if (result != -2)
-      return result;
+      break;
     pthread_mutex_lock(&mutex_);
   }
-  return 0;
+  delegate->Release();
+  return result;
 }
 
 ssize_t FileSystem::Write(int fildes, const void* buf, size_t nbytes) {
-  Delegate* delegate = GetDelegate(fildes);
+  Delegate* delegate = AcquireDelegate(fildes);
   if (!delegate)
     return -1;
-  return delegate->Write(buf, nbytes);
+  ssize_t result = delegate->Write(buf, nbytes);
+  delegate->Release();
+  return result;
+}
+
+ssize_t FileSystem::PRead(int fildes, void* buf, size_t nbytes, off_t offset) {
+  if (offset < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  Delegate* delegate = AcquireDelegate(fildes);
+  if (!delegate) {
+    errno = EBADF;
+    return -1;
+  }
+  int saved_errno = errno;
+  errno = 0;
+  ssize_t result = delegate->PRead(buf, nbytes, offset);
+  delegate->Release();
+  if (result >= 0)
+    errno = saved_errno;
+  else if (!errno)
+    errno = EIO;
+  return result;
+}
+
+ssize_t FileSystem::PWrite(int fildes,
+                           const void* buf,
+                           size_t nbytes,
+                           off_t offset) {
+  if (offset < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  Delegate* delegate = AcquireDelegate(fildes);
+  if (!delegate) {
+    errno = EBADF;
+    return -1;
+  }
+  // Delegates which run on the calling thread may report a precise error,
+  // such as ENOSPC, through errno.
+  int saved_errno = errno;
+  errno = 0;
+  ssize_t result = delegate->PWrite(buf, nbytes, offset);
+  delegate->Release();
+  if (result >= 0)
+    errno = saved_errno;
+  else if (!errno)
+    errno = EIO;
+  return result;
+}
+
+ssize_t FileSystem::ReadV(int fildes, const struct iovec* iov, int iovcnt) {
+  if (!IsValidIoVec(iov, iovcnt)) {
+    errno = EINVAL;
+    return -1;
+  }
+  Delegate* delegate = AcquireDelegate(fildes);
+  if (!delegate) {
+    errno = EBADF;
+    return -1;
+  }
+  int saved_errno = errno;
+  errno = 0;
+  ssize_t result = delegate->ReadV(iov, iovcnt);
+  delegate->Release();
+  if (result >= 0)
+    errno = saved_errno;
+  else if (!errno)
+    errno = EIO;
+  return result;
+}
+
+ssize_t FileSystem::WriteV(int fildes, const struct iovec* iov, int iovcnt) {
+  if (!IsValidIoVec(iov, iovcnt)) {
+    errno = EINVAL;
+    return -1;
+  }
+  Delegate* delegate = AcquireDelegate(fildes);
+  if (!delegate) {
+    errno = EBADF;
+    return -1;
+  }
+  int saved_errno = errno;
+  errno = 0;
+  ssize_t result = delegate->WriteV(iov, iovcnt);
+  delegate->Release();
+  if (result >= 0)
+    errno = saved_errno;
+  else if (!errno)
+    errno = EIO;
+  return result;
 }
 
 off_t FileSystem::Seek(int fildes, off_t offset, int whence) {
-  Delegate* delegate = GetDelegate(fildes);
+  Delegate* delegate = AcquireDelegate(fildes);
   if (!delegate)
     return -1;
-  return delegate->Seek(offset, whence);
+  off_t result = delegate->Seek(offset, whence);
+  delegate->Release();
+  return result;
 }
 
 int FileSystem::IsATty(int fildes) {
-  Delegate* delegate = GetDelegate(fildes);
+  Delegate* delegate = AcquireDelegate(fildes);
   if (!delegate)
     return EBADF;
-  return delegate->IsATty();
+  int result = delegate->IsATty();
+  delegate->Release();
+  return result;
 }
 
 int FileSystem::Fcntl(int fildes, int cmd, va_list* ap) {
-  Delegate* delegate = GetDelegate(fildes);
+  Delegate* delegate = AcquireDelegate(fildes);
+  if (!delegate)
+    return EBADF;
+  int result = delegate->Fcntl(cmd, ap);
+  delegate->Release();
+  return result;
+}
+
+int FileSystem::Fsync(int fildes) {
+  Delegate* delegate = AcquireDelegate(fildes);
+  if (!delegate)
+    return EBADF;
+  int result = delegate->Fsync();
+  delegate->Release();
+  return result;
+}
+
+int FileSystem::MMap(int fildes,
+                     void* addr,
+                     size_t len,
+                     int prot,
+                     int flags,
+                     off_t offset) {
+  Delegate* delegate = AcquireDelegate(fildes);
   if (!delegate)
     return EBADF;
-  return delegate->Fcntl(cmd, ap);
+  int result = MemoryMap::GetInstance()->Map(
+      delegate, addr, len, prot, flags, offset);
+  delegate->Release();
+  return result;
+}
+
+int FileSystem::MUnmap(void* addr, size_t len) {
+  // Called for every munmap(), most of which are for the heap.
+  if (MemoryMap::empty())
+    return 0;
+  return MemoryMap::GetInstance()->Unmap(addr, len);
+}
+
+int FileSystem::MSync(void* addr, size_t len, int flags) {
+  if (MemoryMap::empty())
+    return 0;
+  return MemoryMap::GetInstance()->Sync(addr, len, flags);
 }
 
 int FileSystem::MkDir(const char* path, mode_t mode) {
   if (!path)
     return -1;
-  std::string fullpath;
-  CreateFullpath(path, &fullpath);
-  Delegate* delegate = CreateDelegate(fullpath.c_str());
+  char fullpath[MAXPATHLEN];
+  if (CreateFullpath(path, fullpath)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  negatives_->Invalidate(fullpath);
+  int flags;
+  Delegate* delegate = CreateDelegate(fullpath, &flags);
   if (!delegate) {
     naclfs_->Log("FileSystem: can not create delegate\n");
     return -1;
   }
-  int result = delegate->MkDir(fullpath.c_str(), mode);
-  delete delegate;
+  if (flags & MOUNT_READ_ONLY) {
+    delegate->Release();
+    errno = EROFS;
+    return -1;
+  }
+  int result = delegate->MkDir(fullpath, mode);
+  delegate->Release();
+  if (!result)
+    negatives_->Invalidate(fullpath);
   return result;
 }
 
 DIR* FileSystem::OpenDir(const char* dirname) {
   if (!dirname)
     return NULL;
-  std::string fullpath;
-  CreateFullpath(dirname, &fullpath);
-  Delegate* delegate = CreateDelegate(fullpath.c_str());
+  char fullpath[MAXPATHLEN];
+  if (CreateFullpath(dirname, fullpath)) {
+    errno = ENAMETOOLONG;
+    return NULL;
+  }
+  Delegate* delegate = CreateDelegate(fullpath, NULL);
   if (!delegate) {
     naclfs_->Log("FileSystem: can not create delegate\n");
     return NULL;
   }
-  DIR* result = delegate->OpenDir(fullpath.c_str());
+  DIR* result = delegate->OpenDir(fullpath);
   if (!result)
-    delete delegate;
+    delegate->Release();
   return result;
 }
 
@@ -473,13 +1109,27 @@ struct dirent* FileSystem::ReadDir(DIR* dirp) {
   return delegate->ReadDir(dirp);
 }
 
+long FileSystem::TellDir(DIR* dirp) {
+  Delegate* delegate = reinterpret_cast<Dir*>(dirp)->delegate();
+  if (!delegate)
+    return -1;
+  return delegate->TellDir(dirp);
+}
+
+void FileSystem::SeekDir(DIR* dirp, long offset) {
+  Delegate* delegate = reinterpret_cast<Dir*>(dirp)->delegate();
+  if (!delegate)
+    return;
+  delegate->SeekDir(dirp, offset);
+}
+
 int FileSystem::CloseDir(DIR* dirp) {
   Delegate* delegate = reinterpret_cast<Dir*>(dirp)->delegate();
   if (!delegate)
     return -1;
   int result = delegate->CloseDir(dirp);
   if (!result)
-    delete delegate;
+    delegate->Release();
   return result;
 }
 
@@ -492,9 +1142,11 @@ int FileSystem::ChDir(const char* path) {
     errno = ENOTDIR;
     return -1;
   }
-  std::string fullpath;
-  CreateFullpath(path, &fullpath);
-  cwd_ = fullpath.substr(1);
+  char fullpath[MAXPATHLEN];
+  if (CreateFullpath(path, fullpath))
+    return ENAMETOOLONG;
+  cwd_length_ = strlen(fullpath);
+  memcpy(cwd_, fullpath, cwd_length_ + 1);
   return 0;
 }
 
@@ -503,16 +1155,43 @@ char* FileSystem::GetCwd(char* buf, size_t size) {
     errno = EINVAL;
     return NULL;
   }
-  size_t cwd_size = cwd_.size() + 2;
-  if (size < cwd_size) {
+  if (size <= cwd_length_) {
     errno = ERANGE;
     return NULL;
   }
-  buf[0] = '/';
-  strcpy(&buf[1], cwd_.c_str());
+  memcpy(buf, cwd_, cwd_length_ + 1);
   return buf;
 }
 
+bool FileSystem::SetMaxDescriptors(size_t max) {
+  return descriptors_->SetLimit(max);
+}
+
+int FileSystem::Mount(const char* path, Backend* backend, int flags) {
+  if (!path || !backend)
+    return EFAULT;
+  char fullpath[MAXPATHLEN];
+  if (CreateFullpath(path, fullpath))
+    return ENAMETOOLONG;
+  int result = mounts_->Mount(fullpath, backend, flags);
+  // Paths found missing under the mount point may exist on the new backend.
+  if (!result)
+    negatives_->Invalidate(fullpath);
+  return result;
+}
+
+int FileSystem::Unmount(const char* path) {
+  if (!path)
+    return EFAULT;
+  char fullpath[MAXPATHLEN];
+  if (CreateFullpath(path, fullpath))
+    return ENAMETOOLONG;
+  int result = mounts_->Unmount(fullpath);
+  if (!result)
+    negatives_->Invalidate(fullpath);
+  return result;
+}
+
 bool FileSystem::HandleMessage(const pp::Var& message) {
   std::stringstream ss;
   ss << "HandleMessage: " << message.AsString().c_str();
@@ -525,88 +1204,60 @@ bool FileSystem::HandleMessage(const pp::Var& message) {
   return result;
 }
 
-void FileSystem::CreateFullpath(const char* path, std::string* fullpath) {
-  // Insert current path to a relative path.
-  std::vector<std::string> paths;
-  if (*path != '/' && cwd_.size()) {
-    size_t offset = 0;
-    for (;;) {
-      size_t next_offset = cwd_.find("/", offset);
-      if (next_offset == std::string::npos) {
-        paths.push_back(cwd_.substr(offset));
-        break;
-      }
-      paths.push_back(cwd_.substr(offset, next_offset - offset));
-      offset = next_offset + 1;
-    }
-  }
-
-  // Split path into a string vector.
-  for (const char* caret = path; *caret != 0; ) {
-    const char* delim = index(caret, '/');
-    if (NULL == delim) {
-      paths.push_back(std::string(caret));
-      break;
-    } else {
-      int size = delim - caret;
-      if (size != 0 && !(size == 1 && *caret == '.'))  // Trim '' and '.'.
-        paths.push_back(std::string(caret, size));
-      caret = delim + 1;
-    }
-  }
-
-  // Normalize '..'.
-  for (std::vector<std::string>::iterator iter = paths.begin();
-      iter != paths.end();
-      ++iter) {
-    if (iter->compare(".."))
-      continue;
-    if (iter != paths.begin())
-      paths.erase(iter--);
-    paths.erase(iter--);
-  }
+void FileSystem::GetStatistics(Delegate::Statistics* statistics) {
+  *statistics = Delegate::statistics_;
+}
 
-  // Join paths.
-  if (!paths.size())
-    *fullpath = "/";
-  else for (std::vector<std::string>::iterator iter = paths.begin();
-      iter != paths.end();
-      ++iter) {
-    fullpath->append("/");
-    fullpath->append(*iter);
-  }
+void FileSystem::ConfigureChunkedIO(size_t chunk_size, size_t window) {
+  Delegate::chunk_size_ = window ? chunk_size : 0;
+  Delegate::chunk_window_ = window;
+}
 
+int FileSystem::CreateFullpath(const char* path, char* fullpath) {
+  ssize_t length =
+      NormalizePath(cwd_, cwd_length_, path, fullpath, MAXPATHLEN);
   if (naclfs::NaClFs::trace()) {
     std::stringstream ss;
-    ss << "CreateFullpath from '" << path << "' with cwd '/" << cwd_.c_str()
-       << "' -> '" << fullpath->c_str() << "'" << std::endl;
+    ss << "CreateFullpath from '" << path << "' with cwd '" << cwd_
+       << "' -> '" << (length < 0 ? "(too long)" : fullpath) << "'"
+       << std::endl;
     naclfs_->Log(ss.str().c_str());
   }
+  return length < 0 ? ENAMETOOLONG : 0;
 }
 
-FileSystem::Delegate* FileSystem::CreateDelegate(const char* path) {
-  if (strncmp(path, kPortFileSystemPrefix, kPortFileSystemPrefixSize) == 0)
-    return new PortFileSystem(naclfs_);
-  return new Html5FileSystem(naclfs_);
+FileSystem::Delegate* FileSystem::CreateDelegate(const char* path,
+                                                 int* flags) {
+  return mounts_->CreateDelegate(naclfs_, path, flags);
+}
+
+bool FileSystem::IsValidIoVec(const struct iovec* iov, int iovcnt) {
+  if (!iov || iovcnt <= 0 || iovcnt > IOV_MAX)
+    return false;
+  // The total must fit in the returned ssize_t.
+  size_t total = 0;
+  for (int i = 0; i < iovcnt; ++i) {
+    if (iov[i].iov_len > static_cast<size_t>(SSIZE_MAX) - total)
+      return false;
+    total += iov[i].iov_len;
+  }
+  return true;
+}
+
+bool FileSystem::IsModifyingOpen(int oflag) {
+  return (oflag & O_ACCMODE) != O_RDONLY || (oflag & (O_CREAT | O_TRUNC));
 }
 
 int FileSystem::BindToDescriptor(Delegate* delegate) {
-  descriptors_.push_back(delegate);
-  return descriptors_.size() - 1;
+  return descriptors_->Bind(delegate);
 }
 
-FileSystem::Delegate* FileSystem::GetDelegate(int fildes) {
-  if (fildes < 0 || descriptors_.size() <= (uint)fildes)
-    return NULL;
-  return descriptors_[fildes];
+FileSystem::Delegate* FileSystem::AcquireDelegate(int fildes) {
+  return descriptors_->Acquire(fildes);
 }
 
-void FileSystem::DeleteDescriptor(int fildes) {
-  Delegate* delegate = GetDelegate(fildes);
-  if (NULL == delegate)
-    return;
-  delete delegate;
-  descriptors_[fildes] = NULL;
+FileSystem::Delegate* FileSystem::UnbindDescriptor(int fildes) {
+  return descriptors_->Unbind(fildes);
 }
 
 }  // namespace naclfs
@@ -35,13 +35,13 @@
 
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <sys/param.h>
 #include <sys/stat.h>
-
-#include <string>
-#include <vector>
+#include <sys/uio.h>
 
 #include "ppapi/cpp/completion_callback.h"
 
@@ -54,7 +54,11 @@ class Var;
 
 namespace naclfs {
 
+class DescriptorTable;
+class MemVolume;
+class MountTable;
 class NaClFs;
+class NegativeCache;
 
 class FileSystem {
  public:
@@ -67,19 +71,44 @@ class FileSystem {
       FSTAT,
       READ,
       WRITE,
+      PREAD,
+      PWRITE,
       SEEK,
       ISATTY,
       FCNTL,
+      FSYNC,
       MKDIR,
       OPENDIR,
       REWINDDIR,
       READDIR,
+      TELLDIR,
+      SEEKDIR,
       CLOSEDIR
     };  // enum Function
+    struct _Arguments;
+    // Completion slot which requests report to. A blocking call owns a slot
+    // for its single request, while an IoQueue shares one slot among all
+    // requests it has in flight. Completed requests are appended to the
+    // |head|/|tail| list in completion order.
+    struct Completion {
+      pthread_mutex_t mutex;
+      pthread_cond_t cond;
+      struct _Arguments* head;
+      struct _Arguments* tail;
+    };
     typedef struct _Arguments {
       enum Function function;
       Delegate* delegate;
       bool chaining;
+      bool done;
+      // Main thread only. Progress of a chained request, zero on the first
+      // call, and the callback which resumes it.
+      int step;
+      pp::CompletionCallback callback;
+      Completion* completion;
+      // Link for the main thread submission queue, the per delegate backlog,
+      // and finally the completion list.
+      struct _Arguments* next;
       union {
         struct {
           const char* path;
@@ -101,6 +130,16 @@ class FileSystem {
           const void* buf;
           size_t nbytes;
         } write;
+        struct {
+          void* buf;
+          size_t nbytes;
+          off_t offset;
+        } pread;
+        struct {
+          const void* buf;
+          size_t nbytes;
+          off_t offset;
+        } pwrite;
         struct {
           off_t offset;
           int whence;
@@ -122,6 +161,13 @@ class FileSystem {
         struct {
           DIR* dirp;
         } readdir;
+        struct {
+          DIR* dirp;
+        } telldir;
+        struct {
+          DIR* dirp;
+          long offset;
+        } seekdir;
         struct {
           DIR* dirp;
         } closedir;
@@ -134,32 +180,80 @@ class FileSystem {
         int fstat;
         ssize_t read;
         ssize_t write;
+        ssize_t pread;
+        ssize_t pwrite;
         off_t seek;
         int isatty;
         int fcntl;
+        int fsync;
         int mkdir;
         DIR* opendir;
         struct dirent* readdir;
+        long telldir;
         int closedir;
       } result;
     } Arguments;
 
    public:
+    // Counters for the main thread submission queue. |requests| / |drains|
+    // gives the average number of requests handled per main thread wakeup.
+    struct Statistics {
+      uint32_t requests;
+      uint32_t drains;
+      uint32_t max_batch;
+      uint32_t depth;
+      uint32_t max_depth;
+    };
+
     Delegate();
     virtual ~Delegate() {}
+
+    // Delegates are reference counted so that a descriptor can be closed
+    // while other threads still use it. A new delegate has one reference.
+    void AddRef() { __sync_fetch_and_add(&references_, 1); }
+    void Release() {
+      if (!__sync_sub_and_fetch(&references_, 1))
+        delete this;
+    }
+
     virtual int Open(const char* path, int oflag, mode_t cmode);
     virtual int Stat(const char* path, struct stat* buf);
+    // Fills |buf| for |path| from metadata the delegate caches, on the
+    // calling thread. Returns false if a STAT request is needed.
+    virtual bool StatCached(const char* path, struct stat* buf) {
+      return false;
+    }
     virtual int Close();
     virtual int Fstat(struct stat* buf);
     virtual ssize_t Read(void* buf, size_t nbytes);
     virtual ssize_t Write(const void* buf, size_t nbytes);
+    // Reads at |offset| without moving the file offset. Transfers larger
+    // than the chunk size run as a window of concurrent chunk requests on
+    // delegates which allow it.
+    virtual ssize_t PRead(void* buf, size_t nbytes, off_t offset);
+    virtual ssize_t PWrite(const void* buf, size_t nbytes, off_t offset);
+    // Vectored I/O through a bounce buffer, so that an array costs one
+    // Read() or Write().
+    virtual ssize_t ReadV(const struct iovec* iov, int iovcnt);
+    virtual ssize_t WriteV(const struct iovec* iov, int iovcnt);
     virtual off_t Seek(off_t offset, int whence);
     virtual int IsATty();
     virtual int Fcntl(int cmd, va_list* ap);
+    // Makes data written so far durable. Delegates which buffer writes
+    // override this to write the buffer out first.
+    virtual int Fsync();
+    // Writes out data buffered for the file on the calling thread, so that
+    // requests run on the main thread see it. Returns 0 or an errno value.
+    virtual int WriteBack() { return 0; }
+    // Returns the O_ACCMODE part of the flags the file was opened with.
+    // Delegates which do not keep it allow any access.
+    virtual int AccessMode() { return O_RDWR; }
     virtual int MkDir(const char* path, mode_t mode);
     virtual DIR* OpenDir(const char* dirname);
     virtual void RewindDir(DIR* dirp);
     virtual struct dirent* ReadDir(DIR* dirp);
+    virtual long TellDir(DIR* dirp);
+    virtual void SeekDir(DIR* dirp, long offset);
     virtual int CloseDir(DIR* dirp);
 
     virtual int OpenCall(Arguments* arguments,
@@ -178,6 +272,14 @@ class FileSystem {
     virtual ssize_t WriteCall(Arguments* arguments,
                               const void* buf,
                               size_t nbytes) { return -1; }
+    virtual ssize_t PReadCall(Arguments* arguments,
+                              void* buf,
+                              size_t nbytes,
+                              off_t offset) { return -1; }
+    virtual ssize_t PWriteCall(Arguments* arguments,
+                               const void* buf,
+                               size_t nbytes,
+                               off_t offset) { return -1; }
     virtual off_t SeekCall(Arguments* arguments,
                            off_t offset,
                            int whence) { return -1; }
@@ -185,6 +287,7 @@ class FileSystem {
     virtual int FcntlCall(Arguments* arguments,
                           int cmd,
                           va_list* ap) { return -1; }
+    virtual int FsyncCall(Arguments* arguments) { return ENOSYS; }
     virtual int MkDirCall(Arguments* arguments,
                           const char* path,
                           mode_t mode) { return -1; }
@@ -193,20 +296,65 @@ class FileSystem {
     virtual void RewindDirCall(Arguments* arguments, DIR* dirp) {}
     virtual struct dirent* ReadDirCall(Arguments* arguments,
                                        DIR* dirp) { return NULL; }
+    virtual long TellDirCall(Arguments* arguments, DIR* dirp) { return -1; }
+    virtual void SeekDirCall(Arguments* arguments, DIR* dirp, long offset) {}
     virtual int CloseDirCall(Arguments* arguments, DIR* dirp) { return -1; }
 
    protected:
-    pp::CompletionCallback callback_;
+    // Returns true if |arguments| only touches state owned by the delegate
+    // and can run on the calling thread without a main thread round trip.
+    // Local requests may run while a main thread request on the same
+    // delegate is in flight, so state shared with it must be locked.
+    virtual bool IsLocal(const Arguments& arguments) const { return false; }
+
+    // Returns true if |arguments| may run on the main thread while other
+    // requests for the same function are in flight on this delegate. Such
+    // requests must keep their progress in |step| and |callback| only.
+    virtual bool IsConcurrent(const Arguments& arguments) const {
+      return false;
+    }
+
+    // Starts |arguments|. The default implementation runs local requests in
+    // place and the others on the main thread. Delegates which serve
+    // requests without PPAPI may override this to run them in place and
+    // report with Complete().
+    virtual void Execute(Arguments* arguments);
+    static void Complete(Arguments* arguments);
 
    private:
     void Call(Arguments& arguments);
+    void Submit(Arguments* arguments, Completion* completion);
+    static void Enqueue(Arguments* arguments);
+    static void Drain(void* param, int32_t result);
+    static void Dispatch(Arguments* arguments);
     static void Proxy(void* param, int32_t result);
     static void Switch(Arguments* arguments);
+    Arguments* TakeBacklog();
+    // Runs a PREAD or PWRITE of |nbytes| at |offset| as chunk requests, and
+    // returns the bytes transferred up to the first short or failed chunk.
+    ssize_t Transfer(Function function, char* buf, size_t nbytes,
+                     off_t offset);
 
     static bool initialized_;
-    static pthread_mutex_t mutex_;
-    static pthread_cond_t cond_;
     static pp::Core* core_;
+    static Arguments* volatile queue_;
+    static Statistics statistics_;
+    static size_t chunk_size_;
+    static size_t chunk_window_;
+
+    volatile int32_t references_;
+
+    // Main thread only. The number of requests in flight, all for
+    // |active_function_|, and the requests which wait for them. A delegate
+    // runs one request at a time unless IsConcurrent() allows more.
+    uint32_t active_;
+    Function active_function_;
+    Arguments* backlog_head_;
+    Arguments* backlog_tail_;
+
+    friend class FileSystem;
+    friend class IoQueue;
+    friend class TreeWalk;
   };  // class FileSystem::Delegate
 
   class Dir {
@@ -220,6 +368,35 @@ class FileSystem {
     Delegate* delegate_;
   };  // class FileSystem::Dir
 
+  // A file system which can be mounted into the tree. Backends are reference
+  // counted like delegates. A new backend has one reference, the mount table
+  // keeps it while it is mounted, and delegates may take more to keep per
+  // mount state alive.
+  class Backend {
+   public:
+    Backend() : references_(1) {}
+    virtual ~Backend() {}
+
+    void AddRef() { __sync_fetch_and_add(&references_, 1); }
+    void Release() {
+      if (!__sync_sub_and_fetch(&references_, 1))
+        delete this;
+    }
+
+    // Returns a new delegate for paths under |mount_point|.
+    virtual Delegate* CreateDelegate(NaClFs* naclfs,
+                                     const char* mount_point) = 0;
+
+   private:
+    volatile int32_t references_;
+  };  // class FileSystem::Backend
+
+  // Options for Mount().
+  enum MountFlags {
+    // Opening for write and creating files or directories fail with EROFS.
+    MOUNT_READ_ONLY = 1 << 0
+  };
+
   FileSystem(NaClFs* naclfs);
   ~FileSystem();
 
@@ -229,28 +406,75 @@ class FileSystem {
   int Fstat(int fildes, struct stat* buf);
   ssize_t Read(int fildes, void* buf, size_t nbytes);
   ssize_t Write(int fildes, const void* buf, size_t nbytes);
+  ssize_t PRead(int fildes, void* buf, size_t nbytes, off_t offset);
+  ssize_t PWrite(int fildes, const void* buf, size_t nbytes, off_t offset);
+  ssize_t ReadV(int fildes, const struct iovec* iov, int iovcnt);
+  ssize_t WriteV(int fildes, const struct iovec* iov, int iovcnt);
   off_t Seek(int fildes, off_t offset, int whence);
   int IsATty(int fildes);
   int Fcntl(int fildes, int cmd, va_list* ap);
+  int Fsync(int fildes);
+  // Fills |len| bytes of anonymous memory at |addr| from |offset| of
+  // |fildes| for mmap(). Shared writable mappings are written back by
+  // MSync() and MUnmap(). Return errno values.
+  int MMap(int fildes, void* addr, size_t len, int prot, int flags,
+           off_t offset);
+  static int MUnmap(void* addr, size_t len);
+  static int MSync(void* addr, size_t len, int flags);
   int MkDir(const char* path, mode_t mode);
   DIR* OpenDir(const char* dirname);
   void RewindDir(DIR* dirp);
   struct dirent* ReadDir(DIR* dirp);
+  long TellDir(DIR* dirp);
+  void SeekDir(DIR* dirp, long offset);
   int CloseDir(DIR* dirp);
   int ChDir(const char* path);
   char* GetCwd(char* buf, size_t size);
+  bool SetMaxDescriptors(size_t max);
+  // Mounts |backend| at |path|, which is resolved like any other path, with
+  // MountFlags in |flags|. Takes over the caller's reference on success.
+  // Return errno values.
+  int Mount(const char* path, Backend* backend, int flags);
+  int Unmount(const char* path);
+  NegativeCache* negative_cache() { return negatives_; }
+  // The in-memory volume mounted at /tmp.
+  MemVolume* tmp_volume() { return tmp_volume_; }
 
   static bool HandleMessage(const pp::Var& message);
+  static void GetStatistics(Delegate::Statistics* statistics);
+  // Sets the size of the chunks large positional transfers are split into,
+  // and how many chunks may be in flight at once. Zero disables splitting.
+  static void ConfigureChunkedIO(size_t chunk_size, size_t window);
 
  private:
-  void CreateFullpath(const char* path, std::string* fullpath);
-  Delegate* CreateDelegate(const char* path);
+  // Writes the normalized absolute path for |path| into |fullpath|, which
+  // must have room for MAXPATHLEN bytes. Returns ENAMETOOLONG on overflow.
+  int CreateFullpath(const char* path, char* fullpath);
+  // Creates a delegate for the normalized absolute |path| from the backend
+  // mounted over it, and stores the mount flags into |*flags| unless
+  // |flags| is NULL.
+  Delegate* CreateDelegate(const char* path, int* flags);
+  // Returns true if opening with |oflag| may change the file system.
+  static bool IsModifyingOpen(int oflag);
+  // Returns true if |iovcnt| entries at |iov| may be transferred at once.
+  static bool IsValidIoVec(const struct iovec* iov, int iovcnt);
   int BindToDescriptor(Delegate* delegate);
-  Delegate* GetDelegate(int fildes);
-  void DeleteDescriptor(int fildes);
+  // Returns the delegate bound to |fildes| with a reference held.
+  Delegate* AcquireDelegate(int fildes);
+  // Frees |fildes| and returns its delegate with the table's reference
+  // handed to the caller, or NULL if |fildes| is not bound.
+  Delegate* UnbindDescriptor(int fildes);
+
+  friend class IoQueue;
+  friend class TreeWalk;
 
-  std::vector<Delegate*> descriptors_;
-  std::string cwd_;
+  DescriptorTable* descriptors_;
+  // Paths which a delegate reported as missing.
+  NegativeCache* negatives_;
+  MountTable* mounts_;
+  MemVolume* tmp_volume_;
+  char cwd_[MAXPATHLEN];
+  size_t cwd_length_;
   pthread_mutex_t mutex_;
   pp::Core* core_;
   NaClFs* naclfs_;
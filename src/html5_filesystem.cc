@@ -35,9 +35,13 @@
 #include <sstream>
 #include <stdarg.h>
 #include <string.h>
+#include <sys/time.h>
 #include <unistd.h>
 
+#include "dentry_cache.h"
+#include "directory_index.h"
 #include "naclfs.h"
+#include "page_cache.h"
 #include "ppapi/c/pp_errors.h"
 #include "ppapi/c/ppb_file_io.h"
 #include "ppapi/cpp/completion_callback.h"
@@ -50,6 +54,14 @@
 
 namespace {
 
+// Progress of a request through its chained main thread callbacks, kept in
+// Arguments::step so that requests do not share state in the delegate.
+enum Step {
+  kStart = 0,
+  kWaiting,
+  kQuerying
+};
+
 int PPErrorToErrNo(int pp_error) {
   switch (pp_error) {
    case PP_ERROR_NOACCESS:
@@ -75,24 +87,67 @@ int PPErrorToErrNo(int pp_error) {
   }
 }
 
+void FileInfoToStat(const PP_FileInfo& info, struct stat* buf) {
+  memset(buf, 0, sizeof(struct stat));
+  buf->st_mode = S_IRUSR | S_IWUSR | S_IXUSR |
+                 S_IRGRP | S_IWGRP | S_IXGRP |
+                 S_IROTH | S_IWOTH | S_IXOTH;
+  buf->st_size = info.size;
+  buf->st_atime = info.last_access_time;
+  buf->st_mtime = info.last_modified_time;
+  buf->st_ctime = info.creation_time;
+  buf->st_blksize = 512;  // pseudo value for compatilibity
+  buf->st_blocks = (info.size + 511) >> 9;
+  switch (info.type) {
+    case PP_FILETYPE_REGULAR:
+      buf->st_mode |= S_IFREG;
+      break;
+    case PP_FILETYPE_DIRECTORY:
+      buf->st_mode |= S_IFDIR;
+      break;
+    case PP_FILETYPE_OTHER:
+    default:
+      break;
+  }
+}
+
+// Drops cached metadata of the directory containing |path|, as entries
+// created or removed in it change its modification time.
+void InvalidateParent(const char* path) {
+  const char* slash = strrchr(path, '/');
+  if (!slash)
+    return;
+  std::string parent(path, slash == path ? 1 : slash - path);
+  naclfs::DentryCache::GetInstance()->Invalidate(parent.c_str());
+}
+
 class Html5FileSystemDir
   : public naclfs::FileSystem::Dir,
     private pp::CompletionCallbackFactory<Html5FileSystemDir> {
  public:
   Html5FileSystemDir(naclfs::Html5FileSystem* owner,
+                     pp::FileSystem* filesystem,
+                     const char* path,
                      const pp::FileRef& directory_ref)
     : Dir(owner),
       pp::CompletionCallbackFactory<Html5FileSystemDir>(this),
+      filesystem_(filesystem),
+      path_(path),
       directory_ref_(directory_ref),
       offset_(0),
-      read_(false) {}
+      queries_(0),
+      read_(false) {
+    if (path_.empty() || path_[path_.size() - 1] != '/')
+      path_.push_back('/');
+  }
 
   virtual ~Html5FileSystemDir() {}
 
+  // Fetches the whole listing once. Later calls iterate over it without
+  // PPAPI, so they may run on any thread.
   int32_t ReadDir(const pp::CompletionCallback& cc) {
     if (read_)
       return PP_OK;
-    Rewind();
     int32_t result = directory_ref_.ReadDirectoryEntries(
         NewCallbackWithOutput(&Html5FileSystemDir::OnReadDirectoryEntries));
     if (result == PP_OK_COMPLETIONPENDING)
@@ -101,12 +156,26 @@ class Html5FileSystemDir
   }
 
   struct dirent* ReadDirNext() {
-    if (offset_ >= entries_.size())
+    if (offset_ >= index_.size())
       return NULL;
     memset(&dirent_, 0, sizeof(struct dirent));
-    strncpy(dirent_.d_name, entries_[offset_].c_str(), 256);
-    if (entries_[offset_].length() > 255)
-      dirent_.d_name[255] = 0;
+    size_t length = index_.length(offset_);
+    if (length >= sizeof(dirent_.d_name))
+      length = sizeof(dirent_.d_name) - 1;
+    memcpy(dirent_.d_name, index_.name(offset_), length);
+#if defined(_DIRENT_HAVE_D_TYPE)
+    switch (index_.type(offset_)) {
+      case PP_FILETYPE_REGULAR:
+        dirent_.d_type = DT_REG;
+        break;
+      case PP_FILETYPE_DIRECTORY:
+        dirent_.d_type = DT_DIR;
+        break;
+      default:
+        dirent_.d_type = DT_UNKNOWN;
+        break;
+    }
+#endif  // defined(_DIRENT_HAVE_D_TYPE)
     offset_++;
     return &dirent_;
   }
@@ -115,24 +184,79 @@ class Html5FileSystemDir
     offset_ = 0;
   }
 
+  long Tell() const {
+    return offset_;
+  }
+
+  void Seek(long offset) {
+    offset_ = offset < 0 ? 0 : offset;
+  }
+
+  bool read() const {
+    return read_;
+  }
+
  private:
   void OnReadDirectoryEntries(
       int32_t result, const std::vector<pp::DirectoryEntry>& entries) {
-    if (result == PP_OK) {
-      for (size_t i = 0; i < entries.size(); ++i) {
-        entries_.push_back(entries[i].file_ref().GetName().AsString());
+    if (result != PP_OK) {
+      callback_.RunAndClear(result);
+      return;
+    }
+    index_.Reserve(entries.size(), 0);
+    for (size_t i = 0; i < entries.size(); ++i) {
+      std::string name = entries[i].file_ref().GetName().AsString();
+      index_.Add(name.c_str(), name.size(), entries[i].file_type());
+    }
+    if (naclfs::Html5FileSystem::readdir_sorted())
+      index_.Sort();
+
+    // Fetch metadata for all entries at once, so that stat() on each of
+    // them is served by the dentry cache. The dentry cache may evict the
+    // FileRefs, so they are kept until the queries complete.
+    if (index_.size() <= naclfs::Html5FileSystem::readdir_plus_limit()) {
+      query_refs_.reserve(index_.size());
+      for (size_t i = 0; i < index_.size(); ++i) {
+        query_refs_.push_back(
+            naclfs::DentryCache::GetInstance()->GetFileRef(
+                filesystem_, (path_ + index_.name(i)).c_str()));
+        if (query_refs_.back().Query(NewCallbackWithOutput(
+                &Html5FileSystemDir::OnQuery, i)) == PP_OK_COMPLETIONPENDING) {
+          queries_++;
+        }
       }
+    }
+    if (!queries_) {
+      query_refs_.clear();
       read_ = true;
+      callback_.RunAndClear(PP_OK);
+    }
+  }
+
+  void OnQuery(int32_t result, const PP_FileInfo& info, size_t index) {
+    // A failed query only leaves the entry to a later stat().
+    if (result == PP_OK) {
+      naclfs::DentryCache::GetInstance()->UpdateInfo(
+          (path_ + index_.name(index)).c_str(), info);
     }
-    callback_.RunAndClear(result);
+    if (--queries_)
+      return;
+    query_refs_.clear();
+    read_ = true;
+    callback_.RunAndClear(PP_OK);
   }
 
+  pp::FileSystem* filesystem_;
+  std::string path_;
   pp::FileRef directory_ref_;
+  // Entries whose metadata is being queried.
+  std::vector<pp::FileRef> query_refs_;
   pp::DirectoryEntry entry_;
   pp::CompletionCallback callback_;
   struct dirent dirent_;
-  std::vector<std::string> entries_;
+  naclfs::DirectoryIndex index_;
   size_t offset_;
+  size_t queries_;
   bool read_;
 };
 
@@ -144,20 +268,121 @@ pp::FileSystem* Html5FileSystem::filesystem_ = NULL;
 // TODO: Make JavaScript RPC thread safe. We should have a map for objects
 // and requests.
 Html5FileSystem* Html5FileSystem::rpc_object_ = NULL;
+size_t Html5FileSystem::write_back_size_ = kDefaultWriteBackSize;
+uint32_t Html5FileSystem::write_back_idle_ms_ = kDefaultWriteBackIdleMs;
+size_t Html5FileSystem::readdir_plus_limit_ = 0;
+bool Html5FileSystem::readdir_sorted_ = false;
+pthread_mutex_t Html5FileSystem::flusher_mutex_ = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t Html5FileSystem::flusher_cond_ = PTHREAD_COND_INITIALIZER;
+bool Html5FileSystem::flusher_started_ = false;
+std::deque<Html5FileSystem::PendingFlush> Html5FileSystem::pending_flushes_;
+std::multimap<uint32_t, Html5FileSystem*> Html5FileSystem::dirty_files_;
 
 Html5FileSystem::Html5FileSystem(NaClFs* naclfs)
     : file_ref_(NULL),
       file_io_(NULL),
       naclfs_(naclfs),
-      waiting_(false),
-      querying_(false),
-      offset_(0) {
+      info_valid_(false),
+      access_mode_(O_RDONLY),
+      offset_(0),
+      file_id_(0),
+      read_ahead_(1),
+      sequential_offset_(-1),
+      buffer_offset_(0),
+      buffer_error_(0) {
+  pthread_mutex_init(&offset_mutex_, NULL);
+  pthread_mutex_init(&read_ahead_mutex_, NULL);
+  pthread_mutex_init(&buffer_mutex_, NULL);
 }
 
 Html5FileSystem::~Html5FileSystem() {
   // TODO: Fix memory leaks on file_io_ and file_ref_.
   delete file_io_;
   delete file_ref_;
+  if (file_id_)
+    PageCache::GetInstance()->ReleaseFileId(file_id_);
+  pthread_mutex_destroy(&buffer_mutex_);
+  pthread_mutex_destroy(&read_ahead_mutex_);
+  pthread_mutex_destroy(&offset_mutex_);
+}
+
+int Html5FileSystem::Close() {
+  int error = Flush();
+  int result = Delegate::Close();
+  return result ? result : error;
+}
+
+int Html5FileSystem::Fstat(struct stat* buf) {
+  // The size is queried from the file, so buffered data must be there.
+  int error = Flush();
+  if (error)
+    return error;
+  return Delegate::Fstat(buf);
+}
+
+ssize_t Html5FileSystem::Write(const void* buf, size_t nbytes) {
+  pthread_mutex_lock(&buffer_mutex_);
+  pthread_mutex_lock(&offset_mutex_);
+  off_t offset = offset_;
+  pthread_mutex_unlock(&offset_mutex_);
+  ssize_t result = WriteLocked(buf, nbytes, offset);
+  if (result > 0) {
+    pthread_mutex_lock(&offset_mutex_);
+    offset_ = offset + result;
+    pthread_mutex_unlock(&offset_mutex_);
+  }
+  pthread_mutex_unlock(&buffer_mutex_);
+  return result;
+}
+
+ssize_t Html5FileSystem::PWrite(const void* buf, size_t nbytes, off_t offset) {
+  pthread_mutex_lock(&buffer_mutex_);
+  ssize_t result = WriteLocked(buf, nbytes, offset);
+  pthread_mutex_unlock(&buffer_mutex_);
+  return result;
+}
+
+off_t Html5FileSystem::Seek(off_t offset, int whence) {
+  // A SEEK_END which queries the size needs buffered data in the file.
+  if (whence == SEEK_END && !info_valid_ && Flush())
+    return -1;
+  return Delegate::Seek(offset, whence);
+}
+
+int Html5FileSystem::Fsync() {
+  int error = Flush();
+  if (error)
+    return error;
+  return Delegate::Fsync();
+}
+
+int Html5FileSystem::WriteBack() {
+  // Main thread requests neither see the write-back buffer nor go through
+  // the page cache, so both must match the file.
+  int error = Flush();
+  FlushFile(file_id_, this);
+  return error;
+}
+
+int Html5FileSystem::Flush() {
+  pthread_mutex_lock(&buffer_mutex_);
+  int error = FlushLocked();
+  pthread_mutex_unlock(&buffer_mutex_);
+  return error;
+}
+
+void Html5FileSystem::ConfigureWriteBack(size_t buffer_size,
+                                         uint32_t idle_ms) {
+  write_back_size_ = buffer_size;
+  write_back_idle_ms_ = idle_ms;
+}
+
+void Html5FileSystem::SetReadDirPlus(size_t max_entries) {
+  readdir_plus_limit_ = max_entries;
+}
+
+void Html5FileSystem::SetReadDirSorted(bool sorted) {
+  readdir_sorted_ = sorted;
 }
 
 // TODO: Handle cmode argument.
@@ -168,9 +393,8 @@ int Html5FileSystem::OpenCall(Arguments* arguments,
   if (!filesystem_)
     return Initialize(arguments);
 
-  if (waiting_) {
+  if (arguments->step == kWaiting) {
     // Check FileIO::Open completion result.
-    waiting_ = false;
     if (arguments->result.callback != 0) {
       std::stringstream ss;
       ss << "Html5FileSystem::Open failed internal FileIO::Open completion "
@@ -179,16 +403,21 @@ int Html5FileSystem::OpenCall(Arguments* arguments,
       naclfs_->Log(ss.str().c_str());
       return PPErrorToErrNo(arguments->result.callback);
     }
-    querying_ = true;
+    if (oflag & O_TRUNC)
+      PageCache::GetInstance()->InvalidateFile(file_id_);
+    // The size is fetched lazily on SEEK_END or fstat unless O_APPEND needs
+    // it now, so that plain opens complete in a single callback.
+    if (!(oflag & O_APPEND) || info_valid_)
+      return 0;
+    arguments->step = kQuerying;
     // TODO: Check return value.
-    file_io_->Query(&file_info_, callback_);
+    file_io_->Query(&file_info_, arguments->callback);
     arguments->chaining = true;
     return 0;
   }
 
-  if (querying_) {
+  if (arguments->step == kQuerying) {
     // Check FileIO::Query completion result.
-    querying_ = false;
     if (arguments->result.callback != 0) {
       std::stringstream ss;
       ss << "Html5FileSystem::Open failed internal FileIO::Query completion "
@@ -197,12 +426,25 @@ int Html5FileSystem::OpenCall(Arguments* arguments,
       naclfs_->Log(ss.str().c_str());
       return PPErrorToErrNo(arguments->result.callback);
     }
-    if (oflag & O_APPEND)
-      offset_ = file_info_.size;
+    info_valid_ = true;
+    DentryCache::GetInstance()->UpdateInfo(path, file_info_);
+    offset_ = file_info_.size;
     return 0;
   }
 
-  file_ref_ = new pp::FileRef(*filesystem_, path);
+  path_ = path;
+  file_id_ = PageCache::GetInstance()->GetFileId(path);
+  access_mode_ = oflag & O_ACCMODE;
+  if (oflag & O_CREAT)
+    InvalidateParent(path);
+  if (oflag & (O_CREAT | O_TRUNC))
+    DentryCache::GetInstance()->Invalidate(path);
+  else
+    info_valid_ = DentryCache::GetInstance()->LookupInfo(path, &file_info_);
+  if (info_valid_ && (oflag & O_APPEND))
+    offset_ = file_info_.size;
+  file_ref_ = new pp::FileRef(
+      DentryCache::GetInstance()->GetFileRef(filesystem_, path));
   file_io_ = new pp::FileIO(naclfs_->GetInstance());
   int32_t flags = 0;
   switch (oflag & O_ACCMODE) {
@@ -232,7 +474,7 @@ int Html5FileSystem::OpenCall(Arguments* arguments,
         std::endl;
     naclfs_->Log(ss.str().c_str());
   }
-  int32_t result = file_io_->Open(*file_ref_, flags, callback_);
+  int32_t result = file_io_->Open(*file_ref_, flags, arguments->callback);
   if (result != PP_OK_COMPLETIONPENDING) {
     std::stringstream ss;
     ss << "Html5FileSystem::Open failed internal FileIO::Open with " << result
@@ -240,93 +482,94 @@ int Html5FileSystem::OpenCall(Arguments* arguments,
     naclfs_->Log(ss.str().c_str());
     return PPErrorToErrNo(arguments->result.callback);
   }
-  waiting_ = true;
+  arguments->step = kWaiting;
   arguments->chaining = true;
   return 0;
 }
 
+int Html5FileSystem::Stat(const char* path, struct stat* buf) {
+  if (StatCached(path, buf))
+    return 0;
+  return Delegate::Stat(path, buf);
+}
+
+bool Html5FileSystem::StatCached(const char* path, struct stat* buf) {
+  // Buffered writes drop the cached metadata, and must reach the file
+  // before the size is queried.
+  FlushPath(path);
+  // Serve hot paths from the dentry cache without a main thread round trip.
+  PP_FileInfo info;
+  if (!DentryCache::GetInstance()->LookupInfo(path, &info))
+    return false;
+  FileInfoToStat(info, buf);
+  return true;
+}
+
 int Html5FileSystem::StatCall(Arguments* arguments,
                               const char* path,
                               struct stat* buf) {
   if (!filesystem_)
     return Initialize(arguments);
 
-  if (waiting_) {
-    waiting_ = false;
-    if (arguments->result.callback == PP_ERROR_NOTAFILE) {
-      // For now, it means that the specified path is a directory.
-      arguments->result.callback = PP_OK;
-      memset(buf, 0, sizeof(struct stat));
-      buf->st_mode = S_IRUSR | S_IWUSR | S_IXUSR |
-                     S_IRGRP | S_IWGRP | S_IXGRP |
-                     S_IROTH | S_IWOTH | S_IXOTH |
-                     S_IFDIR;
-      return 0;
-    } else if (arguments->result.callback) {
-      std::stringstream ss;
-      ss << "Html5FileSystem::StatCall got call back failure result "
-         << arguments->result.callback << std::endl;
-      naclfs_->Log(ss.str().c_str());
+  if (arguments->step == kQuerying) {
+    // Check FileRef::Query completion result.
+    if (arguments->result.callback) {
+      if (arguments->result.callback != PP_ERROR_FILENOTFOUND) {
+        std::stringstream ss;
+        ss << "Html5FileSystem::StatCall got call back failure result "
+           << arguments->result.callback << std::endl;
+        naclfs_->Log(ss.str().c_str());
+      }
       return PPErrorToErrNo(arguments->result.callback);
     }
-
-    querying_ = true;
-    arguments->chaining = true;
-    file_io_->Query(&file_info_, callback_);
+    DentryCache::GetInstance()->UpdateInfo(path, file_info_);
+    FileInfoToStat(file_info_, buf);
     return 0;
   }
 
-  if (querying_) {
-    querying_ = false;
-    if (arguments->result.callback)
-      return PPErrorToErrNo(arguments->result.callback);
-    memset(buf, 0, sizeof(struct stat));
-    buf->st_mode = S_IRUSR | S_IWUSR | S_IXUSR |
-                   S_IRGRP | S_IWGRP | S_IXGRP |
-                   S_IROTH | S_IWOTH | S_IXOTH;
-    buf->st_size = file_info_.size;
-    buf->st_atime = file_info_.last_access_time;
-    buf->st_mtime = file_info_.last_modified_time;
-    buf->st_ctime = file_info_.creation_time;
-    buf->st_blksize = 512;  // pseudo value for compatilibity
-    buf->st_blocks = (file_info_.size + 511) >> 9;
-    switch (file_info_.type) {
-      case PP_FILETYPE_REGULAR:
-        buf->st_mode |= S_IFREG;
-        break;
-      case PP_FILETYPE_DIRECTORY:
-        buf->st_mode |= S_IFDIR;
-        break;
-      case PP_FILETYPE_OTHER:
-      default:
-        break;
-    }
+  // Requests from an IoQueue reach here without going through Stat().
+  PP_FileInfo info;
+  if (DentryCache::GetInstance()->LookupInfo(path, &info)) {
+    FileInfoToStat(info, buf);
     return 0;
   }
 
-  file_ref_ = new pp::FileRef(*filesystem_, path);
-  file_io_ = new pp::FileIO(naclfs_->GetInstance());
-  int32_t result = file_io_->Open(*file_ref_, 0, callback_);
+  // Query the metadata on the FileRef itself. It reports the file type, so
+  // directories need no special casing, and it takes one round trip where
+  // opening a FileIO and querying it took two. The FileRef is kept until
+  // completion so that the query is not aborted.
+  file_ref_ = new pp::FileRef(
+      DentryCache::GetInstance()->GetFileRef(filesystem_, path));
+  const PP_CompletionCallback& cc =
+      arguments->callback.pp_completion_callback();
+  int32_t result = file_ref_->Query(
+      pp::CompletionCallbackWithOutput<PP_FileInfo>(
+          cc.func, cc.user_data, &file_info_));
   if (result != PP_OK_COMPLETIONPENDING) {
     naclfs_->Log(
-        "Html5FileSystem::Open doesn't return PP_OK_COMPLETIONPENDING\n");
+        "Html5FileSystem::Stat doesn't return PP_OK_COMPLETIONPENDING\n");
     return PPErrorToErrNo(result);
   }
-  waiting_ = true;
+  arguments->step = kQuerying;
   arguments->chaining = true;
   return 0;
 }
 
 int Html5FileSystem::CloseCall(Arguments* arguments) {
   file_io_->Close();
+  if (access_mode_ != O_RDONLY)
+    DentryCache::GetInstance()->Invalidate(path_.c_str());
   return 0;
 }
 
 int Html5FileSystem::FstatCall(Arguments* arguments, struct stat* buf) {
-  if (waiting_) {
-    waiting_ = false;
-    if (arguments->result.callback)
+  if (arguments->step == kWaiting) {
+    if (arguments->result.callback) {
       PPErrorToErrNo(arguments->result.callback);
+    } else {
+      info_valid_ = true;
+      DentryCache::GetInstance()->UpdateInfo(path_.c_str(), file_info_);
+    }
     memset(buf, 0, sizeof(struct stat));
     buf->st_mode = S_IRUSR | S_IWUSR | S_IXUSR;
     buf->st_size = file_info_.size;
@@ -349,13 +592,72 @@ int Html5FileSystem::FstatCall(Arguments* arguments, struct stat* buf) {
     return 0;
   }
 
-  int32_t result = file_io_->Query(&file_info_, callback_);
+  int32_t result = file_io_->Query(&file_info_, arguments->callback);
   if (result != PP_OK_COMPLETIONPENDING) {
     naclfs_->Log(
         "Html5FileSystem::Query doesn't return PP_OK_COMPLETIONPENDING\n");
     return PPErrorToErrNo(result);
   }
-  waiting_ = true;
+  arguments->step = kWaiting;
+  arguments->chaining = true;
+  return 0;
+}
+
+ssize_t Html5FileSystem::Read(void* buf, size_t nbytes) {
+  pthread_mutex_lock(&offset_mutex_);
+  off_t offset = offset_;
+  pthread_mutex_unlock(&offset_mutex_);
+  ssize_t result = ReadAt(buf, nbytes, offset);
+  if (result > 0) {
+    pthread_mutex_lock(&offset_mutex_);
+    offset_ = offset + result;
+    pthread_mutex_unlock(&offset_mutex_);
+  }
+  return result;
+}
+
+ssize_t Html5FileSystem::PRead(void* buf, size_t nbytes, off_t offset) {
+  return ReadAt(buf, nbytes, offset);
+}
+
+ssize_t Html5FileSystem::PReadCall(Arguments* arguments,
+                                   void* buf,
+                                   size_t nbytes,
+                                   off_t offset) {
+  if (arguments->step == kWaiting) {
+    return arguments->result.callback;
+  }
+
+  if (file_io_->Read(
+          offset, static_cast<char*>(buf), nbytes, arguments->callback) !=
+      PP_OK_COMPLETIONPENDING) {
+    naclfs_->Log(
+        "Html5FileSystem::PRead doesn't return PP_OK_COMPLETIONPENDING\n");
+    return -1;
+  }
+  arguments->step = kWaiting;
+  arguments->chaining = true;
+  return 0;
+}
+
+ssize_t Html5FileSystem::PWriteCall(Arguments* arguments,
+                                    const void* buf,
+                                    size_t nbytes,
+                                    off_t offset) {
+  if (arguments->step == kWaiting) {
+    DentryCache::GetInstance()->Invalidate(path_.c_str());
+    return arguments->result.callback;
+  }
+
+  if (file_io_->Write(offset,
+                      static_cast<const char*>(buf),
+                      nbytes,
+                      arguments->callback) != PP_OK_COMPLETIONPENDING) {
+    naclfs_->Log(
+        "Html5FileSystem::PWrite doesn't return PP_OK_COMPLETIONPENDING\n");
+    return -1;
+  }
+  arguments->step = kWaiting;
   arguments->chaining = true;
   return 0;
 }
@@ -363,20 +665,26 @@ int Html5FileSystem::FstatCall(Arguments* arguments, struct stat* buf) {
 ssize_t Html5FileSystem::ReadCall(Arguments* arguments,
                                   void* buf,
                                   size_t nbytes) {
-  if (waiting_) {
-    waiting_ = false;
-    if (arguments->result.callback > 0)
+  if (arguments->step == kWaiting) {
+    if (arguments->result.callback > 0) {
+      pthread_mutex_lock(&offset_mutex_);
       offset_ += arguments->result.callback;
+      pthread_mutex_unlock(&offset_mutex_);
+    }
     return arguments->result.callback;
   }
 
-  if (file_io_->Read(offset_, static_cast<char*>(buf), nbytes, callback_) !=
+  pthread_mutex_lock(&offset_mutex_);
+  off_t offset = offset_;
+  pthread_mutex_unlock(&offset_mutex_);
+  if (file_io_->Read(
+          offset, static_cast<char*>(buf), nbytes, arguments->callback) !=
       PP_OK_COMPLETIONPENDING) {
     naclfs_->Log(
         "Html5FileSystem::Read doesn't return PP_OK_COMPLETIONPENDING\n");
     return -1;
   }
-  waiting_ = true;
+  arguments->step = kWaiting;
   arguments->chaining = true;
   return 0;
 }
@@ -384,23 +692,35 @@ ssize_t Html5FileSystem::ReadCall(Arguments* arguments,
 ssize_t Html5FileSystem::WriteCall(Arguments* arguments,
                                    const void* buf,
                                    size_t nbytes) {
-  if (waiting_) {
-    waiting_ = false;
-    if (arguments->result.callback > 0)
+  if (arguments->step == kWaiting) {
+    if (arguments->result.callback > 0) {
+      pthread_mutex_lock(&offset_mutex_);
       offset_ += arguments->result.callback;
-    if (file_info_.size < offset_)
-      file_info_.size = offset_;
+      off_t offset = offset_;
+      pthread_mutex_unlock(&offset_mutex_);
+      PageCache::GetInstance()->Invalidate(
+          file_id_,
+          offset - arguments->result.callback,
+          arguments->result.callback);
+      if (file_info_.size < offset)
+        file_info_.size = offset;
+    }
+    DentryCache::GetInstance()->Invalidate(path_.c_str());
     return arguments->result.callback;
   }
 
-  if (file_io_->Write(
-          offset_, static_cast<const char*>(buf), nbytes, callback_) !=
-      PP_OK_COMPLETIONPENDING) {
+  pthread_mutex_lock(&offset_mutex_);
+  off_t offset = offset_;
+  pthread_mutex_unlock(&offset_mutex_);
+  if (file_io_->Write(offset,
+                      static_cast<const char*>(buf),
+                      nbytes,
+                      arguments->callback) != PP_OK_COMPLETIONPENDING) {
     naclfs_->Log(
         "Html5FileSystem::Write doesn't return PP_OK_COMPLETIONPENDING\n");
     return -1;
   }
-  waiting_ = true;
+  arguments->step = kWaiting;
   arguments->chaining = true;
   return 0;
 }
@@ -408,6 +728,27 @@ ssize_t Html5FileSystem::WriteCall(Arguments* arguments,
 off_t Html5FileSystem::SeekCall(Arguments* arguments,
                                 off_t offset,
                                 int whence) {
+  if (arguments->step == kQuerying) {
+    // Check FileIO::Query completion result for SEEK_END.
+    if (arguments->result.callback) {
+      naclfs_->Log("Html5FileSystem::Seek failed to query the file size\n");
+      return -1;
+    }
+    info_valid_ = true;
+    DentryCache::GetInstance()->UpdateInfo(path_.c_str(), file_info_);
+  } else if (whence == SEEK_END && !info_valid_) {
+    if (file_io_->Query(&file_info_, arguments->callback) !=
+        PP_OK_COMPLETIONPENDING) {
+      naclfs_->Log(
+          "Html5FileSystem::Query doesn't return PP_OK_COMPLETIONPENDING\n");
+      return -1;
+    }
+    arguments->step = kQuerying;
+    arguments->chaining = true;
+    return 0;
+  }
+
+  pthread_mutex_lock(&offset_mutex_);
   switch (whence) {
     case SEEK_SET:
       offset_ = offset;
@@ -419,10 +760,13 @@ off_t Html5FileSystem::SeekCall(Arguments* arguments,
       offset_ = file_info_.size + offset;
       break;
     default:
+      pthread_mutex_unlock(&offset_mutex_);
       naclfs_->Log("Html5FileSystem::Seek invalid whence\n");
       return -1;
   }
-  return offset_;
+  off_t result = offset_;
+  pthread_mutex_unlock(&offset_mutex_);
+  return result;
 }
 
 int Html5FileSystem::FcntlCall(Arguments* arguments, int cmd, va_list* ap) {
@@ -455,25 +799,45 @@ int Html5FileSystem::FcntlCall(Arguments* arguments, int cmd, va_list* ap) {
   return 0;
 }
 
+int Html5FileSystem::FsyncCall(Arguments* arguments) {
+  if (arguments->step == kWaiting) {
+    if (arguments->result.callback)
+      return PPErrorToErrNo(arguments->result.callback);
+    return 0;
+  }
+
+  int32_t result = file_io_->Flush(arguments->callback);
+  if (result != PP_OK_COMPLETIONPENDING) {
+    naclfs_->Log(
+        "Html5FileSystem::Flush doesn't return PP_OK_COMPLETIONPENDING\n");
+    return PPErrorToErrNo(result);
+  }
+  arguments->step = kWaiting;
+  arguments->chaining = true;
+  return 0;
+}
+
 int Html5FileSystem::MkDirCall(Arguments* arguments,
                                const char* path,
                                mode_t mode) {
   if (!filesystem_)
     return Initialize(arguments);
 
-  if (waiting_) {
-    waiting_ = false;
+  if (arguments->step == kWaiting) {
+    DentryCache::GetInstance()->Invalidate(path);
+    InvalidateParent(path);
     return arguments->result.callback;
   }
 
-  pp::FileRef file_ref(*filesystem_, path);
-  if (file_ref.MakeDirectory(PP_MAKEDIRECTORYFLAG_NONE, callback_) !=
+  pp::FileRef file_ref(
+      DentryCache::GetInstance()->GetFileRef(filesystem_, path));
+  if (file_ref.MakeDirectory(PP_MAKEDIRECTORYFLAG_NONE, arguments->callback) !=
       PP_OK_COMPLETIONPENDING) {
     naclfs_->Log(
         "Html5FileSystem::MkDir doesn't return PP_OK_COMPLETIONPENDING\n");
     return -1;
   }
-  waiting_ = true;
+  arguments->step = kWaiting;
   arguments->chaining = true;
   return 0;
 }
@@ -484,8 +848,10 @@ DIR* Html5FileSystem::OpenDirCall(Arguments* arguments, const char* dirname) {
     return NULL;
   }
 
-  pp::FileRef file_ref(*filesystem_, dirname);
-  return reinterpret_cast<DIR*>(new Html5FileSystemDir(this, file_ref));
+  pp::FileRef file_ref(
+      DentryCache::GetInstance()->GetFileRef(filesystem_, dirname));
+  return reinterpret_cast<DIR*>(
+      new Html5FileSystemDir(this, filesystem_, dirname, file_ref));
 }
 
 void Html5FileSystem::RewindDirCall(Arguments* arguments, DIR* dirp) {
@@ -500,8 +866,7 @@ struct dirent* Html5FileSystem::ReadDirCall(Arguments* arguments, DIR* dirp) {
   if (!dir)
     return NULL;
 
-  if (waiting_) {
-    waiting_ = false;
+  if (arguments->step == kWaiting) {
     if (arguments->result.callback) {
       std::stringstream ss;
       ss << "Html5FileSystem::ReadDir failed with error code " <<
@@ -512,12 +877,12 @@ struct dirent* Html5FileSystem::ReadDirCall(Arguments* arguments, DIR* dirp) {
     return dir->ReadDirNext();
   }
 
-  int result = dir->ReadDir(callback_);
+  int result = dir->ReadDir(arguments->callback);
   if (result == PP_OK)
     return dir->ReadDirNext();
 
   if (result == PP_OK_COMPLETIONPENDING) {
-    waiting_ = true;
+    arguments->step = kWaiting;
     arguments->chaining = true;
     return NULL;
   }
@@ -527,6 +892,22 @@ struct dirent* Html5FileSystem::ReadDirCall(Arguments* arguments, DIR* dirp) {
   return NULL;
 }
 
+long Html5FileSystem::TellDirCall(Arguments* arguments, DIR* dirp) {
+  Html5FileSystemDir* dir = reinterpret_cast<Html5FileSystemDir*>(dirp);
+  if (!dir)
+    return -1;
+  return dir->Tell();
+}
+
+void Html5FileSystem::SeekDirCall(Arguments* arguments,
+                                  DIR* dirp,
+                                  long offset) {
+  Html5FileSystemDir* dir = reinterpret_cast<Html5FileSystemDir*>(dirp);
+  if (!dir)
+    return;
+  dir->Seek(offset);
+}
+
 int Html5FileSystem::CloseDirCall(Arguments* arguments, DIR* dirp) {
   Html5FileSystemDir* dir = reinterpret_cast<Html5FileSystemDir*>(dirp);
   if (!dir)
@@ -536,6 +917,278 @@ int Html5FileSystem::CloseDirCall(Arguments* arguments, DIR* dirp) {
   return 0;
 }
 
+ssize_t Html5FileSystem::Fetch(off_t offset,
+                               void* buf,
+                               size_t nbytes,
+                               size_t read_ahead) {
+  // Read the blocks covering the request, and more while reads are
+  // sequential, with a single FileIO::Read.
+  PageCache* cache = PageCache::GetInstance();
+  size_t block_size = cache->block_size();
+  off_t start = offset - offset % block_size;
+  size_t head = offset - start;
+  size_t needed = (head + nbytes + block_size - 1) / block_size;
+  size_t blocks = read_ahead > needed ? read_ahead : needed;
+  uint32_t generation = cache->GetGeneration(file_id_);
+  std::vector<char> data(blocks * block_size);
+  ssize_t result = Delegate::PRead(&data[0], data.size(), start);
+  if (result < 0)
+    return -1;
+  size_t length = result;
+  for (size_t i = 0; i < blocks && i * block_size < length; ++i) {
+    size_t size = length - i * block_size;
+    if (size > block_size)
+      size = block_size;
+    cache->Insert(file_id_, generation, start + i * block_size,
+                  &data[i * block_size], size, i >= needed);
+  }
+  if (length <= head)
+    return 0;
+  size_t size = length - head;
+  if (size > nbytes)
+    size = nbytes;
+  memcpy(buf, &data[head], size);
+  return size;
+}
+
+ssize_t Html5FileSystem::ReadAt(void* buf, size_t nbytes, off_t offset) {
+  // Serve reads through the page cache on the calling thread. Large reads
+  // go to the file directly.
+  PageCache* cache = PageCache::GetInstance();
+  if (!cache->enabled() ||
+      nbytes >= cache->block_size() * cache->max_read_ahead()) {
+    if (Flush())
+      return -1;
+    FlushFile(file_id_, this);
+    return Delegate::PRead(buf, nbytes, offset);
+  }
+
+  // Grow the read-ahead window while reads are sequential.
+  pthread_mutex_lock(&read_ahead_mutex_);
+  if (offset == sequential_offset_) {
+    read_ahead_ *= 2;
+    if (read_ahead_ > cache->max_read_ahead())
+      read_ahead_ = cache->max_read_ahead();
+  } else {
+    read_ahead_ = 1;
+  }
+  size_t read_ahead = read_ahead_;
+  pthread_mutex_unlock(&read_ahead_mutex_);
+
+  char* dst = static_cast<char*>(buf);
+  size_t done = 0;
+  while (done < nbytes) {
+    ssize_t result = cache->Read(file_id_, offset, &dst[done], nbytes - done);
+    if (result < 0) {
+      // Buffered writes are in the page cache but not yet in the file.
+      if (!Flush()) {
+        FlushFile(file_id_, this);
+        result = Fetch(offset, &dst[done], nbytes - done, read_ahead);
+      }
+    }
+    if (result < 0) {
+      if (done)
+        break;
+      return -1;
+    }
+    if (!result)
+      break;
+    done += result;
+    offset += result;
+  }
+  pthread_mutex_lock(&read_ahead_mutex_);
+  sequential_offset_ = offset;
+  pthread_mutex_unlock(&read_ahead_mutex_);
+  return done;
+}
+
+ssize_t Html5FileSystem::WriteLocked(const void* buf,
+                                     size_t nbytes,
+                                     off_t offset) {
+  const char* src = static_cast<const char*>(buf);
+  size_t limit = write_back_size_;
+  if (buffer_error_) {
+    errno = buffer_error_;
+    buffer_error_ = 0;
+    return -1;
+  }
+  // Coalesce writes which continue the buffered data.
+  if (!buffer_.empty() &&
+      (offset != buffer_offset_ + static_cast<off_t>(buffer_.size()) ||
+       buffer_.size() + nbytes > limit) &&
+      FlushLocked()) {
+    return -1;
+  }
+  ssize_t result = nbytes;
+  if (nbytes >= limit) {
+    result = Delegate::PWrite(buf, nbytes, offset);
+    if (result > 0)
+      PageCache::GetInstance()->Invalidate(file_id_, offset, result);
+  } else {
+    if (buffer_.empty()) {
+      buffer_offset_ = offset;
+      QueueFlush();
+    }
+    buffer_.insert(buffer_.end(), src, src + nbytes);
+    // Readers on other descriptors see the data through the page cache.
+    PageCache::GetInstance()->Write(file_id_, offset, buf, nbytes);
+    DentryCache::GetInstance()->Invalidate(path_.c_str());
+    if (buffer_.size() >= limit && FlushLocked())
+      result = -1;
+  }
+  if (result > 0 && file_info_.size < offset + result)
+    file_info_.size = offset + result;
+  return result;
+}
+
+int Html5FileSystem::FlushLocked() {
+  if (!buffer_.empty()) {
+    pthread_mutex_lock(&flusher_mutex_);
+    std::multimap<uint32_t, Html5FileSystem*>::iterator it =
+        dirty_files_.lower_bound(file_id_);
+    while (it != dirty_files_.end() && it->first == file_id_) {
+      if (it->second == this) {
+        dirty_files_.erase(it);
+        break;
+      }
+      ++it;
+    }
+    pthread_mutex_unlock(&flusher_mutex_);
+  }
+  size_t done = 0;
+  while (done < buffer_.size()) {
+    ssize_t result = Delegate::PWrite(
+        &buffer_[done], buffer_.size() - done, buffer_offset_ + done);
+    if (result <= 0) {
+      // Cached blocks hold data which did not reach the file.
+      PageCache::GetInstance()->InvalidateFile(file_id_);
+      buffer_error_ = EIO;
+      break;
+    }
+    done += result;
+  }
+  buffer_.clear();
+  int error = buffer_error_;
+  buffer_error_ = 0;
+  return error;
+}
+
+void Html5FileSystem::QueueFlush() {
+  pthread_mutex_lock(&flusher_mutex_);
+  if (!flusher_started_) {
+    pthread_t thread;
+    if (!pthread_create(&thread, NULL, FlusherMain, NULL)) {
+      pthread_detach(thread);
+      flusher_started_ = true;
+    }
+  }
+  if (flusher_started_) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    uint64_t usec = now.tv_usec + write_back_idle_ms_ * 1000ULL;
+    PendingFlush pending;
+    pending.delegate = this;
+    pending.deadline.tv_sec = now.tv_sec + usec / 1000000;
+    pending.deadline.tv_nsec = (usec % 1000000) * 1000;
+    AddRef();
+    pending_flushes_.push_back(pending);
+    dirty_files_.insert(std::make_pair(file_id_, this));
+    pthread_cond_signal(&flusher_cond_);
+  }
+  pthread_mutex_unlock(&flusher_mutex_);
+}
+
+void* Html5FileSystem::FlusherMain(void* param) {
+  pthread_mutex_lock(&flusher_mutex_);
+  for (;;) {
+    if (pending_flushes_.empty()) {
+      pthread_cond_wait(&flusher_cond_, &flusher_mutex_);
+      continue;
+    }
+    PendingFlush pending = pending_flushes_.front();
+    if (pthread_cond_timedwait(
+            &flusher_cond_, &flusher_mutex_, &pending.deadline) != ETIMEDOUT)
+      continue;
+    pending_flushes_.pop_front();
+    pthread_mutex_unlock(&flusher_mutex_);
+    pending.delegate->FlushDeferringError();
+    pending.delegate->Release();
+    pthread_mutex_lock(&flusher_mutex_);
+  }
+  return NULL;
+}
+
+void Html5FileSystem::FlushDeferringError() {
+  pthread_mutex_lock(&buffer_mutex_);
+  buffer_error_ = FlushLocked();
+  pthread_mutex_unlock(&buffer_mutex_);
+}
+
+void Html5FileSystem::FlushFile(uint32_t file_id, Html5FileSystem* self) {
+  std::vector<Html5FileSystem*> delegates;
+  pthread_mutex_lock(&flusher_mutex_);
+  std::multimap<uint32_t, Html5FileSystem*>::iterator it =
+      dirty_files_.lower_bound(file_id);
+  for (; it != dirty_files_.end() && it->first == file_id; ++it) {
+    if (it->second == self)
+      continue;
+    it->second->AddRef();
+    delegates.push_back(it->second);
+  }
+  pthread_mutex_unlock(&flusher_mutex_);
+  for (size_t i = 0; i < delegates.size(); ++i) {
+    delegates[i]->FlushDeferringError();
+    delegates[i]->Release();
+  }
+}
+
+void Html5FileSystem::FlushPath(const char* path) {
+  std::vector<Html5FileSystem*> delegates;
+  pthread_mutex_lock(&flusher_mutex_);
+  std::multimap<uint32_t, Html5FileSystem*>::iterator it;
+  for (it = dirty_files_.begin(); it != dirty_files_.end(); ++it) {
+    if (it->second->path_ != path)
+      continue;
+    it->second->AddRef();
+    delegates.push_back(it->second);
+  }
+  pthread_mutex_unlock(&flusher_mutex_);
+  for (size_t i = 0; i < delegates.size(); ++i) {
+    delegates[i]->FlushDeferringError();
+    delegates[i]->Release();
+  }
+}
+
+bool Html5FileSystem::IsLocal(const Arguments& arguments) const {
+  // These only update the offset or the directory cursor, or report fixed
+  // values, so they never need PPAPI.
+  switch (arguments.function) {
+    case SEEK:
+      // SEEK_END needs the size, which open does not fetch.
+      return arguments.u.seek.whence != SEEK_END || info_valid_;
+    case ISATTY:
+    case FCNTL:
+    case REWINDDIR:
+    case TELLDIR:
+    case SEEKDIR:
+    case CLOSEDIR:
+      return true;
+    case READDIR:
+      // Only the first call fetches the listing.
+      return arguments.u.readdir.dirp &&
+          reinterpret_cast<Html5FileSystemDir*>(
+              arguments.u.readdir.dirp)->read();
+    default:
+      return false;
+  }
+}
+
+bool Html5FileSystem::IsConcurrent(const Arguments& arguments) const {
+  // Positional transfers keep nothing in the delegate, and PPB_FileIO allows
+  // several reads or several writes in flight on one resource.
+  return arguments.function == PREAD || arguments.function == PWRITE;
+}
+
 bool Html5FileSystem::HandleMessage(const pp::Var& message) {
   return false;
 }
@@ -544,7 +1197,7 @@ int Html5FileSystem::Initialize(Arguments* arguments) {
   naclfs_->Log("Html5FileSystem: initializing file system...");
   filesystem_ = new pp::FileSystem(naclfs_->GetInstance(),
                                    naclfs_->filesystem_type());
-  filesystem_->Open(1024 * 1024, callback_);
+  filesystem_->Open(1024 * 1024, arguments->callback);
   naclfs_->Log("done\n");
   arguments->chaining = true;
   return 0;
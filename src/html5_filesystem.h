@@ -35,6 +35,9 @@
 
 #include <pthread.h>
 
+#include <deque>
+#include <map>
+#include <string>
 #include <vector>
 
 #include "filesystem.h"
@@ -58,6 +61,19 @@ class Html5FileSystem : public FileSystem::Delegate {
   Html5FileSystem(NaClFs* naclfs);
   virtual ~Html5FileSystem();
 
+  virtual int Stat(const char* path, struct stat* buf);
+  virtual bool StatCached(const char* path, struct stat* buf);
+  virtual int Close();
+  virtual int Fstat(struct stat* buf);
+  virtual ssize_t Read(void* buf, size_t nbytes);
+  virtual ssize_t Write(const void* buf, size_t nbytes);
+  virtual ssize_t PRead(void* buf, size_t nbytes, off_t offset);
+  virtual ssize_t PWrite(const void* buf, size_t nbytes, off_t offset);
+  virtual off_t Seek(off_t offset, int whence);
+  virtual int Fsync();
+  virtual int WriteBack();
+  virtual int AccessMode() { return access_mode_; }
+
   virtual int OpenCall(Arguments* arguments,
                        const char* path,
                        int oflag,
@@ -71,18 +87,94 @@ class Html5FileSystem : public FileSystem::Delegate {
   virtual ssize_t WriteCall(Arguments* arguments,
                             const void* buf,
                             size_t nbytes);
+  virtual ssize_t PReadCall(Arguments* arguments,
+                            void* buf,
+                            size_t nbytes,
+                            off_t offset);
+  virtual ssize_t PWriteCall(Arguments* arguments,
+                             const void* buf,
+                             size_t nbytes,
+                             off_t offset);
   virtual off_t SeekCall(Arguments* arguments, off_t offset, int whence);
   virtual int IsATtyCall(Arguments* arguyments) { return -1; }
   virtual int FcntlCall(Arguments* arguments, int cmd, va_list* ap);
+  virtual int FsyncCall(Arguments* arguments);
   virtual int MkDirCall(Arguments* arguments, const char* path, mode_t mode);
   virtual DIR* OpenDirCall(Arguments* arguments, const char* dirname);
   virtual void RewindDirCall(Arguments* arguments, DIR* dirp);
   virtual struct dirent* ReadDirCall(Arguments* arguments, DIR* dirp);
+  virtual long TellDirCall(Arguments* arguments, DIR* dirp);
+  virtual void SeekDirCall(Arguments* arguments, DIR* dirp, long offset);
   virtual int CloseDirCall(Arguments* arguments, DIR* dirp);
   static bool HandleMessage(const pp::Var& message);
 
+  // Writes out buffered data. Returns 0, or an errno for a failed write
+  // which was not reported yet.
+  int Flush();
+
+  // Writes are buffered per descriptor up to |buffer_size| bytes, and are
+  // written out at most |idle_ms| milliseconds after they were buffered.
+  // A |buffer_size| of 0 disables buffering.
+  static void ConfigureWriteBack(size_t buffer_size, uint32_t idle_ms);
+  // The first readdir() on a directory with at most |max_entries| entries
+  // also fetches metadata for all of them into the dentry cache. 0, the
+  // default, disables this.
+  static void SetReadDirPlus(size_t max_entries);
+  static size_t readdir_plus_limit() { return readdir_plus_limit_; }
+  // Makes readdir() return entries in name order instead of the order the
+  // browser lists them in.
+  static void SetReadDirSorted(bool sorted);
+  static bool readdir_sorted() { return readdir_sorted_; }
+
+ protected:
+  virtual bool IsLocal(const Arguments& arguments) const;
+  virtual bool IsConcurrent(const Arguments& arguments) const;
+
  private:
   int Initialize(Arguments* arguments);
+  // Reads the page cache blocks covering |nbytes| at |offset|, and at least
+  // |read_ahead| blocks, from the file into the cache, and copies the
+  // requested part into |buf|.
+  ssize_t Fetch(off_t offset, void* buf, size_t nbytes, size_t read_ahead);
+  // Reads at |offset| through the page cache.
+  ssize_t ReadAt(void* buf, size_t nbytes, off_t offset);
+  // Writes at |offset| through the write-back buffer. Called with
+  // |buffer_mutex_| held.
+  ssize_t WriteLocked(const void* buf, size_t nbytes, off_t offset);
+  // Writes |buffer_| out to the file. Called with |buffer_mutex_| held.
+  int FlushLocked();
+  // Queues the buffer to be written out by the flusher thread after the
+  // idle delay. Called with |buffer_mutex_| held.
+  void QueueFlush();
+  // Writes the buffer out, keeping a failure to report on the next call.
+  void FlushDeferringError();
+  // Writes out data other descriptors buffered for |file_id|, so that a
+  // read from the file sees it.
+  static void FlushFile(uint32_t file_id, Html5FileSystem* self);
+  // Writes out data any descriptor buffered for the file at |path|, so that
+  // its size on the file is current.
+  static void FlushPath(const char* path);
+  static void* FlusherMain(void* param);
+
+  struct PendingFlush {
+    Html5FileSystem* delegate;
+    struct timespec deadline;
+  };
+
+  static const size_t kDefaultWriteBackSize = 64 * 1024;
+  static const uint32_t kDefaultWriteBackIdleMs = 100;
+
+  static size_t write_back_size_;
+  static uint32_t write_back_idle_ms_;
+  static size_t readdir_plus_limit_;
+  static bool readdir_sorted_;
+  static pthread_mutex_t flusher_mutex_;
+  static pthread_cond_t flusher_cond_;
+  static bool flusher_started_;
+  // In deadline order, each holding a reference to its delegate.
+  static std::deque<PendingFlush> pending_flushes_;
+  // Delegates with buffered data by page cache file id.
+  static std::multimap<uint32_t, Html5FileSystem*> dirty_files_;
 
   static pp::FileSystem* filesystem_;
   static Html5FileSystem* rpc_object_;
@@ -91,9 +183,31 @@ class Html5FileSystem : public FileSystem::Delegate {
   pp::FileIO* file_io_;
   PP_FileInfo file_info_;
   NaClFs* naclfs_;
-  bool waiting_;
-  bool querying_;
+  // Whether |file_info_| holds the metadata. Open leaves it to be fetched
+  // when needed.
+  bool info_valid_;
+  int access_mode_;
+  // Guards |offset_|, which local seeks update on the calling thread while
+  // reads and writes may use it on the main thread. Only held to read or
+  // update the offset, never across a main thread round trip.
+  pthread_mutex_t offset_mutex_;
   off_t offset_;
+  // Page cache id of the opened file, and the read-ahead window in blocks
+  // which grows while reads continue from |sequential_offset_|. Concurrent
+  // reads update the window under |read_ahead_mutex_|.
+  uint32_t file_id_;
+  pthread_mutex_t read_ahead_mutex_;
+  size_t read_ahead_;
+  off_t sequential_offset_;
+  // Full path this delegate opened, for dentry cache invalidation.
+  std::string path_;
+  // Write-back buffer holding data to be written at |buffer_offset_|, and
+  // an error from a background flush to report on the next call. Never
+  // taken on the main thread.
+  pthread_mutex_t buffer_mutex_;
+  std::vector<char> buffer_;
+  off_t buffer_offset_;
+  int buffer_error_;
 };
 
 }  // namespace naclfs
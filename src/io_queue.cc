@@ -0,0 +1,306 @@
+//
+// Copyright (c) 2012, Takashi TOYOSHIMA <toyoshim@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// - Neither the name of the authors nor the names of its contributors may be
+//   used to endorse or promote products derived from this software with out
+//   specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUE
+// NTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+// GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.
+//
+
+#include "io_queue.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/param.h>
+
+#include "filesystem.h"
+#include "naclfs.h"
+#include "negative_cache.h"
+#include "ppapi/cpp/core.h"
+#include "ppapi/cpp/module.h"
+
+namespace naclfs {
+
+typedef FileSystem::Delegate Delegate;
+
+struct IoQueue::Context {
+  Delegate::Completion completion;
+};
+
+// A submitted request. The Arguments part travels through the delegate and
+// comes back through the shared completion slot.
+struct IoQueue::Operation : public Delegate::Arguments {
+  Request* request;
+  char fullpath[MAXPATHLEN];
+};
+
+IoQueue::IoQueue(size_t depth)
+    : context_(new Context),
+      depth_(depth),
+      inflight_(0) {
+  pthread_mutex_init(&context_->completion.mutex, NULL);
+  pthread_cond_init(&context_->completion.cond, NULL);
+  context_->completion.head = NULL;
+  context_->completion.tail = NULL;
+}
+
+IoQueue::~IoQueue() {
+  pthread_cond_destroy(&context_->completion.cond);
+  pthread_mutex_destroy(&context_->completion.mutex);
+  delete context_;
+}
+
+size_t IoQueue::Submit(Request** requests, size_t count) {
+  FileSystem* filesystem = NaClFs::GetFileSystem();
+  size_t submitted;
+  for (submitted = 0; submitted < count && inflight_ < depth_; ++submitted) {
+    Request* request = requests[submitted];
+    Operation* operation = new Operation;
+    operation->request = request;
+    Delegate* delegate = NULL;
+    int error = 0;
+    switch (request->opcode) {
+      case OPEN:
+      case STAT:
+        if (!request->path) {
+          error = EFAULT;
+          break;
+        }
+        if (!request->path[0]) {
+          error = ENOENT;
+          break;
+        }
+        if (filesystem->CreateFullpath(request->path, operation->fullpath)) {
+          error = ENAMETOOLONG;
+          break;
+        }
+        if (request->opcode == OPEN && (request->oflag & O_CREAT)) {
+          filesystem->negatives_->Invalidate(operation->fullpath);
+        } else if (filesystem->negatives_->Lookup(operation->fullpath)) {
+          error = ENOENT;
+          break;
+        }
+        int flags;
+        delegate = filesystem->CreateDelegate(operation->fullpath, &flags);
+        if (!delegate) {
+          error = ENODEV;
+          break;
+        }
+        if (request->opcode == OPEN && (flags & FileSystem::MOUNT_READ_ONLY) &&
+            FileSystem::IsModifyingOpen(request->oflag)) {
+          delegate->Release();
+          delegate = NULL;
+          error = EROFS;
+          break;
+        }
+        if (request->opcode == OPEN) {
+          operation->function = Delegate::OPEN;
+          operation->u.open.path = operation->fullpath;
+          operation->u.open.oflag = request->oflag;
+          operation->u.open.cmode = request->mode;
+        } else {
+          operation->function = Delegate::STAT;
+          operation->u.stat.path = operation->fullpath;
+          operation->u.stat.buf = request->stat;
+        }
+        break;
+      case CLOSE:
+      case FSTAT:
+      case READ:
+      case WRITE:
+      case PREAD:
+        // CLOSE owns the delegate from here on, so that the descriptor is
+        // neither closed twice nor unbound after it is reused.
+        if (request->opcode == CLOSE)
+          delegate = filesystem->UnbindDescriptor(request->fildes);
+        else
+          delegate = filesystem->AcquireDelegate(request->fildes);
+        if (!delegate) {
+          error = EBADF;
+          break;
+        }
+        // Requests run on the main thread and bypass data the delegate
+        // buffers for the calling thread, so write it out first. The main
+        // thread can not wait for that.
+        if (!pp::Module::Get()->core()->IsMainThread()) {
+          error = delegate->WriteBack();
+          if (error) {
+            // The descriptor is gone already, so close it anyway.
+            if (request->opcode == CLOSE)
+              delegate->Close();
+            delegate->Release();
+            delegate = NULL;
+            break;
+          }
+        }
+        if (request->opcode == CLOSE) {
+          operation->function = Delegate::CLOSE;
+        } else if (request->opcode == FSTAT) {
+          operation->function = Delegate::FSTAT;
+          operation->u.fstat.buf = request->stat;
+        } else if (request->opcode == READ) {
+          operation->function = Delegate::READ;
+          operation->u.read.buf = request->buf;
+          operation->u.read.nbytes = request->nbytes;
+        } else if (request->opcode == PREAD) {
+          operation->function = Delegate::PREAD;
+          operation->u.pread.buf = request->buf;
+          operation->u.pread.nbytes = request->nbytes;
+          operation->u.pread.offset = request->offset;
+        } else {
+          operation->function = Delegate::WRITE;
+          operation->u.write.buf = request->buf;
+          operation->u.write.nbytes = request->nbytes;
+        }
+        break;
+      default:
+        error = EINVAL;
+        break;
+    }
+    inflight_++;
+    if (error) {
+      request->result = -1;
+      request->error = error;
+      operation->delegate = NULL;
+      operation->completion = &context_->completion;
+      Delegate::Complete(operation);
+      continue;
+    }
+    delegate->Submit(operation, &context_->completion);
+  }
+  return submitted;
+}
+
+size_t IoQueue::Reap(Request** completions, size_t count, size_t wait) {
+  if (wait > inflight_)
+    wait = inflight_;
+  if (pp::Module::Get()->core()->IsMainThread())
+    wait = 0;
+
+  // Take completed operations off the shared slot under the lock, and
+  // finish them without it.
+  Delegate::Completion* completion = &context_->completion;
+  Operation* head = NULL;
+  Operation* tail = NULL;
+  size_t reaped = 0;
+  pthread_mutex_lock(&completion->mutex);
+  for (;;) {
+    while (completion->head && reaped < count) {
+      Operation* operation = static_cast<Operation*>(completion->head);
+      completion->head = operation->next;
+      if (!completion->head)
+        completion->tail = NULL;
+      operation->next = NULL;
+      if (tail)
+        tail->next = operation;
+      else
+        head = operation;
+      tail = operation;
+      reaped++;
+    }
+    if (reaped >= wait || reaped >= count)
+      break;
+    pthread_cond_wait(&completion->cond, &completion->mutex);
+  }
+  pthread_mutex_unlock(&completion->mutex);
+
+  size_t index = 0;
+  while (head) {
+    Operation* operation = head;
+    head = static_cast<Operation*>(operation->next);
+    Finish(operation);
+    completions[index++] = operation->request;
+    delete operation;
+  }
+  inflight_ -= reaped;
+  return reaped;
+}
+
+void IoQueue::Finish(Operation* operation) {
+  Request* request = operation->request;
+  Delegate* delegate = operation->delegate;
+  if (!delegate)
+    return;  // Failed on submission.
+
+  FileSystem* filesystem = NaClFs::GetFileSystem();
+  int error = 0;
+  ssize_t result = 0;
+  switch (request->opcode) {
+    case OPEN:
+      error = operation->result.open;
+      if (error == ENOENT && !(request->oflag & O_CREAT))
+        filesystem->negatives_->Insert(operation->fullpath);
+      // A stat() which raced with the create may have recorded the path.
+      if (!error && (request->oflag & O_CREAT))
+        filesystem->negatives_->Invalidate(operation->fullpath);
+      if (!error) {
+        result = filesystem->BindToDescriptor(delegate);
+        if (result < 0) {
+          delegate->Close();
+          error = EMFILE;
+        }
+      }
+      if (error)
+        delegate->Release();
+      break;
+    case STAT:
+      error = operation->result.stat;
+      if (error == ENOENT)
+        filesystem->negatives_->Insert(operation->fullpath);
+      delegate->Release();
+      break;
+    case CLOSE:
+      error = operation->result.close;
+      delegate->Release();
+      break;
+    case FSTAT:
+      error = operation->result.fstat;
+      delegate->Release();
+      break;
+    case READ:
+      result = operation->result.read;
+      if (result < 0)
+        error = EIO;
+      delegate->Release();
+      break;
+    case WRITE:
+      result = operation->result.write;
+      if (result < 0)
+        error = EIO;
+      delegate->Release();
+      break;
+    case PREAD:
+      result = operation->result.pread;
+      if (result < 0)
+        error = EIO;
+      delegate->Release();
+      break;
+  }
+  request->result = error ? -1 : result;
+  request->error = error;
+}
+
+}  // namespace naclfs
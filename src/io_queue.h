@@ -0,0 +1,115 @@
+//
+// Copyright (c) 2012, Takashi TOYOSHIMA <toyoshim@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// - Neither the name of the authors nor the names of its contributors may be
+//   used to endorse or promote products derived from this software with out
+//   specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUE
+// NTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+// GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.
+//
+
+#ifndef NACLFS_IO_QUEUE_H_
+#define NACLFS_IO_QUEUE_H_
+#pragma once
+
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+namespace naclfs {
+
+// Asynchronous file operations in the spirit of io_uring. A thread submits
+// a batch of requests, keeps running, and reaps completed requests later in
+// completion order. Requests run on the main thread like the blocking calls,
+// so many of them can be in flight at once. Requests for the same descriptor
+// are executed one by one in submission order, except that consecutive
+// PREAD requests may overlap when the file system supports it.
+//
+// Data which descriptors buffer is written out before requests on them are
+// submitted, except from the main thread, which can not wait for it.
+//
+// Request objects are owned by the caller and must stay valid until they are
+// reaped. A request keeps its descriptor's delegate alive until it is reaped,
+// even if the descriptor is closed meanwhile. CLOSE frees the descriptor
+// when it is submitted. An IoQueue is used by one thread at a time, and must
+// not be destroyed while requests are in flight.
+class IoQueue {
+ public:
+  enum Opcode {
+    OPEN,   // path, oflag, mode -> new descriptor
+    CLOSE,  // fildes
+    STAT,   // path, stat
+    FSTAT,  // fildes, stat
+    READ,   // fildes, buf, nbytes -> bytes read
+    WRITE,  // fildes, buf, nbytes -> bytes written
+    PREAD   // fildes, buf, nbytes, offset -> bytes read
+  };
+
+  struct Request {
+    Opcode opcode;
+    int fildes;
+    const char* path;
+    int oflag;
+    mode_t mode;
+    void* buf;
+    size_t nbytes;
+    off_t offset;
+    struct stat* stat;
+    void* user_data;
+
+    // Set on completion. |result| is -1 and |error| holds an errno value on
+    // failure.
+    ssize_t result;
+    int error;
+  };
+
+  IoQueue(size_t depth);
+  ~IoQueue();
+
+  // Submits up to |count| requests and returns how many were accepted.
+  // Fewer than |count| are accepted when |depth| requests are in flight.
+  size_t Submit(Request** requests, size_t count);
+
+  // Waits until at least |wait| requests, or all requests in flight if
+  // fewer, have completed, then stores up to |count| completed requests into
+  // |completions| and returns how many were stored. |wait| is ignored on the
+  // main thread, which never blocks.
+  size_t Reap(Request** completions, size_t count, size_t wait);
+
+  size_t inflight() const { return inflight_; }
+
+ private:
+  struct Context;
+  struct Operation;
+
+  static void Finish(Operation* operation);
+
+  Context* context_;
+  size_t depth_;
+  size_t inflight_;
+};
+
+}  // namespace naclfs
+
+#endif  // NACLFS_IO_QUEUE_H_
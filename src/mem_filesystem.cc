@@ -0,0 +1,620 @@
+//
+// Copyright (c) 2012, Takashi TOYOSHIMA <toyoshim@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// - Neither the name of the authors nor the names of its contributors may be
+//   used to endorse or promote products derived from this software with out
+//   specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUE
+// NTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+// GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.
+//
+
+#include "mem_filesystem.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sstream>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "directory_index.h"
+#include "naclfs.h"
+
+namespace {
+
+// Entry types kept in the directory index.
+enum EntryType {
+  kRegular = 0,
+  kDirectory
+};
+
+const mode_t kPermissions = S_IRWXU | S_IRWXG | S_IRWXO;
+
+class MemFileSystemDir : public naclfs::FileSystem::Dir {
+ public:
+  MemFileSystemDir(naclfs::MemFileSystem* owner)
+    : Dir(owner),
+      offset_(0) {}
+
+  virtual ~MemFileSystemDir() {}
+
+  naclfs::DirectoryIndex* index() { return &index_; }
+
+  struct dirent* ReadDirNext() {
+    if (offset_ >= index_.size())
+      return NULL;
+    memset(&dirent_, 0, sizeof(struct dirent));
+    size_t length = index_.length(offset_);
+    if (length >= sizeof(dirent_.d_name))
+      length = sizeof(dirent_.d_name) - 1;
+    memcpy(dirent_.d_name, index_.name(offset_), length);
+#if defined(_DIRENT_HAVE_D_TYPE)
+    dirent_.d_type = index_.type(offset_) == kDirectory ? DT_DIR : DT_REG;
+#endif  // defined(_DIRENT_HAVE_D_TYPE)
+    offset_++;
+    return &dirent_;
+  }
+
+  void Rewind() {
+    offset_ = 0;
+  }
+
+  long Tell() const {
+    return offset_;
+  }
+
+  void Seek(long offset) {
+    offset_ = offset < 0 ? 0 : offset;
+  }
+
+ private:
+  // Names listed when the directory was opened, in name order.
+  naclfs::DirectoryIndex index_;
+  size_t offset_;
+  struct dirent dirent_;
+};
+
+}  // namespace
+
+namespace naclfs {
+
+MemVolume::MemVolume(size_t capacity)
+    : root_(NULL),
+      next_ino_(1),
+      capacity_(capacity),
+      usage_(0) {
+  pthread_mutex_init(&mutex_, NULL);
+  root_ = CreateInode(S_IFDIR | kPermissions);
+}
+
+MemVolume::~MemVolume() {
+  DeleteInode(root_);
+  pthread_mutex_destroy(&mutex_);
+}
+
+FileSystem::Delegate* MemVolume::CreateDelegate(NaClFs* naclfs,
+                                                const char* mount_point) {
+  return new MemFileSystem(naclfs, this, mount_point);
+}
+
+void MemVolume::SetCapacity(size_t capacity) {
+  pthread_mutex_lock(&mutex_);
+  capacity_ = capacity;
+  pthread_mutex_unlock(&mutex_);
+}
+
+MemVolume::Inode* MemVolume::Lookup(const char* path, int* error) {
+  // Paths are normalized, so components are separated by single slashes.
+  Inode* inode = root_;
+  while (*path) {
+    if (*path == '/') {
+      path++;
+      continue;
+    }
+    if (!S_ISDIR(inode->mode)) {
+      *error = ENOTDIR;
+      return NULL;
+    }
+    const char* end = strchr(path, '/');
+    if (!end)
+      end = path + strlen(path);
+    std::map<std::string, Inode*>::iterator it =
+        inode->children.find(std::string(path, end - path));
+    if (it == inode->children.end()) {
+      *error = ENOENT;
+      return NULL;
+    }
+    inode = it->second;
+    path = end;
+  }
+  return inode;
+}
+
+MemVolume::Inode* MemVolume::LookupParent(const char* path,
+                                          std::string* name,
+                                          int* error) {
+  const char* slash = strrchr(path, '/');
+  const char* base = slash ? slash + 1 : path;
+  Inode* parent = root_;
+  if (slash) {
+    std::string directory(path, slash - path);
+    parent = Lookup(directory.c_str(), error);
+    if (!parent)
+      return NULL;
+  }
+  if (!S_ISDIR(parent->mode)) {
+    *error = ENOTDIR;
+    return NULL;
+  }
+  name->assign(base);
+  return parent;
+}
+
+MemVolume::Inode* MemVolume::CreateInode(mode_t mode) {
+  Inode* inode = new Inode;
+  inode->ino = next_ino_++;
+  inode->mode = mode;
+  inode->size = 0;
+  inode->atime = inode->mtime = inode->ctime = time(NULL);
+  return inode;
+}
+
+void MemVolume::DeleteInode(Inode* inode) {
+  for (std::map<std::string, Inode*>::iterator it = inode->children.begin();
+       it != inode->children.end(); ++it) {
+    DeleteInode(it->second);
+  }
+  Truncate(inode, 0);
+  delete inode;
+}
+
+void MemVolume::Truncate(Inode* inode, off_t size) {
+  uint64_t chunks = (size + kChunkSize - 1) / kChunkSize;
+  for (size_t i = chunks; i < inode->chunks.size(); ++i) {
+    if (!inode->chunks[i])
+      continue;
+    free(inode->chunks[i]);
+    usage_ -= kChunkSize;
+  }
+  if (chunks < inode->chunks.size()) {
+    // Give the index storage back too, as it counts toward the usage.
+    usage_ -= inode->chunks.capacity() * sizeof(char*);
+    std::vector<char*>(inode->chunks.begin(),
+                       inode->chunks.begin() + chunks).swap(inode->chunks);
+    usage_ += inode->chunks.capacity() * sizeof(char*);
+  }
+  // Clear the rest of the last chunk so that growing the file again reads
+  // zeros there.
+  size_t tail = size % kChunkSize;
+  if (tail && chunks && chunks <= inode->chunks.size() &&
+      inode->chunks[chunks - 1]) {
+    memset(&inode->chunks[chunks - 1][tail], 0, kChunkSize - tail);
+  }
+  if (inode->size != size) {
+    inode->size = size;
+    inode->mtime = inode->ctime = time(NULL);
+  }
+}
+
+ssize_t MemVolume::Read(Inode* inode, void* buf, size_t nbytes, off_t offset) {
+  if (offset >= inode->size)
+    return 0;
+  if (nbytes > static_cast<size_t>(inode->size - offset))
+    nbytes = inode->size - offset;
+  char* dst = static_cast<char*>(buf);
+  size_t done = 0;
+  while (done < nbytes) {
+    off_t position = offset + done;
+    uint64_t index = position / kChunkSize;
+    size_t start = position % kChunkSize;
+    size_t size = kChunkSize - start;
+    if (size > nbytes - done)
+      size = nbytes - done;
+    if (index < inode->chunks.size() && inode->chunks[index])
+      memcpy(&dst[done], &inode->chunks[index][start], size);
+    else
+      memset(&dst[done], 0, size);
+    done += size;
+  }
+  inode->atime = time(NULL);
+  return done;
+}
+
+ssize_t MemVolume::Write(Inode* inode,
+                         const void* buf,
+                         size_t nbytes,
+                         off_t offset) {
+  const char* src = static_cast<const char*>(buf);
+  size_t done = 0;
+  while (done < nbytes) {
+    off_t position = offset + done;
+    uint64_t index = position / kChunkSize;
+    size_t start = position % kChunkSize;
+    size_t size = kChunkSize - start;
+    if (size > nbytes - done)
+      size = nbytes - done;
+    char* chunk = index < inode->chunks.size() ? inode->chunks[index] : NULL;
+    if (!chunk) {
+      if (usage_ + kChunkSize > capacity_)
+        break;
+      // The index up to a chunk far beyond the end takes memory too, so it
+      // counts toward the capacity. This also keeps |index| within size_t.
+      size_t slots = inode->chunks.capacity();
+      if (index >= slots &&
+          index - slots >= (capacity_ - usage_ - kChunkSize) / sizeof(char*)) {
+        break;
+      }
+      chunk = static_cast<char*>(calloc(1, kChunkSize));
+      if (!chunk)
+        break;
+      if (index >= inode->chunks.size()) {
+        // Reserve exactly, as resize() alone may double the index.
+        inode->chunks.reserve(index + 1);
+        inode->chunks.resize(index + 1, NULL);
+        usage_ += (inode->chunks.capacity() - slots) * sizeof(char*);
+      }
+      inode->chunks[index] = chunk;
+      usage_ += kChunkSize;
+    }
+    memcpy(&chunk[start], &src[done], size);
+    done += size;
+  }
+  if (!done && nbytes) {
+    errno = ENOSPC;
+    return -1;
+  }
+  if (offset + static_cast<off_t>(done) > inode->size)
+    inode->size = offset + done;
+  inode->mtime = inode->ctime = time(NULL);
+  return done;
+}
+
+MemFileSystem::MemFileSystem(NaClFs* naclfs,
+                             MemVolume* volume,
+                             const char* mount_point)
+    : naclfs_(naclfs),
+      volume_(volume),
+      mount_length_(strcmp(mount_point, "/") ? strlen(mount_point) : 0),
+      inode_(NULL),
+      oflag_(0),
+      fd_flags_(0),
+      offset_(0) {
+  volume_->AddRef();
+}
+
+MemFileSystem::~MemFileSystem() {
+  volume_->Release();
+}
+
+int MemFileSystem::AccessMode() {
+  return oflag_ & O_ACCMODE;
+}
+
+int MemFileSystem::OpenCall(Arguments* arguments,
+                            const char* path,
+                            int oflag,
+                            mode_t cmode) {
+  int error = 0;
+  std::string name;
+  pthread_mutex_lock(&volume_->mutex_);
+  MemVolume::Inode* parent =
+      volume_->LookupParent(Relative(path), &name, &error);
+  MemVolume::Inode* inode = NULL;
+  if (parent && name.empty()) {
+    inode = parent;
+  } else if (parent) {
+    std::map<std::string, MemVolume::Inode*>::iterator it =
+        parent->children.find(name);
+    if (it != parent->children.end()) {
+      inode = it->second;
+    } else if (oflag & O_CREAT) {
+      // There is no idea of file owner, so |cmode| is not kept.
+      inode = volume_->CreateInode(S_IFREG | kPermissions);
+      parent->children[name] = inode;
+      parent->mtime = parent->ctime = inode->ctime;
+      oflag &= ~O_EXCL;
+    } else {
+      error = ENOENT;
+    }
+  }
+  if (inode) {
+    int mode = oflag & O_ACCMODE;
+    if ((oflag & O_CREAT) && (oflag & O_EXCL))
+      error = EEXIST;
+    else if (S_ISDIR(inode->mode) && mode != O_RDONLY)
+      error = EISDIR;
+    else if ((oflag & O_TRUNC) && mode != O_RDONLY)
+      volume_->Truncate(inode, 0);
+  }
+  pthread_mutex_unlock(&volume_->mutex_);
+  if (error)
+    return error;
+  inode_ = inode;
+  oflag_ = oflag;
+  fd_flags_ = 0;
+#if defined(O_CLOEXEC)
+  if (oflag & O_CLOEXEC)
+    fd_flags_ = FD_CLOEXEC;
+#endif
+  offset_ = 0;
+  return 0;
+}
+
+int MemFileSystem::StatCall(Arguments* arguments,
+                            const char* path,
+                            struct stat* buf) {
+  int error = 0;
+  pthread_mutex_lock(&volume_->mutex_);
+  MemVolume::Inode* inode = volume_->Lookup(Relative(path), &error);
+  if (inode)
+    InodeToStat(inode, buf);
+  pthread_mutex_unlock(&volume_->mutex_);
+  return error;
+}
+
+int MemFileSystem::CloseCall(Arguments* arguments) {
+  inode_ = NULL;
+  return 0;
+}
+
+int MemFileSystem::FstatCall(Arguments* arguments, struct stat* buf) {
+  if (!inode_)
+    return EBADF;
+  pthread_mutex_lock(&volume_->mutex_);
+  InodeToStat(inode_, buf);
+  pthread_mutex_unlock(&volume_->mutex_);
+  return 0;
+}
+
+ssize_t MemFileSystem::ReadCall(Arguments* arguments,
+                                void* buf,
+                                size_t nbytes) {
+  if (!inode_ || (oflag_ & O_ACCMODE) == O_WRONLY) {
+    errno = EBADF;
+    return -1;
+  }
+  if (S_ISDIR(inode_->mode)) {
+    errno = EISDIR;
+    return -1;
+  }
+  pthread_mutex_lock(&volume_->mutex_);
+  ssize_t result = volume_->Read(inode_, buf, nbytes, offset_);
+  if (result > 0)
+    offset_ += result;
+  pthread_mutex_unlock(&volume_->mutex_);
+  return result;
+}
+
+ssize_t MemFileSystem::WriteCall(Arguments* arguments,
+                                 const void* buf,
+                                 size_t nbytes) {
+  if (!inode_ || (oflag_ & O_ACCMODE) == O_RDONLY) {
+    errno = EBADF;
+    return -1;
+  }
+  pthread_mutex_lock(&volume_->mutex_);
+  if (oflag_ & O_APPEND)
+    offset_ = inode_->size;
+  ssize_t result = volume_->Write(inode_, buf, nbytes, offset_);
+  if (result > 0)
+    offset_ += result;
+  pthread_mutex_unlock(&volume_->mutex_);
+  return result;
+}
+
+ssize_t MemFileSystem::PReadCall(Arguments* arguments,
+                                 void* buf,
+                                 size_t nbytes,
+                                 off_t offset) {
+  if (!inode_ || (oflag_ & O_ACCMODE) == O_WRONLY) {
+    errno = EBADF;
+    return -1;
+  }
+  if (S_ISDIR(inode_->mode)) {
+    errno = EISDIR;
+    return -1;
+  }
+  pthread_mutex_lock(&volume_->mutex_);
+  ssize_t result = volume_->Read(inode_, buf, nbytes, offset);
+  pthread_mutex_unlock(&volume_->mutex_);
+  return result;
+}
+
+ssize_t MemFileSystem::PWriteCall(Arguments* arguments,
+                                  const void* buf,
+                                  size_t nbytes,
+                                  off_t offset) {
+  if (!inode_ || (oflag_ & O_ACCMODE) == O_RDONLY) {
+    errno = EBADF;
+    return -1;
+  }
+  pthread_mutex_lock(&volume_->mutex_);
+  ssize_t result = volume_->Write(inode_, buf, nbytes, offset);
+  pthread_mutex_unlock(&volume_->mutex_);
+  return result;
+}
+
+off_t MemFileSystem::SeekCall(Arguments* arguments, off_t offset, int whence) {
+  if (!inode_) {
+    errno = EBADF;
+    return -1;
+  }
+  pthread_mutex_lock(&volume_->mutex_);
+  off_t base = 0;
+  switch (whence) {
+    case SEEK_SET:
+      break;
+    case SEEK_CUR:
+      base = offset_;
+      break;
+    case SEEK_END:
+      base = inode_->size;
+      break;
+    default:
+      base = -1;
+      break;
+  }
+  off_t result = -1;
+  if (base >= 0 && base + offset >= 0) {
+    offset_ = base + offset;
+    result = offset_;
+  }
+  pthread_mutex_unlock(&volume_->mutex_);
+  if (result < 0)
+    errno = EINVAL;
+  return result;
+}
+
+int MemFileSystem::FcntlCall(Arguments* arguments, int cmd, va_list* ap) {
+  switch (cmd) {
+    case F_GETFD:
+      return fd_flags_;
+    case F_SETFD:
+      fd_flags_ = va_arg(*ap, long) & FD_CLOEXEC;
+      return 0;
+    case F_GETFL:
+      return oflag_;
+    case F_SETFL: {
+      long arg = va_arg(*ap, long);
+      oflag_ = (oflag_ & ~O_APPEND) | (arg & O_APPEND);
+      return 0;
+    }
+    default: {
+      std::ostringstream ss;
+      ss << "MemFileSystem::Fcntl not supported cmd=" << cmd << "\n";
+      naclfs_->Log(ss.str().c_str());
+      errno = ENOSYS;
+      return -1;
+    }
+  }
+}
+
+int MemFileSystem::MkDirCall(Arguments* arguments,
+                             const char* path,
+                             mode_t mode) {
+  int error = 0;
+  std::string name;
+  pthread_mutex_lock(&volume_->mutex_);
+  MemVolume::Inode* parent =
+      volume_->LookupParent(Relative(path), &name, &error);
+  if (parent && (name.empty() || parent->children.count(name))) {
+    error = EEXIST;
+  } else if (parent) {
+    MemVolume::Inode* inode = volume_->CreateInode(S_IFDIR | kPermissions);
+    parent->children[name] = inode;
+    parent->mtime = parent->ctime = inode->ctime;
+  }
+  pthread_mutex_unlock(&volume_->mutex_);
+  if (error) {
+    errno = error;
+    return -1;
+  }
+  return 0;
+}
+
+DIR* MemFileSystem::OpenDirCall(Arguments* arguments, const char* dirname) {
+  int error = 0;
+  MemFileSystemDir* dir = NULL;
+  pthread_mutex_lock(&volume_->mutex_);
+  MemVolume::Inode* inode = volume_->Lookup(Relative(dirname), &error);
+  if (inode && !S_ISDIR(inode->mode)) {
+    error = ENOTDIR;
+  } else if (inode) {
+    // Listing a snapshot keeps positions stable while the directory changes.
+    dir = new MemFileSystemDir(this);
+    DirectoryIndex* index = dir->index();
+    index->Reserve(inode->children.size(), 0);
+    for (std::map<std::string, MemVolume::Inode*>::iterator it =
+             inode->children.begin();
+         it != inode->children.end(); ++it) {
+      index->Add(it->first.c_str(), it->first.size(),
+                 S_ISDIR(it->second->mode) ? kDirectory : kRegular);
+    }
+  }
+  pthread_mutex_unlock(&volume_->mutex_);
+  if (error)
+    errno = error;
+  return reinterpret_cast<DIR*>(dir);
+}
+
+void MemFileSystem::RewindDirCall(Arguments* arguments, DIR* dirp) {
+  MemFileSystemDir* dir = reinterpret_cast<MemFileSystemDir*>(dirp);
+  if (dir)
+    dir->Rewind();
+}
+
+struct dirent* MemFileSystem::ReadDirCall(Arguments* arguments, DIR* dirp) {
+  MemFileSystemDir* dir = reinterpret_cast<MemFileSystemDir*>(dirp);
+  if (!dir)
+    return NULL;
+  return dir->ReadDirNext();
+}
+
+long MemFileSystem::TellDirCall(Arguments* arguments, DIR* dirp) {
+  MemFileSystemDir* dir = reinterpret_cast<MemFileSystemDir*>(dirp);
+  if (!dir)
+    return -1;
+  return dir->Tell();
+}
+
+void MemFileSystem::SeekDirCall(Arguments* arguments, DIR* dirp, long offset) {
+  MemFileSystemDir* dir = reinterpret_cast<MemFileSystemDir*>(dirp);
+  if (dir)
+    dir->Seek(offset);
+}
+
+int MemFileSystem::CloseDirCall(Arguments* arguments, DIR* dirp) {
+  MemFileSystemDir* dir = reinterpret_cast<MemFileSystemDir*>(dirp);
+  if (!dir)
+    return -1;
+  delete dir;
+  return 0;
+}
+
+const char* MemFileSystem::Relative(const char* path) const {
+  return &path[mount_length_];
+}
+
+void MemFileSystem::InodeToStat(const MemVolume::Inode* inode,
+                                struct stat* buf) {
+  memset(buf, 0, sizeof(struct stat));
+  buf->st_ino = inode->ino;
+  buf->st_mode = inode->mode;
+  buf->st_nlink = 1;
+  buf->st_size = inode->size;
+  buf->st_atime = inode->atime;
+  buf->st_mtime = inode->mtime;
+  buf->st_ctime = inode->ctime;
+  buf->st_blksize = MemVolume::kChunkSize;
+  size_t chunks = 0;
+  for (size_t i = 0; i < inode->chunks.size(); ++i) {
+    if (inode->chunks[i])
+      chunks++;
+  }
+  buf->st_blocks = chunks * (MemVolume::kChunkSize >> 9);
+}
+
+}  // namespace naclfs
@@ -0,0 +1,176 @@
+//
+// Copyright (c) 2012, Takashi TOYOSHIMA <toyoshim@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// - Neither the name of the authors nor the names of its contributors may be
+//   used to endorse or promote products derived from this software with out
+//   specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUE
+// NTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+// GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.
+//
+
+#ifndef NACLFS_MEM_FILESYSTEM_H_
+#define NACLFS_MEM_FILESYSTEM_H_
+#pragma once
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "filesystem.h"
+
+namespace naclfs {
+
+class MemFileSystem;
+class NaClFs;
+
+// A tree of in-memory files and directories with its own memory limit,
+// served by MemFileSystem delegates. A volume stays alive while it is mounted
+// or a delegate for it is in use.
+class MemVolume : public FileSystem::Backend {
+ public:
+  // Files keep their data in chunks of this size, allocated as they are
+  // written. Chunks in holes are never allocated and read as zeros.
+  static const size_t kChunkSize = 16 * 1024;
+
+  explicit MemVolume(size_t capacity);
+  virtual ~MemVolume();
+
+  virtual FileSystem::Delegate* CreateDelegate(NaClFs* naclfs,
+                                               const char* mount_point);
+
+  // Limits the memory file data and the chunk indexes may take. Chunks
+  // already allocated are kept, but writes which need new chunks beyond
+  // |capacity| bytes fail with ENOSPC.
+  void SetCapacity(size_t capacity);
+  size_t capacity() const { return capacity_; }
+  size_t usage() const { return usage_; }
+
+ private:
+  struct Inode {
+    ino_t ino;
+    mode_t mode;
+    off_t size;
+    time_t atime;
+    time_t mtime;
+    time_t ctime;
+    std::vector<char*> chunks;
+    std::map<std::string, Inode*> children;
+  };
+
+  // Returns the inode |path| relative to the volume root names, or NULL
+  // with |*error| set. Called with |mutex_| held.
+  Inode* Lookup(const char* path, int* error);
+  // Returns the directory which holds the last component of |path|, and
+  // sets |*name| to that component. Called with |mutex_| held.
+  Inode* LookupParent(const char* path, std::string* name, int* error);
+  Inode* CreateInode(mode_t mode);
+  void DeleteInode(Inode* inode);
+  // Drops the data of |inode| past |size|. Called with |mutex_| held.
+  void Truncate(Inode* inode, off_t size);
+  // Copies data between |inode| and |buf|. Write returns -1 with ENOSPC if
+  // no byte fit. Called with |mutex_| held.
+  ssize_t Read(Inode* inode, void* buf, size_t nbytes, off_t offset);
+  ssize_t Write(Inode* inode, const void* buf, size_t nbytes, off_t offset);
+
+  pthread_mutex_t mutex_;
+  Inode* root_;
+  ino_t next_ino_;
+  size_t capacity_;
+  size_t usage_;
+
+  friend class MemFileSystem;
+};  // class MemVolume
+
+// File system kept in process memory, for scratch files which need not
+// outlive the module. Every operation runs on the calling thread under the
+// volume lock, so unlike the HTML5 file system it costs no main thread
+// round trip and works for any number of threads at once.
+class MemFileSystem : public FileSystem::Delegate {
+ public:
+  // Serves |volume| mounted at |mount_point|, which paths given to this
+  // delegate start with. Holds a reference to |volume|.
+  MemFileSystem(NaClFs* naclfs, MemVolume* volume, const char* mount_point);
+  virtual ~MemFileSystem();
+
+  virtual int AccessMode();
+
+  virtual int OpenCall(Arguments* arguments,
+                       const char* path,
+                       int oflag,
+                       mode_t cmode);
+  virtual int StatCall(Arguments* arguments,
+                       const char* path,
+                       struct stat* buf);
+  virtual int CloseCall(Arguments* arguments);
+  virtual int FstatCall(Arguments* arguments, struct stat* buf);
+  virtual ssize_t ReadCall(Arguments* arguments, void* buf, size_t nbytes);
+  virtual ssize_t WriteCall(Arguments* arguments,
+                            const void* buf,
+                            size_t nbytes);
+  virtual ssize_t PReadCall(Arguments* arguments,
+                            void* buf,
+                            size_t nbytes,
+                            off_t offset);
+  virtual ssize_t PWriteCall(Arguments* arguments,
+                             const void* buf,
+                             size_t nbytes,
+                             off_t offset);
+  virtual off_t SeekCall(Arguments* arguments, off_t offset, int whence);
+  virtual int IsATtyCall(Arguments* arguments) { return ENOTTY; }
+  virtual int FcntlCall(Arguments* arguments, int cmd, va_list* ap);
+  virtual int FsyncCall(Arguments* arguments) { return 0; }
+  virtual int MkDirCall(Arguments* arguments, const char* path, mode_t mode);
+  virtual DIR* OpenDirCall(Arguments* arguments, const char* dirname);
+  virtual void RewindDirCall(Arguments* arguments, DIR* dirp);
+  virtual struct dirent* ReadDirCall(Arguments* arguments, DIR* dirp);
+  virtual long TellDirCall(Arguments* arguments, DIR* dirp);
+  virtual void SeekDirCall(Arguments* arguments, DIR* dirp, long offset);
+  virtual int CloseDirCall(Arguments* arguments, DIR* dirp);
+
+ protected:
+  virtual bool IsLocal(const Arguments& arguments) const { return true; }
+
+ private:
+  // Returns |path| relative to the mount point.
+  const char* Relative(const char* path) const;
+  static void InodeToStat(const MemVolume::Inode* inode, struct stat* buf);
+
+  NaClFs* naclfs_;
+  MemVolume* volume_;
+  size_t mount_length_;
+  MemVolume::Inode* inode_;
+  int oflag_;
+  // Descriptor flags, FD_CLOEXEC or 0. Kept for F_GETFD since nothing here
+  // execs.
+  int fd_flags_;
+  off_t offset_;
+};
+
+}  // namespace naclfs
+
+#endif  // NACLFS_MEM_FILESYSTEM_H_
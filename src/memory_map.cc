@@ -0,0 +1,307 @@
+//
+// Copyright (c) 2012, Takashi TOYOSHIMA <toyoshim@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// - Neither the name of the authors nor the names of its contributors may be
+//   used to endorse or promote products derived from this software with out
+//   specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUE
+// NTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+// GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.
+//
+
+#include "memory_map.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+
+#if !defined(MS_SYNC)
+#  define MS_SYNC 4
+#endif  // !defined(MS_SYNC)
+
+namespace naclfs {
+
+pthread_once_t MemoryMap::once_ = PTHREAD_ONCE_INIT;
+MemoryMap* MemoryMap::instance_ = NULL;
+volatile int32_t MemoryMap::mappings_ = 0;
+
+MemoryMap* MemoryMap::GetInstance() {
+  pthread_once(&once_, Create);
+  return instance_;
+}
+
+int MemoryMap::Map(FileSystem::Delegate* delegate,
+                   void* addr,
+                   size_t length,
+                   int prot,
+                   int flags,
+                   off_t offset) {
+  if (!length || offset < 0 || offset % kPageSize)
+    return EINVAL;
+  // The file is always read in, and shared writes go back to it.
+  int mode = delegate->AccessMode();
+  if (mode == O_WRONLY ||
+      ((flags & MAP_SHARED) && (prot & PROT_WRITE) && mode != O_RDWR)) {
+    return EACCES;
+  }
+  struct stat buf;
+  int error = delegate->Fstat(&buf);
+  if (error)
+    return error;
+  if (!S_ISREG(buf.st_mode))
+    return ENODEV;
+
+  // Read in the part of the range the file backs. The rest stays zero.
+  char* start = static_cast<char*>(addr);
+  size_t limit = 0;
+  if (buf.st_size > offset) {
+    limit = buf.st_size - offset;
+    if (limit > length)
+      limit = length;
+  }
+  size_t done = 0;
+  while (done < limit) {
+    ssize_t result = delegate->PRead(&start[done], limit - done, offset + done);
+    if (result < 0)
+      return EIO;
+    if (!result)
+      break;
+    done += result;
+  }
+  if (!(flags & MAP_SHARED) || !(prot & PROT_WRITE))
+    return 0;
+
+  Mapping mapping;
+  mapping.start = start;
+  mapping.length = (length + kPageSize - 1) / kPageSize * kPageSize;
+  mapping.delegate = delegate;
+  mapping.offset = offset;
+  mapping.limit = done;
+  mapping.sums.resize(mapping.length / kPageSize);
+  for (size_t i = 0; i < mapping.sums.size(); ++i)
+    mapping.sums[i] = Checksum(&start[i * kPageSize], kPageSize);
+  delegate->AddRef();
+  pthread_mutex_lock(&mutex_);
+  map_[reinterpret_cast<uintptr_t>(start)] = mapping;
+  __sync_fetch_and_add(&mappings_, 1);
+  pthread_mutex_unlock(&mutex_);
+  return 0;
+}
+
+int MemoryMap::Unmap(void* addr, size_t length) {
+  if (empty())
+    return 0;
+  if (reinterpret_cast<uintptr_t>(addr) % kPageSize)
+    return EINVAL;
+  std::vector<Mapping> pieces;
+  pthread_mutex_lock(&mutex_);
+  Collect(static_cast<char*>(addr), length, true, &pieces);
+  pthread_mutex_unlock(&mutex_);
+
+  // Write back without the lock, since the delegate may allocate and so
+  // unmap memory on this thread.
+  int error = 0;
+  for (size_t i = 0; i < pieces.size(); ++i) {
+    int result = WriteBack(&pieces[i]);
+    if (!error)
+      error = result;
+    pieces[i].delegate->Release();
+  }
+  return error;
+}
+
+int MemoryMap::Sync(void* addr, size_t length, int flags) {
+  if (empty())
+    return 0;
+  if (reinterpret_cast<uintptr_t>(addr) % kPageSize)
+    return EINVAL;
+  std::vector<Mapping> pieces;
+  pthread_mutex_lock(&mutex_);
+  Collect(static_cast<char*>(addr), length, false, &pieces);
+  pthread_mutex_unlock(&mutex_);
+
+  int error = 0;
+  for (size_t i = 0; i < pieces.size(); ++i) {
+    int result = WriteBack(&pieces[i]);
+    Update(pieces[i]);
+    if (!result && (flags & MS_SYNC))
+      result = pieces[i].delegate->Fsync();
+    if (!error)
+      error = result;
+    pieces[i].delegate->Release();
+  }
+  return error;
+}
+
+MemoryMap::MemoryMap() {
+  pthread_mutex_init(&mutex_, NULL);
+}
+
+MemoryMap::~MemoryMap() {
+  pthread_mutex_destroy(&mutex_);
+}
+
+void MemoryMap::Create() {
+  instance_ = new MemoryMap;
+}
+
+uint64_t MemoryMap::Checksum(const char* data, size_t size) {
+  // FNV-1a over 64-bit words. Each step is a bijection of the running hash,
+  // so a change within a single word is always detected.
+  uint64_t hash = 14695981039346656037ULL;
+  size_t i = 0;
+  for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, &data[i], sizeof(word));
+    hash = (hash ^ word) * 1099511628211ULL;
+  }
+  for (; i < size; ++i)
+    hash = (hash ^ static_cast<uint8_t>(data[i])) * 1099511628211ULL;
+  return hash;
+}
+
+void MemoryMap::Collect(char* addr,
+                        size_t length,
+                        bool detach,
+                        std::vector<Mapping>* pieces) {
+  uintptr_t begin = reinterpret_cast<uintptr_t>(addr);
+  uintptr_t end = begin + (length + kPageSize - 1) / kPageSize * kPageSize;
+  MappingMap::iterator it = map_.upper_bound(begin);
+  if (it != map_.begin())
+    --it;
+  while (it != map_.end() && it->first < end) {
+    uintptr_t start = it->first;
+    uintptr_t stop = start + it->second.length;
+    if (stop <= begin) {
+      ++it;
+      continue;
+    }
+
+    // Split |mapping| into the overlapping piece and the parts around it.
+    Mapping mapping = it->second;
+    uintptr_t from = start < begin ? begin : start;
+    uintptr_t to = stop > end ? end : stop;
+    Mapping parts[3];
+    uintptr_t bounds[4] = { start, from, to, stop };
+    for (int i = 0; i < 3; ++i) {
+      size_t skip = bounds[i] - start;
+      Mapping& part = parts[i];
+      part.start = mapping.start + skip;
+      part.length = bounds[i + 1] - bounds[i];
+      part.delegate = mapping.delegate;
+      part.offset = mapping.offset + skip;
+      part.limit = 0;
+      if (mapping.limit > skip) {
+        part.limit = mapping.limit - skip;
+        if (part.limit > part.length)
+          part.limit = part.length;
+      }
+      part.sums.assign(
+          mapping.sums.begin() + skip / kPageSize,
+          mapping.sums.begin() + (skip + part.length) / kPageSize);
+    }
+    mapping.delegate->AddRef();
+    pieces->push_back(parts[1]);
+    if (!detach) {
+      ++it;
+      continue;
+    }
+
+    // The table's reference moves to the first part which stays tracked.
+    bool referenced = false;
+    map_.erase(it++);
+    __sync_fetch_and_sub(&mappings_, 1);
+    for (int i = 0; i < 3; i += 2) {
+      if (!parts[i].length)
+        continue;
+      if (referenced)
+        mapping.delegate->AddRef();
+      referenced = true;
+      map_[bounds[i]] = parts[i];
+      __sync_fetch_and_add(&mappings_, 1);
+    }
+    if (!referenced)
+      mapping.delegate->Release();
+  }
+}
+
+int MemoryMap::WriteBack(Mapping* piece) {
+  // Write runs of dirty pages, never past the part the file backed.
+  int error = 0;
+  size_t pages = piece->sums.size();
+  std::vector<uint64_t> sums(pages);
+  size_t run = 0;
+  bool dirty = false;
+  for (size_t i = 0; i <= pages; ++i) {
+    bool changed = false;
+    if (i < pages && i * kPageSize < piece->limit) {
+      sums[i] = Checksum(&piece->start[i * kPageSize], kPageSize);
+      changed = sums[i] != piece->sums[i];
+    }
+    if (changed) {
+      if (!dirty)
+        run = i;
+      dirty = true;
+      continue;
+    }
+    if (!dirty)
+      continue;
+    dirty = false;
+    size_t from = run * kPageSize;
+    size_t to = i * kPageSize;
+    if (to > piece->limit)
+      to = piece->limit;
+    ssize_t result = piece->delegate->PWrite(
+        &piece->start[from], to - from, piece->offset + from);
+    if (result != static_cast<ssize_t>(to - from)) {
+      error = EIO;
+      continue;
+    }
+    for (size_t j = run; j < i; ++j)
+      piece->sums[j] = sums[j];
+  }
+  return error;
+}
+
+void MemoryMap::Update(const Mapping& piece) {
+  uintptr_t begin = reinterpret_cast<uintptr_t>(piece.start);
+  pthread_mutex_lock(&mutex_);
+  MappingMap::iterator it = map_.upper_bound(begin);
+  if (it != map_.begin()) {
+    --it;
+    Mapping& mapping = it->second;
+    // The mapping may have been split or replaced meanwhile.
+    if (mapping.delegate == piece.delegate &&
+        it->first + mapping.length >= begin + piece.length) {
+      std::copy(piece.sums.begin(), piece.sums.end(),
+                mapping.sums.begin() + (begin - it->first) / kPageSize);
+    }
+  }
+  pthread_mutex_unlock(&mutex_);
+}
+
+}  // namespace naclfs
@@ -0,0 +1,123 @@
+//
+// Copyright (c) 2012, Takashi TOYOSHIMA <toyoshim@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// - Neither the name of the authors nor the names of its contributors may be
+//   used to endorse or promote products derived from this software with out
+//   specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUE
+// NTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+// GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.
+//
+
+#ifndef NACLFS_MEMORY_MAP_H_
+#define NACLFS_MEMORY_MAP_H_
+#pragma once
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <map>
+#include <vector>
+
+#include "filesystem.h"
+
+namespace naclfs {
+
+// File backed mappings emulated on anonymous memory. NaCl modules can not
+// catch page faults, so a mapped range is read in as a whole when it is
+// mapped, through the delegate and so through the page cache.
+//
+// Shared writable mappings are tracked with a checksum per page taken when
+// the page was last in sync with the file. Sync() and Unmap() write back the
+// pages whose contents no longer match it. Only the part of a mapping which
+// was backed by the file when it was mapped is ever written back.
+class MemoryMap {
+ public:
+  static const size_t kPageSize = 4096;
+
+  static MemoryMap* GetInstance();
+
+  // Returns true if no mapping is tracked. Cheap and safe to call at any
+  // time, so that unrelated munmap() calls do not take the lock.
+  static bool empty() { return !mappings_; }
+
+  // Reads |length| bytes at |offset| of the file behind |delegate| into
+  // |addr|, and tracks the range if |prot| and |flags| make it a shared
+  // writable mapping. Fails with EACCES unless the file was opened for
+  // reading, and for writing as well for a shared writable mapping.
+  // Returns an errno value.
+  int Map(FileSystem::Delegate* delegate,
+          void* addr,
+          size_t length,
+          int prot,
+          int flags,
+          off_t offset);
+  // Writes back dirty pages in |length| bytes at |addr| and stops tracking
+  // them. Returns an errno value.
+  int Unmap(void* addr, size_t length);
+  // Writes back dirty pages in |length| bytes at |addr|, and makes them
+  // durable if |flags| has MS_SYNC. Returns an errno value.
+  int Sync(void* addr, size_t length, int flags);
+
+ private:
+  struct Mapping {
+    char* start;
+    size_t length;
+    FileSystem::Delegate* delegate;
+    off_t offset;
+    // Bytes from |start| which were backed by the file at map time.
+    size_t limit;
+    std::vector<uint64_t> sums;
+  };
+  typedef std::map<uintptr_t, Mapping> MappingMap;
+
+  MemoryMap();
+  ~MemoryMap();
+
+  static void Create();
+  static uint64_t Checksum(const char* data, size_t size);
+
+  // Copies the parts of tracked mappings overlapping |length| bytes at
+  // |addr| into |pieces|, each holding a delegate reference. With |detach|
+  // the parts stop being tracked.
+  void Collect(char* addr,
+               size_t length,
+               bool detach,
+               std::vector<Mapping>* pieces);
+  // Writes back the dirty pages of |piece| and updates its checksums.
+  int WriteBack(Mapping* piece);
+  // Stores the checksums of a written back |piece| into its mapping.
+  void Update(const Mapping& piece);
+
+  static pthread_once_t once_;
+  static MemoryMap* instance_;
+  static volatile int32_t mappings_;
+
+  MappingMap map_;
+  pthread_mutex_t mutex_;
+};
+
+}  // namespace naclfs
+
+#endif  // NACLFS_MEMORY_MAP_H_
@@ -0,0 +1,246 @@
+//
+// Copyright (c) 2012, Takashi TOYOSHIMA <toyoshim@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// - Neither the name of the authors nor the names of its contributors may be
+//   used to endorse or promote products derived from this software with out
+//   specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUE
+// NTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+// GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.
+//
+
+#include "mount_table.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <string.h>
+
+namespace naclfs {
+
+MountTable::MountTable()
+    : readers_(0) {
+  pthread_mutex_init(&mutex_, NULL);
+  Snapshot* snapshot = new Snapshot;
+  snapshot->references = 1;
+  snapshot->root = new Node;
+  snapshot->root->path = "/";
+  snapshot->root->backend = NULL;
+  snapshot->root->flags = 0;
+  current_ = snapshot;
+}
+
+MountTable::~MountTable() {
+  Release(current_);
+  pthread_mutex_destroy(&mutex_);
+}
+
+int MountTable::Mount(const char* path,
+                      FileSystem::Backend* backend,
+                      int flags) {
+  pthread_mutex_lock(&mutex_);
+  Node* root = CopyNode(current_->root);
+  Node* node = Find(root, path, true, NULL);
+  if (node->backend) {
+    DeleteNode(root);
+    pthread_mutex_unlock(&mutex_);
+    return EBUSY;
+  }
+  node->backend = backend;
+  node->flags = flags;
+  Snapshot* snapshot = new Snapshot;
+  snapshot->references = 1;
+  snapshot->root = root;
+  Publish(snapshot);
+  pthread_mutex_unlock(&mutex_);
+  return 0;
+}
+
+int MountTable::Unmount(const char* path) {
+  pthread_mutex_lock(&mutex_);
+  Node* node = Find(current_->root, path, false, NULL);
+  if (!node || !node->backend) {
+    pthread_mutex_unlock(&mutex_);
+    return EINVAL;
+  }
+  std::vector<Node*> trail;
+  Node* root = CopyNode(current_->root);
+  node = Find(root, path, false, &trail);
+  node->backend->Release();
+  node->backend = NULL;
+  // Drop the nodes which lead to no mount point any more.
+  for (size_t i = trail.size() - 1; i > 0; --i) {
+    Node* child = trail[i];
+    if (child->backend || !child->children.empty())
+      break;
+    std::vector<Node*>& siblings = trail[i - 1]->children;
+    for (size_t j = 0; j < siblings.size(); ++j) {
+      if (siblings[j] == child) {
+        siblings.erase(siblings.begin() + j);
+        break;
+      }
+    }
+    delete child;
+  }
+  Snapshot* snapshot = new Snapshot;
+  snapshot->references = 1;
+  snapshot->root = root;
+  // Lookups on the old snapshot and delegates created from the backend may
+  // still hold references to it.
+  Publish(snapshot);
+  pthread_mutex_unlock(&mutex_);
+  return 0;
+}
+
+FileSystem::Delegate* MountTable::CreateDelegate(NaClFs* naclfs,
+                                                 const char* path,
+                                                 int* flags) {
+  Snapshot* snapshot = Acquire();
+  Node* node = snapshot->root;
+  Node* mount = node->backend ? node : NULL;
+  while (*path) {
+    if (*path == '/') {
+      path++;
+      continue;
+    }
+    const char* end = strchr(path, '/');
+    if (!end)
+      end = path + strlen(path);
+    node = FindChild(node, path, end - path);
+    if (!node)
+      break;
+    if (node->backend)
+      mount = node;
+    path = end;
+  }
+  // The snapshot holds a reference to the backend, so that it can not be
+  // released by a concurrent Unmount() meanwhile.
+  FileSystem::Delegate* delegate = NULL;
+  if (mount) {
+    delegate = mount->backend->CreateDelegate(naclfs, mount->path.c_str());
+    if (flags)
+      *flags = mount->flags;
+  }
+  Release(snapshot);
+  return delegate;
+}
+
+MountTable::Snapshot* MountTable::Acquire() {
+  // Both atomic operations are full barriers, which pairs with the barrier
+  // in Publish(): either this reader sees the new snapshot, or Publish()
+  // sees the reader and waits for it.
+  __sync_fetch_and_add(&readers_, 1);
+  Snapshot* snapshot = current_;
+  __sync_fetch_and_add(&snapshot->references, 1);
+  __sync_fetch_and_sub(&readers_, 1);
+  return snapshot;
+}
+
+void MountTable::Release(Snapshot* snapshot) {
+  if (__sync_sub_and_fetch(&snapshot->references, 1))
+    return;
+  DeleteNode(snapshot->root);
+  delete snapshot;
+}
+
+void MountTable::Publish(Snapshot* snapshot) {
+  Snapshot* old = current_;
+  current_ = snapshot;
+  __sync_synchronize();
+  while (readers_)
+    sched_yield();
+  Release(old);
+}
+
+MountTable::Node* MountTable::Find(Node* root,
+                                   const char* path,
+                                   bool create,
+                                   std::vector<Node*>* trail) {
+  Node* node = root;
+  if (trail)
+    trail->push_back(node);
+  while (*path) {
+    if (*path == '/') {
+      path++;
+      continue;
+    }
+    const char* end = strchr(path, '/');
+    if (!end)
+      end = path + strlen(path);
+    Node* child = FindChild(node, path, end - path);
+    if (!child) {
+      if (!create)
+        return NULL;
+      child = new Node;
+      child->name.assign(path, end - path);
+      child->path = node == root ? "" : node->path;
+      child->path += "/" + child->name;
+      child->backend = NULL;
+      child->flags = 0;
+      node->children.push_back(child);
+    }
+    node = child;
+    if (trail)
+      trail->push_back(node);
+    path = end;
+  }
+  return node;
+}
+
+MountTable::Node* MountTable::FindChild(Node* node,
+                                        const char* name,
+                                        size_t length) {
+  // Tables hold a handful of mount points, so a scan without allocating a
+  // key beats a map here.
+  for (size_t i = 0; i < node->children.size(); ++i) {
+    Node* child = node->children[i];
+    if (child->name.size() == length &&
+        !memcmp(child->name.data(), name, length)) {
+      return child;
+    }
+  }
+  return NULL;
+}
+
+MountTable::Node* MountTable::CopyNode(const Node* node) {
+  Node* copy = new Node;
+  copy->name = node->name;
+  copy->path = node->path;
+  copy->backend = node->backend;
+  copy->flags = node->flags;
+  if (copy->backend)
+    copy->backend->AddRef();
+  copy->children.reserve(node->children.size());
+  for (size_t i = 0; i < node->children.size(); ++i)
+    copy->children.push_back(CopyNode(node->children[i]));
+  return copy;
+}
+
+void MountTable::DeleteNode(Node* node) {
+  for (size_t i = 0; i < node->children.size(); ++i)
+    DeleteNode(node->children[i]);
+  if (node->backend)
+    node->backend->Release();
+  delete node;
+}
+
+}  // namespace naclfs
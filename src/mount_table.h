@@ -0,0 +1,117 @@
+//
+// Copyright (c) 2012, Takashi TOYOSHIMA <toyoshim@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// - Neither the name of the authors nor the names of its contributors may be
+//   used to endorse or promote products derived from this software with out
+//   specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUE
+// NTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+// GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.
+//
+
+#ifndef NACLFS_MOUNT_TABLE_H_
+#define NACLFS_MOUNT_TABLE_H_
+#pragma once
+
+#include <pthread.h>
+
+#include <string>
+#include <vector>
+
+#include "filesystem.h"
+
+namespace naclfs {
+
+class NaClFs;
+
+// Maps absolute paths to the backends mounted over them. Mount points are
+// kept in a trie keyed by path components, so that a lookup walks the path
+// once and picks the deepest mount point on the way, however many mounts
+// there are. Mount points match whole components only, so "/tmp" covers
+// "/tmp/a" but not "/tmpfile".
+//
+// Lookups take no lock. The trie is an immutable, reference counted
+// snapshot, and Mount() and Unmount() publish a modified copy in its place.
+// Lookups count themselves in |readers_| only while they load the snapshot
+// and take a reference to it, and a writer waits for that count to drain
+// before it drops the table's reference to the old snapshot.
+class MountTable {
+ public:
+  MountTable();
+  ~MountTable();
+
+  // Mounts |backend| at the absolute, normalized |path| with |flags|. The
+  // table takes over the caller's reference on success. Returns EBUSY if a
+  // backend is mounted at |path| already.
+  int Mount(const char* path, FileSystem::Backend* backend, int flags);
+  // Returns EINVAL if no backend is mounted at |path|.
+  int Unmount(const char* path);
+  // Creates a delegate for the absolute, normalized |path| from the backend
+  // mounted at the deepest mount point covering it, and stores the mount
+  // flags into |*flags| unless |flags| is NULL. Returns NULL if no mount
+  // point covers |path|.
+  FileSystem::Delegate* CreateDelegate(NaClFs* naclfs,
+                                       const char* path,
+                                       int* flags);
+
+ private:
+  struct Node {
+    // Path component this node adds to its parent.
+    std::string name;
+    // The full mount point, and what is mounted there if anything. Each
+    // snapshot holds its own reference to |backend|.
+    std::string path;
+    FileSystem::Backend* backend;
+    int flags;
+    std::vector<Node*> children;
+  };
+  struct Snapshot {
+    volatile int32_t references;
+    Node* root;
+  };
+
+  // Returns the current snapshot with a reference taken for the caller.
+  Snapshot* Acquire();
+  static void Release(Snapshot* snapshot);
+  // Replaces the current snapshot with |snapshot|. Called with |mutex_|
+  // held.
+  void Publish(Snapshot* snapshot);
+  // Returns the node for |path| in |root|, adding missing nodes if |create|
+  // is true. Fills |trail| with the nodes from the root when it is given.
+  static Node* Find(Node* root,
+                    const char* path,
+                    bool create,
+                    std::vector<Node*>* trail);
+  static Node* FindChild(Node* node, const char* name, size_t length);
+  static Node* CopyNode(const Node* node);
+  static void DeleteNode(Node* node);
+
+  // Serializes Mount() and Unmount().
+  pthread_mutex_t mutex_;
+  Snapshot* volatile current_;
+  volatile uint32_t readers_;
+};
+
+}  // namespace naclfs
+
+#endif  // NACLFS_MOUNT_TABLE_H_
@@ -34,7 +34,13 @@
 #include <pthread.h>
 #include <sstream>
 
+#include "dentry_cache.h"
 #include "filesystem.h"
+#include "html5_filesystem.h"
+#include "mem_filesystem.h"
+#include "negative_cache.h"
+#include "pack_filesystem.h"
+#include "page_cache.h"
 #include "ppapi/c/pp_errors.h"
 #include "ppapi/cpp/completion_callback.h"
 #include "ppapi/cpp/core.h"
@@ -74,6 +80,102 @@ void NaClFs::Log(const char* message) {
     NaClFs::PostMessage(pp::Var(ss.str()));
 }
 
+void NaClFs::LogStatistics() {
+  FileSystem::Delegate::Statistics statistics;
+  FileSystem::GetStatistics(&statistics);
+  std::stringstream ss;
+  ss << "NaClFs statistics:" << std::endl;
+  ss << " requests=" << statistics.requests << std::endl;
+  ss << " drains=" << statistics.drains << std::endl;
+  if (statistics.drains) {
+    ss << " requests/drain="
+       << static_cast<double>(statistics.requests) / statistics.drains
+       << std::endl;
+  }
+  ss << " max_batch=" << statistics.max_batch << std::endl;
+  ss << " depth=" << statistics.depth << std::endl;
+  ss << " max_depth=" << statistics.max_depth << std::endl;
+  DentryCache::Statistics dentries;
+  DentryCache::GetInstance()->GetStatistics(&dentries);
+  ss << " dentry_hits=" << dentries.hits << std::endl;
+  ss << " dentry_misses=" << dentries.misses << std::endl;
+  ss << " dentry_invalidations=" << dentries.invalidations << std::endl;
+  ss << " dentry_evictions=" << dentries.evictions << std::endl;
+  ss << " dentry_entries=" << dentries.entries << std::endl;
+  NegativeCache::Statistics negatives;
+  single_instance_->filesystem_->negative_cache()->GetStatistics(&negatives);
+  ss << " negative_hits=" << negatives.hits << std::endl;
+  ss << " negative_misses=" << negatives.misses << std::endl;
+  ss << " negative_false_positives=" << negatives.false_positives
+     << std::endl;
+  ss << " negative_insertions=" << negatives.insertions << std::endl;
+  ss << " negative_invalidations=" << negatives.invalidations << std::endl;
+  ss << " negative_entries=" << negatives.entries << std::endl;
+  PageCache::Statistics pages;
+  PageCache::GetInstance()->GetStatistics(&pages);
+  ss << " page_hits=" << pages.hits << std::endl;
+  ss << " page_misses=" << pages.misses << std::endl;
+  if (pages.hits + pages.misses) {
+    ss << " page_hit_ratio="
+       << static_cast<double>(pages.hits) / (pages.hits + pages.misses)
+       << std::endl;
+  }
+  ss << " page_bytes_prefetched=" << pages.bytes_prefetched << std::endl;
+  ss << " page_evictions=" << pages.evictions << std::endl;
+  ss << " page_blocks=" << pages.blocks << std::endl;
+  Log(ss.str().c_str());
+}
+
+bool NaClFs::SetMaxDescriptors(size_t max) {
+  return single_instance_->filesystem_->SetMaxDescriptors(max);
+}
+
+void NaClFs::SetDentryCacheSize(size_t entries) {
+  DentryCache::GetInstance()->SetCapacity(entries);
+}
+
+void NaClFs::SetNegativeCacheSize(size_t entries) {
+  single_instance_->filesystem_->negative_cache()->SetCapacity(entries);
+}
+
+void NaClFs::ConfigurePageCache(size_t block_size,
+                                size_t capacity,
+                                size_t max_read_ahead) {
+  PageCache::GetInstance()->Configure(block_size, capacity, max_read_ahead);
+}
+
+void NaClFs::ConfigureWriteBack(size_t buffer_size, uint32_t idle_ms) {
+  Html5FileSystem::ConfigureWriteBack(buffer_size, idle_ms);
+}
+
+void NaClFs::ConfigureChunkedIO(size_t chunk_size, size_t window) {
+  FileSystem::ConfigureChunkedIO(chunk_size, window);
+}
+
+void NaClFs::SetReadDirPlus(size_t max_entries) {
+  Html5FileSystem::SetReadDirPlus(max_entries);
+}
+
+void NaClFs::SetReadDirSorted(bool sorted) {
+  Html5FileSystem::SetReadDirSorted(sorted);
+}
+
+void NaClFs::SetTmpCapacity(size_t bytes) {
+  single_instance_->filesystem_->tmp_volume()->SetCapacity(bytes);
+}
+
+int NaClFs::MountPack(const char* image, const char* mount_point) {
+  PackVolume* volume = new PackVolume;
+  int result = volume->Load(image);
+  if (!result) {
+    result = single_instance_->filesystem_->Mount(
+        mount_point, volume, FileSystem::MOUNT_READ_ONLY);
+  }
+  if (result)
+    volume->Release();
+  return result;
+}
+
 void NaClFs::PostMessage(const pp::Var& message) {
   if (single_instance_->core_->IsMainThread()) {
     single_instance_->instance_->PostMessage(message);
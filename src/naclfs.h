@@ -63,6 +63,41 @@ class NaClFs {
   static PP_FileSystemType filesystem_type() { return filesystem_type_; }
   static void set_filesystem_type(PP_FileSystemType type) { filesystem_type_ = type; }
   static void Log(const char* message);
+  static void LogStatistics();
+  // Limits the number of descriptors open at once. Fails if a descriptor
+  // at or above |max| is in use.
+  static bool SetMaxDescriptors(size_t max);
+  // Sets how many paths the HTML5 file system keeps resolved file references
+  // and metadata for.
+  static void SetDentryCacheSize(size_t entries);
+  // Sets how many missing paths are remembered to fail repeated lookups
+  // without asking the file system.
+  static void SetNegativeCacheSize(size_t entries);
+  // Sets the block size and the total size in bytes of the page cache for
+  // file reads, and how many blocks may be read ahead for sequential reads.
+  // A |capacity| smaller than |block_size| disables the cache.
+  static void ConfigurePageCache(size_t block_size,
+                                 size_t capacity,
+                                 size_t max_read_ahead);
+  // Sets how many bytes of writes are buffered per descriptor, and how
+  // long buffered data may wait before it is written out.
+  static void ConfigureWriteBack(size_t buffer_size, uint32_t idle_ms);
+  // Sets the chunk size large reads and writes are split into, and how many
+  // chunks may be in flight at once. A |window| of zero disables splitting.
+  static void ConfigureChunkedIO(size_t chunk_size, size_t window);
+  // Makes the first readdir() on a directory with at most |max_entries|
+  // entries fetch metadata for all of them in one batch, so that stat() on
+  // the entries needs no further round trips. 0 disables it.
+  static void SetReadDirPlus(size_t max_entries);
+  // Makes readdir() return entries sorted by name.
+  static void SetReadDirSorted(bool sorted);
+  // Limits the memory files under /tmp may take. Writes which need more
+  // fail with ENOSPC. The default is 64MB.
+  static void SetTmpCapacity(size_t bytes);
+  // Reads the image made by naclfs-pack at |image| with a single read, and
+  // mounts it read-only at |mount_point|. Must not be called on the main
+  // thread. Returns an errno value.
+  static int MountPack(const char* image, const char* mount_point);
 
   static FileSystem* GetFileSystem() { return single_instance_->filesystem_; }
   static pp::Instance* GetInstance() { return single_instance_->instance_; }
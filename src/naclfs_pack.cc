@@ -0,0 +1,147 @@
+//
+// Copyright (c) 2012, Takashi TOYOSHIMA <toyoshim@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// - Neither the name of the authors nor the names of its contributors may be
+//   used to endorse or promote products derived from this software with out
+//   specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUE
+// NTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+// GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.
+//
+
+// Host side tool which packs a directory tree into an image for PackVolume.
+//   naclfs-pack <image> <directory>
+// Regular files and directories under <directory> are packed with paths
+// relative to it. Other kinds of files are skipped.
+
+#include <dirent.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <string>
+#include <vector>
+
+#include "pack_builder.h"
+
+namespace {
+
+bool ReadFile(const std::string& path, std::vector<char>* data) {
+  FILE* file = fopen(path.c_str(), "rb");
+  if (!file)
+    return false;
+  data->clear();
+  char buffer[64 * 1024];
+  size_t size;
+  while ((size = fread(buffer, 1, sizeof(buffer), file)) > 0)
+    data->insert(data->end(), buffer, buffer + size);
+  bool result = !ferror(file);
+  fclose(file);
+  return result;
+}
+
+// Adds the contents of |root|/|relative| to |builder|. Returns the number of
+// entries added, or -1 on an error.
+int Walk(const std::string& root,
+         const std::string& relative,
+         naclfs::PackBuilder* builder) {
+  std::string path = relative.empty() ? root : root + "/" + relative;
+  DIR* dir = opendir(path.c_str());
+  if (!dir) {
+    fprintf(stderr, "naclfs-pack: can not open directory %s\n", path.c_str());
+    return -1;
+  }
+  int count = 0;
+  struct dirent* entry;
+  while (count >= 0 && (entry = readdir(dir))) {
+    if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+      continue;
+    std::string name =
+        relative.empty() ? entry->d_name : relative + "/" + entry->d_name;
+    std::string source = root + "/" + name;
+    struct stat buf;
+    if (stat(source.c_str(), &buf)) {
+      fprintf(stderr, "naclfs-pack: can not stat %s\n", source.c_str());
+      count = -1;
+    } else if (S_ISDIR(buf.st_mode)) {
+      builder->AddDirectory(name);
+      int result = Walk(root, name, builder);
+      count = result < 0 ? -1 : count + result + 1;
+    } else if (S_ISREG(buf.st_mode)) {
+      std::vector<char> data;
+      if (!ReadFile(source, &data)) {
+        fprintf(stderr, "naclfs-pack: can not read %s\n", source.c_str());
+        count = -1;
+      } else {
+        builder->AddFile(name, data.empty() ? NULL : &data[0], data.size());
+        count++;
+      }
+    } else {
+      fprintf(stderr, "naclfs-pack: skip %s\n", source.c_str());
+    }
+  }
+  closedir(dir);
+  return count;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  if (argc != 3) {
+    fprintf(stderr, "usage: %s <image> <directory>\n", argv[0]);
+    return 1;
+  }
+  // Images are little endian, and the builder writes native integers.
+  const uint16_t probe = 1;
+  if (*reinterpret_cast<const uint8_t*>(&probe) != 1) {
+    fprintf(stderr, "naclfs-pack: big endian hosts are not supported\n");
+    return 1;
+  }
+
+  std::string root(argv[2]);
+  while (root.size() > 1 && root[root.size() - 1] == '/')
+    root.erase(root.size() - 1);
+  naclfs::PackBuilder builder;
+  int count = Walk(root, "", &builder);
+  if (count < 0)
+    return 1;
+  std::vector<char> image;
+  if (!builder.Build(&image)) {
+    fprintf(stderr, "naclfs-pack: can not build the path index\n");
+    return 1;
+  }
+
+  FILE* file = fopen(argv[1], "wb");
+  bool written = file &&
+      fwrite(&image[0], 1, image.size(), file) == image.size();
+  if (file && fclose(file))
+    written = false;
+  if (!written) {
+    fprintf(stderr, "naclfs-pack: can not write %s\n", argv[1]);
+    return 1;
+  }
+  printf("packed %d entries into %s (%lu bytes)\n",
+         count, argv[1], static_cast<unsigned long>(image.size()));
+  return 0;
+}
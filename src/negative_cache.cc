@@ -0,0 +1,164 @@
+//
+// Copyright (c) 2012, Takashi TOYOSHIMA <toyoshim@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// - Neither the name of the authors nor the names of its contributors may be
+//   used to endorse or promote products derived from this software with out
+//   specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUE
+// NTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+// GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.
+//
+
+#include "negative_cache.h"
+
+#include <string.h>
+
+namespace naclfs {
+
+NegativeCache::NegativeCache()
+    : capacity_(kDefaultCapacity) {
+  memset(&statistics_, 0, sizeof(statistics_));
+  memset(const_cast<uint8_t*>(filter_), 0, sizeof(filter_));
+  pthread_mutex_init(&mutex_, NULL);
+}
+
+NegativeCache::~NegativeCache() {
+  pthread_mutex_destroy(&mutex_);
+}
+
+bool NegativeCache::Lookup(const char* fullpath) {
+  if (!MayContain(fullpath)) {
+    __sync_fetch_and_add(&statistics_.misses, 1);
+    return false;
+  }
+  pthread_mutex_lock(&mutex_);
+  bool found = paths_.find(fullpath) != paths_.end();
+  if (found) {
+    statistics_.hits++;
+  } else {
+    statistics_.misses++;
+    statistics_.false_positives++;
+  }
+  pthread_mutex_unlock(&mutex_);
+  return found;
+}
+
+void NegativeCache::Insert(const char* fullpath) {
+  pthread_mutex_lock(&mutex_);
+  if (capacity_) {
+    if (paths_.size() >= capacity_)
+      Clear();
+    Add(fullpath);
+  }
+  pthread_mutex_unlock(&mutex_);
+}
+
+void NegativeCache::Invalidate(const char* fullpath) {
+  pthread_mutex_lock(&mutex_);
+  if (!paths_.empty()) {
+    std::string path(fullpath);
+    if (paths_.count(path))
+      Remove(path);
+    // Paths under |fullpath| sort right after "|fullpath|/".
+    std::string prefix(path);
+    if (prefix[prefix.size() - 1] != '/')
+      prefix.append("/");
+    std::set<std::string>::iterator it = paths_.lower_bound(prefix);
+    while (it != paths_.end() && !it->compare(0, prefix.size(), prefix)) {
+      std::string child(*it++);
+      Remove(child);
+    }
+  }
+  pthread_mutex_unlock(&mutex_);
+}
+
+void NegativeCache::SetCapacity(size_t capacity) {
+  pthread_mutex_lock(&mutex_);
+  capacity_ = capacity;
+  if (paths_.size() > capacity_)
+    Clear();
+  pthread_mutex_unlock(&mutex_);
+}
+
+void NegativeCache::GetStatistics(Statistics* statistics) {
+  pthread_mutex_lock(&mutex_);
+  *statistics = statistics_;
+  pthread_mutex_unlock(&mutex_);
+}
+
+void NegativeCache::Hash(const char* fullpath, uint32_t* hashes) {
+  // Two FNV-1a variants combined by double hashing.
+  uint32_t h1 = 2166136261u;
+  uint32_t h2 = 5381;
+  for (const unsigned char* p =
+           reinterpret_cast<const unsigned char*>(fullpath); *p; ++p) {
+    h1 = (h1 ^ *p) * 16777619u;
+    h2 = (h2 * 33) ^ *p;
+  }
+  h2 |= 1;
+  for (size_t i = 0; i < kHashCount; ++i)
+    hashes[i] = (h1 + i * h2) & (kFilterSize - 1);
+}
+
+bool NegativeCache::MayContain(const char* fullpath) const {
+  uint32_t hashes[kHashCount];
+  Hash(fullpath, hashes);
+  for (size_t i = 0; i < kHashCount; ++i) {
+    if (!filter_[hashes[i]])
+      return false;
+  }
+  return true;
+}
+
+void NegativeCache::Add(const std::string& fullpath) {
+  if (!paths_.insert(fullpath).second)
+    return;
+  uint32_t hashes[kHashCount];
+  Hash(fullpath.c_str(), hashes);
+  for (size_t i = 0; i < kHashCount; ++i) {
+    if (filter_[hashes[i]] != 255)
+      filter_[hashes[i]]++;
+  }
+  statistics_.insertions++;
+  statistics_.entries = paths_.size();
+}
+
+void NegativeCache::Remove(const std::string& fullpath) {
+  uint32_t hashes[kHashCount];
+  Hash(fullpath.c_str(), hashes);
+  for (size_t i = 0; i < kHashCount; ++i) {
+    if (filter_[hashes[i]] != 255)
+      filter_[hashes[i]]--;
+  }
+  paths_.erase(fullpath);
+  statistics_.invalidations++;
+  statistics_.entries = paths_.size();
+}
+
+void NegativeCache::Clear() {
+  paths_.clear();
+  memset(const_cast<uint8_t*>(filter_), 0, sizeof(filter_));
+  statistics_.entries = 0;
+}
+
+}  // namespace naclfs
@@ -0,0 +1,101 @@
+//
+// Copyright (c) 2012, Takashi TOYOSHIMA <toyoshim@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// - Neither the name of the authors nor the names of its contributors may be
+//   used to endorse or promote products derived from this software with out
+//   specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUE
+// NTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+// GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.
+//
+
+#ifndef NACLFS_NEGATIVE_CACHE_H_
+#define NACLFS_NEGATIVE_CACHE_H_
+#pragma once
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <set>
+#include <string>
+
+namespace naclfs {
+
+// Remembers full paths which are known not to exist, so that repeated
+// probes for missing files fail without asking a delegate.
+//
+// Paths are kept in an exact set fronted by a counting Bloom filter. The
+// filter is read without the lock and rules out most paths which were never
+// recorded, so that lookups for existing files rarely touch the set. Entries
+// are removed when the path or one of its ancestors is created.
+class NegativeCache {
+ public:
+  struct Statistics {
+    uint32_t hits;
+    uint32_t misses;
+    // Lookups which passed the filter but were not in the set.
+    uint32_t false_positives;
+    uint32_t insertions;
+    uint32_t invalidations;
+    uint32_t entries;
+  };
+
+  static const size_t kDefaultCapacity = 4096;
+
+  NegativeCache();
+  ~NegativeCache();
+
+  // Returns true if |fullpath| is known to be missing.
+  bool Lookup(const char* fullpath);
+  // Records that |fullpath| does not exist.
+  void Insert(const char* fullpath);
+  // Forgets |fullpath| and every path under it, as it may exist now.
+  void Invalidate(const char* fullpath);
+
+  // Sets the number of paths kept. The cache starts over when it is full.
+  void SetCapacity(size_t capacity);
+  void GetStatistics(Statistics* statistics);
+
+ private:
+  static const size_t kFilterBits = 16;
+  static const size_t kFilterSize = 1 << kFilterBits;
+  static const size_t kHashCount = 4;
+
+  static void Hash(const char* fullpath, uint32_t* hashes);
+  bool MayContain(const char* fullpath) const;
+  void Add(const std::string& fullpath);
+  void Remove(const std::string& fullpath);
+  void Clear();
+
+  // Counting Bloom filter. Counters saturate at 255 and are then never
+  // decremented, which only costs false positives.
+  volatile uint8_t filter_[kFilterSize];
+  std::set<std::string> paths_;
+  size_t capacity_;
+  Statistics statistics_;
+  pthread_mutex_t mutex_;
+};
+
+}  // namespace naclfs
+
+#endif  // NACLFS_NEGATIVE_CACHE_H_
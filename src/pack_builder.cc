@@ -0,0 +1,209 @@
+//
+// Copyright (c) 2012, Takashi TOYOSHIMA <toyoshim@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// - Neither the name of the authors nor the names of its contributors may be
+//   used to endorse or promote products derived from this software with out
+//   specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUE
+// NTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+// GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.
+//
+
+#include "pack_builder.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include "pack_image.h"
+
+namespace {
+
+// Gives up on a bucket after this many seeds.
+const uint32_t kMaxSeed = 1 << 24;
+
+struct LargerBucket {
+  explicit LargerBucket(const std::vector<std::vector<uint32_t> >* members)
+      : members_(members) {}
+  bool operator()(uint32_t a, uint32_t b) const {
+    return (*members_)[a].size() > (*members_)[b].size();
+  }
+  const std::vector<std::vector<uint32_t> >* members_;
+};
+
+}  // namespace
+
+namespace naclfs {
+
+PackBuilder::PackBuilder() {
+  items_[""].directory = true;
+}
+
+PackBuilder::~PackBuilder() {
+}
+
+void PackBuilder::AddFile(const std::string& path,
+                          const char* data,
+                          size_t size) {
+  std::string::size_type slash = path.rfind('/');
+  AddDirectory(slash == std::string::npos ? "" : path.substr(0, slash));
+  Item& item = items_[path];
+  item.directory = false;
+  item.data.assign(data, data + size);
+}
+
+void PackBuilder::AddDirectory(const std::string& path) {
+  for (std::string::size_type end = path.find('/');
+       end != std::string::npos; end = path.find('/', end + 1)) {
+    items_[path.substr(0, end)].directory = true;
+  }
+  Item& item = items_[path];
+  item.directory = true;
+  item.data.clear();
+}
+
+bool PackBuilder::Build(std::vector<char>* image) const {
+  uint32_t count = items_.size();
+  std::vector<const std::string*> paths;
+  std::vector<const Item*> items;
+  std::map<std::string, uint32_t> indices;
+  for (std::map<std::string, Item>::const_iterator it = items_.begin();
+       it != items_.end(); ++it) {
+    indices[it->first] = paths.size();
+    paths.push_back(&it->first);
+    items.push_back(&it->second);
+  }
+
+  // Place every path in a slot of its own, filling the largest buckets
+  // first while most slots are free.
+  uint32_t bucket_count = count / 4 + 1;
+  std::vector<std::vector<uint32_t> > members(bucket_count);
+  for (uint32_t i = 0; i < count; ++i) {
+    members[PackHash(0, paths[i]->data(), paths[i]->size()) % bucket_count]
+        .push_back(i);
+  }
+  std::vector<uint32_t> order(bucket_count);
+  for (uint32_t i = 0; i < bucket_count; ++i)
+    order[i] = i;
+  std::stable_sort(order.begin(), order.end(), LargerBucket(&members));
+  std::vector<uint32_t> seeds(bucket_count, 0);
+  std::vector<uint32_t> slots(count);
+  std::vector<bool> used(count, false);
+  for (uint32_t i = 0; i < bucket_count && !members[order[i]].empty(); ++i) {
+    const std::vector<uint32_t>& keys = members[order[i]];
+    std::vector<uint32_t> taken;
+    uint32_t seed;
+    for (seed = 1; seed < kMaxSeed; ++seed) {
+      taken.clear();
+      for (size_t j = 0; j < keys.size(); ++j) {
+        const std::string* path = paths[keys[j]];
+        uint32_t slot = PackHash(seed, path->data(), path->size()) % count;
+        if (used[slot] ||
+            std::find(taken.begin(), taken.end(), slot) != taken.end())
+          break;
+        taken.push_back(slot);
+      }
+      if (taken.size() == keys.size())
+        break;
+    }
+    if (seed == kMaxSeed)
+      return false;
+    seeds[order[i]] = seed;
+    for (size_t j = 0; j < keys.size(); ++j) {
+      slots[keys[j]] = taken[j];
+      used[taken[j]] = true;
+    }
+  }
+
+  // Entries of a directory follow it in path order, so they are listed
+  // sorted by name.
+  std::vector<std::vector<uint32_t> > children(count);
+  for (uint32_t i = 1; i < count; ++i) {
+    std::string::size_type slash = paths[i]->rfind('/');
+    std::string parent =
+        slash == std::string::npos ? "" : paths[i]->substr(0, slash);
+    children[indices[parent]].push_back(slots[i]);
+  }
+
+  std::vector<PackEntry> entries(count);
+  std::vector<uint32_t> child_table;
+  std::string names;
+  uint64_t data_size = 0;
+  for (uint32_t i = 0; i < count; ++i) {
+    PackEntry& entry = entries[slots[i]];
+    entry.name_offset = names.size();
+    entry.name_length = paths[i]->size();
+    names.append(*paths[i]);
+    names.push_back('\0');
+    if (items[i]->directory) {
+      entry.type = PACK_DIRECTORY;
+      entry.first_child = child_table.size();
+      entry.offset = 0;
+      entry.size = children[i].size();
+      child_table.insert(
+          child_table.end(), children[i].begin(), children[i].end());
+    } else {
+      entry.type = PACK_FILE;
+      entry.first_child = 0;
+      entry.offset = data_size;
+      entry.size = items[i]->data.size();
+      data_size += entry.size;
+    }
+  }
+
+  size_t seeds_offset = PackAlign(sizeof(PackHeader));
+  size_t entries_offset = PackAlign(seeds_offset + bucket_count * 4);
+  size_t children_offset =
+      PackAlign(entries_offset + count * sizeof(PackEntry));
+  size_t names_offset = PackAlign(children_offset + child_table.size() * 4);
+  size_t data_offset = PackAlign(names_offset + names.size());
+  image->assign(data_offset + data_size, 0);
+
+  PackHeader header;
+  memcpy(header.magic, kPackMagic, sizeof(kPackMagic));
+  header.entry_count = count;
+  header.bucket_count = bucket_count;
+  header.child_count = child_table.size();
+  header.names_size = names.size();
+  header.data_offset = data_offset;
+  header.data_size = data_size;
+  char* base = &(*image)[0];
+  memcpy(base, &header, sizeof(header));
+  memcpy(&base[seeds_offset], &seeds[0], bucket_count * 4);
+  memcpy(&base[entries_offset], &entries[0], count * sizeof(PackEntry));
+  if (!child_table.empty()) {
+    memcpy(&base[children_offset], &child_table[0],
+           child_table.size() * 4);
+  }
+  memcpy(&base[names_offset], names.data(), names.size());
+  for (uint32_t i = 0; i < count; ++i) {
+    const PackEntry& entry = entries[slots[i]];
+    if (entry.type == PACK_FILE && entry.size) {
+      memcpy(&base[data_offset + entry.offset], &items[i]->data[0],
+             entry.size);
+    }
+  }
+  return true;
+}
+
+}  // namespace naclfs
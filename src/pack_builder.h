@@ -0,0 +1,75 @@
+//
+// Copyright (c) 2012, Takashi TOYOSHIMA <toyoshim@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// - Neither the name of the authors nor the names of its contributors may be
+//   used to endorse or promote products derived from this software with out
+//   specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUE
+// NTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+// GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.
+//
+
+#ifndef NACLFS_PACK_BUILDER_H_
+#define NACLFS_PACK_BUILDER_H_
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+namespace naclfs {
+
+// Lays out packed images for PackVolume. Used by the host side packer, and
+// builds without PPAPI so that modules can pack data at runtime as well.
+class PackBuilder {
+ public:
+  PackBuilder();
+  ~PackBuilder();
+
+  // Adds a file or a directory at |path|, relative to the image root and
+  // without a leading slash. Missing parent directories are added. Adding a
+  // path again replaces it.
+  void AddFile(const std::string& path, const char* data, size_t size);
+  void AddDirectory(const std::string& path);
+
+  // Writes the image into |image|. Returns false if no perfect hash was
+  // found for the paths, which is unlikely short of billions of them.
+  bool Build(std::vector<char>* image) const;
+
+ private:
+  struct Item {
+    bool directory;
+    std::vector<char> data;
+  };
+
+  // Keyed by path, which keeps the entries of a directory next to each
+  // other and in name order.
+  std::map<std::string, Item> items_;
+};
+
+}  // namespace naclfs
+
+#endif  // NACLFS_PACK_BUILDER_H_
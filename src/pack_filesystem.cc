@@ -0,0 +1,481 @@
+//
+// Copyright (c) 2012, Takashi TOYOSHIMA <toyoshim@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// - Neither the name of the authors nor the names of its contributors may be
+//   used to endorse or promote products derived from this software with out
+//   specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUE
+// NTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+// GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.
+//
+
+#include "pack_filesystem.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sstream>
+#include <stdarg.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "naclfs.h"
+
+namespace {
+
+const mode_t kPermissions = S_IRUSR | S_IXUSR |
+                            S_IRGRP | S_IXGRP |
+                            S_IROTH | S_IXOTH;
+
+class PackFileSystemDir : public naclfs::FileSystem::Dir {
+ public:
+  PackFileSystemDir(naclfs::FileSystem::Delegate* owner,
+                    const naclfs::PackEntry* entries,
+                    const uint32_t* children,
+                    const char* names,
+                    size_t count)
+    : Dir(owner),
+      entries_(entries),
+      children_(children),
+      names_(names),
+      count_(count),
+      offset_(0) {}
+
+  virtual ~PackFileSystemDir() {}
+
+  struct dirent* ReadDirNext() {
+    if (offset_ >= count_)
+      return NULL;
+    const naclfs::PackEntry* entry = &entries_[children_[offset_]];
+    // Entries are named by their full path. List the last component.
+    const char* name = &names_[entry->name_offset];
+    const char* slash = strrchr(name, '/');
+    if (slash)
+      name = slash + 1;
+    memset(&dirent_, 0, sizeof(struct dirent));
+    size_t length = strlen(name);
+    if (length >= sizeof(dirent_.d_name))
+      length = sizeof(dirent_.d_name) - 1;
+    memcpy(dirent_.d_name, name, length);
+#if defined(_DIRENT_HAVE_D_TYPE)
+    dirent_.d_type = entry->type == naclfs::PACK_DIRECTORY ? DT_DIR : DT_REG;
+#endif  // defined(_DIRENT_HAVE_D_TYPE)
+    offset_++;
+    return &dirent_;
+  }
+
+  void Rewind() {
+    offset_ = 0;
+  }
+
+  long Tell() const {
+    return offset_;
+  }
+
+  void Seek(long offset) {
+    offset_ = offset < 0 ? 0 : offset;
+  }
+
+ private:
+  const naclfs::PackEntry* entries_;
+  const uint32_t* children_;
+  const char* names_;
+  size_t count_;
+  size_t offset_;
+  struct dirent dirent_;
+};
+
+}  // namespace
+
+namespace naclfs {
+
+PackVolume::PackVolume()
+    : header_(NULL),
+      seeds_(NULL),
+      entries_(NULL),
+      children_(NULL),
+      names_(NULL),
+      data_(NULL) {
+}
+
+PackVolume::~PackVolume() {
+}
+
+FileSystem::Delegate* PackVolume::CreateDelegate(NaClFs* naclfs,
+                                                 const char* mount_point) {
+  if (!header_)
+    return NULL;
+  return new PackFileSystem(naclfs, this, mount_point);
+}
+
+int PackVolume::Load(const char* path) {
+  FileSystem* filesystem = NaClFs::GetFileSystem();
+  int fildes;
+  int result = filesystem->Open(path, O_RDONLY, 0, &fildes);
+  if (result)
+    return result;
+  struct stat buf;
+  std::vector<char> image;
+  result = filesystem->Fstat(fildes, &buf);
+  if (!result && buf.st_size > 0) {
+    // Large reads skip the page cache and go out as concurrent chunks.
+    image.resize(buf.st_size);
+    if (filesystem->PRead(fildes, &image[0], image.size(), 0) != buf.st_size)
+      result = EIO;
+  }
+  filesystem->Close(fildes);
+  if (result)
+    return result;
+  return Attach(&image);
+}
+
+int PackVolume::Attach(std::vector<char>* image) {
+  if (header_)
+    return EBUSY;
+
+  // Check the image once here, so that lookups can trust it.
+  uint64_t size = image->size();
+  if (size < sizeof(PackHeader))
+    return EINVAL;
+  const char* base = &(*image)[0];
+  const PackHeader* header = reinterpret_cast<const PackHeader*>(base);
+  if (memcmp(header->magic, kPackMagic, sizeof(kPackMagic)) ||
+      !header->entry_count || !header->bucket_count ||
+      header->entry_count > size / sizeof(PackEntry) ||
+      header->bucket_count > size / sizeof(uint32_t) ||
+      header->child_count > size / sizeof(uint32_t)) {
+    return EINVAL;
+  }
+  uint64_t seeds = PackAlign(sizeof(PackHeader));
+  uint64_t entries = PackAlign(seeds + header->bucket_count * 4ULL);
+  uint64_t children =
+      PackAlign(entries + header->entry_count * sizeof(PackEntry));
+  uint64_t names = PackAlign(children + header->child_count * 4ULL);
+  if (!header->names_size ||
+      names + header->names_size > header->data_offset ||
+      header->data_offset > size ||
+      header->data_size > size - header->data_offset ||
+      base[names + header->names_size - 1]) {
+    return EINVAL;
+  }
+  const PackEntry* entry_table =
+      reinterpret_cast<const PackEntry*>(&base[entries]);
+  const uint32_t* child_table =
+      reinterpret_cast<const uint32_t*>(&base[children]);
+  for (uint32_t i = 0; i < header->entry_count; ++i) {
+    const PackEntry& entry = entry_table[i];
+    if (entry.name_offset >= header->names_size ||
+        entry.name_length >= header->names_size - entry.name_offset ||
+        base[names + entry.name_offset + entry.name_length]) {
+      return EINVAL;
+    }
+    if (entry.type == PACK_FILE) {
+      if (entry.offset > header->data_size ||
+          entry.size > header->data_size - entry.offset)
+        return EINVAL;
+    } else if (entry.type == PACK_DIRECTORY) {
+      if (entry.first_child > header->child_count ||
+          entry.size > header->child_count - entry.first_child)
+        return EINVAL;
+    } else {
+      return EINVAL;
+    }
+  }
+  for (uint32_t i = 0; i < header->child_count; ++i) {
+    if (child_table[i] >= header->entry_count)
+      return EINVAL;
+  }
+
+  image_.swap(*image);
+  base = &image_[0];
+  header_ = reinterpret_cast<const PackHeader*>(base);
+  seeds_ = reinterpret_cast<const uint32_t*>(&base[seeds]);
+  entries_ = reinterpret_cast<const PackEntry*>(&base[entries]);
+  children_ = reinterpret_cast<const uint32_t*>(&base[children]);
+  names_ = &base[names];
+  data_ = &base[header_->data_offset];
+  const PackEntry* root = Lookup("");
+  if (!root || root->type != PACK_DIRECTORY) {
+    header_ = NULL;
+    image->swap(image_);
+    return EINVAL;
+  }
+  return 0;
+}
+
+const PackEntry* PackVolume::Lookup(const char* path) const {
+  size_t length = strlen(path);
+  uint32_t slot = PackSlot(seeds_, header_->bucket_count,
+                           header_->entry_count, path, length);
+  const PackEntry* entry = &entries_[slot];
+  // The hash places every packed path, but any other path lands on some
+  // entry too.
+  if (entry->name_length != length || memcmp(name(entry), path, length))
+    return NULL;
+  return entry;
+}
+
+PackFileSystem::PackFileSystem(NaClFs* naclfs,
+                               PackVolume* volume,
+                               const char* mount_point)
+    : naclfs_(naclfs),
+      volume_(volume),
+      mount_length_(strcmp(mount_point, "/") ? strlen(mount_point) : 0),
+      entry_(NULL),
+      oflag_(0),
+      fd_flags_(0),
+      offset_(0) {
+  pthread_mutex_init(&offset_mutex_, NULL);
+  volume_->AddRef();
+}
+
+PackFileSystem::~PackFileSystem() {
+  volume_->Release();
+  pthread_mutex_destroy(&offset_mutex_);
+}
+
+int PackFileSystem::AccessMode() {
+  return O_RDONLY;
+}
+
+int PackFileSystem::OpenCall(Arguments* arguments,
+                             const char* path,
+                             int oflag,
+                             mode_t cmode) {
+  const PackEntry* entry = volume_->Lookup(Relative(path));
+  if (!entry)
+    return (oflag & O_CREAT) ? EROFS : ENOENT;
+  if ((oflag & O_CREAT) && (oflag & O_EXCL))
+    return EEXIST;
+  if ((oflag & O_ACCMODE) != O_RDONLY || (oflag & O_TRUNC))
+    return entry->type == PACK_DIRECTORY ? EISDIR : EROFS;
+  entry_ = entry;
+  oflag_ = oflag;
+  fd_flags_ = 0;
+#if defined(O_CLOEXEC)
+  if (oflag & O_CLOEXEC)
+    fd_flags_ = FD_CLOEXEC;
+#endif
+  offset_ = 0;
+  return 0;
+}
+
+int PackFileSystem::StatCall(Arguments* arguments,
+                             const char* path,
+                             struct stat* buf) {
+  const PackEntry* entry = volume_->Lookup(Relative(path));
+  if (!entry)
+    return ENOENT;
+  EntryToStat(entry, buf);
+  return 0;
+}
+
+int PackFileSystem::CloseCall(Arguments* arguments) {
+  entry_ = NULL;
+  return 0;
+}
+
+int PackFileSystem::FstatCall(Arguments* arguments, struct stat* buf) {
+  if (!entry_)
+    return EBADF;
+  EntryToStat(entry_, buf);
+  return 0;
+}
+
+ssize_t PackFileSystem::ReadCall(Arguments* arguments,
+                                 void* buf,
+                                 size_t nbytes) {
+  pthread_mutex_lock(&offset_mutex_);
+  ssize_t result = PReadCall(arguments, buf, nbytes, offset_);
+  if (result > 0)
+    offset_ += result;
+  pthread_mutex_unlock(&offset_mutex_);
+  return result;
+}
+
+ssize_t PackFileSystem::WriteCall(Arguments* arguments,
+                                  const void* buf,
+                                  size_t nbytes) {
+  errno = EBADF;
+  return -1;
+}
+
+ssize_t PackFileSystem::PReadCall(Arguments* arguments,
+                                  void* buf,
+                                  size_t nbytes,
+                                  off_t offset) {
+  if (!entry_) {
+    errno = EBADF;
+    return -1;
+  }
+  if (entry_->type == PACK_DIRECTORY) {
+    errno = EISDIR;
+    return -1;
+  }
+  if (offset < 0 || static_cast<uint64_t>(offset) >= entry_->size)
+    return 0;
+  if (nbytes > entry_->size - offset)
+    nbytes = entry_->size - offset;
+  memcpy(buf, &volume_->data(entry_)[offset], nbytes);
+  return nbytes;
+}
+
+ssize_t PackFileSystem::PWriteCall(Arguments* arguments,
+                                   const void* buf,
+                                   size_t nbytes,
+                                   off_t offset) {
+  errno = EBADF;
+  return -1;
+}
+
+off_t PackFileSystem::SeekCall(Arguments* arguments,
+                               off_t offset,
+                               int whence) {
+  if (!entry_) {
+    errno = EBADF;
+    return -1;
+  }
+  pthread_mutex_lock(&offset_mutex_);
+  off_t base = -1;
+  switch (whence) {
+    case SEEK_SET:
+      base = 0;
+      break;
+    case SEEK_CUR:
+      base = offset_;
+      break;
+    case SEEK_END:
+      base = entry_->type == PACK_FILE ? entry_->size : 0;
+      break;
+  }
+  off_t result = -1;
+  if (base >= 0 && base + offset >= 0) {
+    offset_ = base + offset;
+    result = offset_;
+  }
+  pthread_mutex_unlock(&offset_mutex_);
+  if (result < 0)
+    errno = EINVAL;
+  return result;
+}
+
+int PackFileSystem::FcntlCall(Arguments* arguments, int cmd, va_list* ap) {
+  switch (cmd) {
+    case F_GETFD:
+      return fd_flags_;
+    case F_SETFD:
+      fd_flags_ = va_arg(*ap, long) & FD_CLOEXEC;
+      return 0;
+    case F_GETFL:
+      return oflag_;
+    default: {
+      std::ostringstream ss;
+      ss << "PackFileSystem::Fcntl not supported cmd=" << cmd << "\n";
+      naclfs_->Log(ss.str().c_str());
+      errno = ENOSYS;
+      return -1;
+    }
+  }
+}
+
+int PackFileSystem::MkDirCall(Arguments* arguments,
+                              const char* path,
+                              mode_t mode) {
+  errno = volume_->Lookup(Relative(path)) ? EEXIST : EROFS;
+  return -1;
+}
+
+DIR* PackFileSystem::OpenDirCall(Arguments* arguments, const char* dirname) {
+  const PackEntry* entry = volume_->Lookup(Relative(dirname));
+  if (!entry) {
+    errno = ENOENT;
+    return NULL;
+  }
+  if (entry->type != PACK_DIRECTORY) {
+    errno = ENOTDIR;
+    return NULL;
+  }
+  PackFileSystemDir* dir = new PackFileSystemDir(
+      this, volume_->entries_, &volume_->children_[entry->first_child],
+      volume_->names_, entry->size);
+  return reinterpret_cast<DIR*>(dir);
+}
+
+void PackFileSystem::RewindDirCall(Arguments* arguments, DIR* dirp) {
+  PackFileSystemDir* dir = reinterpret_cast<PackFileSystemDir*>(dirp);
+  if (dir)
+    dir->Rewind();
+}
+
+struct dirent* PackFileSystem::ReadDirCall(Arguments* arguments, DIR* dirp) {
+  PackFileSystemDir* dir = reinterpret_cast<PackFileSystemDir*>(dirp);
+  if (!dir)
+    return NULL;
+  return dir->ReadDirNext();
+}
+
+long PackFileSystem::TellDirCall(Arguments* arguments, DIR* dirp) {
+  PackFileSystemDir* dir = reinterpret_cast<PackFileSystemDir*>(dirp);
+  if (!dir)
+    return -1;
+  return dir->Tell();
+}
+
+void PackFileSystem::SeekDirCall(Arguments* arguments,
+                                 DIR* dirp,
+                                 long offset) {
+  PackFileSystemDir* dir = reinterpret_cast<PackFileSystemDir*>(dirp);
+  if (dir)
+    dir->Seek(offset);
+}
+
+int PackFileSystem::CloseDirCall(Arguments* arguments, DIR* dirp) {
+  PackFileSystemDir* dir = reinterpret_cast<PackFileSystemDir*>(dirp);
+  if (!dir)
+    return -1;
+  delete dir;
+  return 0;
+}
+
+const char* PackFileSystem::Relative(const char* path) const {
+  path = &path[mount_length_];
+  return *path == '/' ? &path[1] : path;
+}
+
+void PackFileSystem::EntryToStat(const PackEntry* entry,
+                                 struct stat* buf) const {
+  memset(buf, 0, sizeof(struct stat));
+  // Slots are unique, which makes them inode numbers.
+  buf->st_ino = entry - volume_->entries_ + 1;
+  buf->st_nlink = 1;
+  buf->st_blksize = 512;
+  if (entry->type == PACK_DIRECTORY) {
+    buf->st_mode = S_IFDIR | kPermissions;
+  } else {
+    buf->st_mode = S_IFREG | kPermissions;
+    buf->st_size = entry->size;
+    buf->st_blocks = (entry->size + 511) >> 9;
+  }
+}
+
+}  // namespace naclfs
@@ -0,0 +1,155 @@
+//
+// Copyright (c) 2012, Takashi TOYOSHIMA <toyoshim@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// - Neither the name of the authors nor the names of its contributors may be
+//   used to endorse or promote products derived from this software with out
+//   specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUE
+// NTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+// GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.
+//
+
+#ifndef NACLFS_PACK_FILESYSTEM_H_
+#define NACLFS_PACK_FILESYSTEM_H_
+#pragma once
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <vector>
+
+#include "filesystem.h"
+#include "pack_image.h"
+
+namespace naclfs {
+
+class NaClFs;
+
+// Read-only tree served from a packed image held in memory. The image is
+// built on the host with naclfs-pack and read in with a single read, so
+// opening thousands of small assets costs no round trip after that. Paths
+// are looked up through the perfect hash in the image.
+class PackVolume : public FileSystem::Backend {
+ public:
+  PackVolume();
+  virtual ~PackVolume();
+
+  virtual FileSystem::Delegate* CreateDelegate(NaClFs* naclfs,
+                                               const char* mount_point);
+
+  // Reads the image at |path| with one read and uses it. Must not be called
+  // on the main thread. Returns an errno value, EINVAL for a malformed
+  // image.
+  int Load(const char* path);
+  // Uses the image in |image|, which is swapped out. Returns an errno value.
+  int Attach(std::vector<char>* image);
+
+ private:
+  // Returns the entry for |path| relative to the image root, or NULL.
+  const PackEntry* Lookup(const char* path) const;
+  const char* name(const PackEntry* entry) const {
+    return &names_[entry->name_offset];
+  }
+  const char* data(const PackEntry* entry) const {
+    return &data_[entry->offset];
+  }
+
+  std::vector<char> image_;
+  const PackHeader* header_;
+  const uint32_t* seeds_;
+  const PackEntry* entries_;
+  const uint32_t* children_;
+  const char* names_;
+  const char* data_;
+
+  friend class PackFileSystem;
+};  // class PackVolume
+
+// Delegate for files and directories of a PackVolume. The image never
+// changes, so every request runs on the calling thread and only the file
+// offset needs a lock.
+class PackFileSystem : public FileSystem::Delegate {
+ public:
+  // Serves |volume| mounted at |mount_point|. Holds a reference to |volume|.
+  PackFileSystem(NaClFs* naclfs, PackVolume* volume, const char* mount_point);
+  virtual ~PackFileSystem();
+
+  // Files are only ever opened for reading.
+  virtual int AccessMode();
+
+  virtual int OpenCall(Arguments* arguments,
+                       const char* path,
+                       int oflag,
+                       mode_t cmode);
+  virtual int StatCall(Arguments* arguments,
+                       const char* path,
+                       struct stat* buf);
+  virtual int CloseCall(Arguments* arguments);
+  virtual int FstatCall(Arguments* arguments, struct stat* buf);
+  virtual ssize_t ReadCall(Arguments* arguments, void* buf, size_t nbytes);
+  virtual ssize_t WriteCall(Arguments* arguments,
+                            const void* buf,
+                            size_t nbytes);
+  virtual ssize_t PReadCall(Arguments* arguments,
+                            void* buf,
+                            size_t nbytes,
+                            off_t offset);
+  virtual ssize_t PWriteCall(Arguments* arguments,
+                             const void* buf,
+                             size_t nbytes,
+                             off_t offset);
+  virtual off_t SeekCall(Arguments* arguments, off_t offset, int whence);
+  virtual int IsATtyCall(Arguments* arguments) { return ENOTTY; }
+  virtual int FcntlCall(Arguments* arguments, int cmd, va_list* ap);
+  virtual int FsyncCall(Arguments* arguments) { return 0; }
+  virtual int MkDirCall(Arguments* arguments, const char* path, mode_t mode);
+  virtual DIR* OpenDirCall(Arguments* arguments, const char* dirname);
+  virtual void RewindDirCall(Arguments* arguments, DIR* dirp);
+  virtual struct dirent* ReadDirCall(Arguments* arguments, DIR* dirp);
+  virtual long TellDirCall(Arguments* arguments, DIR* dirp);
+  virtual void SeekDirCall(Arguments* arguments, DIR* dirp, long offset);
+  virtual int CloseDirCall(Arguments* arguments, DIR* dirp);
+
+ protected:
+  virtual bool IsLocal(const Arguments& arguments) const { return true; }
+
+ private:
+  // Returns |path| relative to the image root.
+  const char* Relative(const char* path) const;
+  void EntryToStat(const PackEntry* entry, struct stat* buf) const;
+
+  NaClFs* naclfs_;
+  PackVolume* volume_;
+  size_t mount_length_;
+  const PackEntry* entry_;
+  int oflag_;
+  // Descriptor flags, FD_CLOEXEC or 0.
+  int fd_flags_;
+  pthread_mutex_t offset_mutex_;
+  off_t offset_;
+};
+
+}  // namespace naclfs
+
+#endif  // NACLFS_PACK_FILESYSTEM_H_
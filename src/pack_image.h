@@ -0,0 +1,118 @@
+//
+// Copyright (c) 2012, Takashi TOYOSHIMA <toyoshim@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// - Neither the name of the authors nor the names of its contributors may be
+//   used to endorse or promote products derived from this software with out
+//   specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUE
+// NTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+// GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.
+//
+
+#ifndef NACLFS_PACK_IMAGE_H_
+#define NACLFS_PACK_IMAGE_H_
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace naclfs {
+
+// Layout of a packed image, shared by PackVolume and the host side packer.
+// All integers are little endian. An image is laid out as
+//   PackHeader
+//   uint32_t seeds[bucket_count]
+//   PackEntry entries[entry_count]
+//   uint32_t children[child_count]
+//   char names[names_size]
+//   file data, starting at data_offset
+// with every part after the header starting at a multiple of 8 bytes.
+// Entries are placed at the slot PackSlot() computes for their path, which
+// is relative to the image root and has no leading slash. The root itself
+// is the entry with the empty path. Names are the NUL terminated paths.
+
+static const char kPackMagic[8] = { 'N', 'A', 'C', 'L', 'P', 'A', 'K', '1' };
+
+enum PackEntryType {
+  PACK_FILE = 0,
+  PACK_DIRECTORY = 1
+};
+
+struct PackHeader {
+  char magic[8];
+  uint32_t entry_count;
+  uint32_t bucket_count;
+  uint32_t child_count;
+  uint32_t names_size;
+  uint64_t data_offset;
+  uint64_t data_size;
+};
+
+struct PackEntry {
+  uint32_t name_offset;
+  uint32_t name_length;
+  uint32_t type;
+  // Directories list their entries at children[first_child] onwards, in
+  // name order.
+  uint32_t first_child;
+  // File data at |offset| from data_offset, or the number of entries for a
+  // directory.
+  uint64_t offset;
+  uint64_t size;
+};
+
+// Seeded FNV-1a with a final avalanche, so that different seeds give
+// independent slots.
+inline uint32_t PackHash(uint32_t seed, const char* key, size_t length) {
+  uint32_t hash = 2166136261u ^ seed;
+  for (size_t i = 0; i < length; ++i) {
+    hash ^= static_cast<uint8_t>(key[i]);
+    hash *= 16777619u;
+  }
+  hash ^= hash >> 16;
+  hash *= 0x85ebca6bu;
+  hash ^= hash >> 13;
+  hash *= 0xc2b2ae35u;
+  hash ^= hash >> 16;
+  return hash;
+}
+
+inline size_t PackAlign(size_t offset) {
+  return (offset + 7) & ~static_cast<size_t>(7);
+}
+
+// Hash and displace perfect hashing: the unseeded hash picks a bucket, and
+// the seed stored for the bucket places each of its keys in a slot of its
+// own. A lookup is two hashes and one comparison to reject other names.
+inline uint32_t PackSlot(const uint32_t* seeds,
+                         uint32_t bucket_count,
+                         uint32_t entry_count,
+                         const char* key,
+                         size_t length) {
+  uint32_t bucket = PackHash(0, key, length) % bucket_count;
+  return PackHash(seeds[bucket], key, length) % entry_count;
+}
+
+}  // namespace naclfs
+
+#endif  // NACLFS_PACK_IMAGE_H_
@@ -0,0 +1,306 @@
+//
+// Copyright (c) 2012, Takashi TOYOSHIMA <toyoshim@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// - Neither the name of the authors nor the names of its contributors may be
+//   used to endorse or promote products derived from this software with out
+//   specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUE
+// NTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+// GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.
+//
+
+#include "page_cache.h"
+
+#include <string.h>
+
+namespace naclfs {
+
+pthread_once_t PageCache::once_ = PTHREAD_ONCE_INIT;
+PageCache* PageCache::instance_ = NULL;
+
+PageCache* PageCache::GetInstance() {
+  pthread_once(&once_, Create);
+  return instance_;
+}
+
+uint32_t PageCache::GetFileId(const char* fullpath) {
+  pthread_mutex_lock(&mutex_);
+  std::pair<IdMap::iterator, bool> inserted =
+      ids_.insert(std::make_pair(std::string(fullpath), next_id_));
+  if (inserted.second) {
+    // Skip ids still in use after the counter wraps around.
+    while (!next_id_ || files_.find(next_id_) != files_.end())
+      next_id_++;
+    inserted.first->second = next_id_++;
+    File file = { inserted.first, 0, 0, 0, -1 };
+    files_.insert(std::make_pair(inserted.first->second, file));
+  }
+  uint32_t id = inserted.first->second;
+  files_[id].references++;
+  pthread_mutex_unlock(&mutex_);
+  return id;
+}
+
+void PageCache::ReleaseFileId(uint32_t file) {
+  pthread_mutex_lock(&mutex_);
+  FileMap::iterator it = files_.find(file);
+  if (it != files_.end() && it->second.references) {
+    it->second.references--;
+    MaybeDrop(it);
+  }
+  pthread_mutex_unlock(&mutex_);
+}
+
+uint32_t PageCache::GetGeneration(uint32_t file) {
+  pthread_mutex_lock(&mutex_);
+  File* state = GetFile(file);
+  uint32_t generation = state ? state->generation : 0;
+  pthread_mutex_unlock(&mutex_);
+  return generation;
+}
+
+ssize_t PageCache::Read(uint32_t file, off_t offset, void* buf, size_t nbytes) {
+  pthread_mutex_lock(&mutex_);
+  off_t index = offset / block_size_;
+  BlockMap::iterator found = blocks_.find(Key(file, index));
+  if (found == blocks_.end()) {
+    statistics_.misses++;
+    pthread_mutex_unlock(&mutex_);
+    return -1;
+  }
+  statistics_.hits++;
+  Block* block = found->second;
+  lru_.splice(lru_.begin(), lru_, block->lru);
+  size_t start = offset - index * block_size_;
+  size_t size = 0;
+  if (start < block->length) {
+    size = block->length - start;
+    if (size > nbytes)
+      size = nbytes;
+    memcpy(buf, &block->data[start], size);
+  }
+  pthread_mutex_unlock(&mutex_);
+  return size;
+}
+
+void PageCache::Insert(uint32_t file,
+                       uint32_t generation,
+                       off_t offset,
+                       const void* data,
+                       size_t length,
+                       bool prefetched) {
+  pthread_mutex_lock(&mutex_);
+  File* state = GetFile(file);
+  if (!enabled() || !state || state->generation != generation ||
+      offset % block_size_ || length > block_size_) {
+    pthread_mutex_unlock(&mutex_);
+    return;
+  }
+  Key key(file, offset / block_size_);
+  BlockMap::iterator found = blocks_.find(key);
+  if (found != blocks_.end())
+    Erase(found);
+  while ((blocks_.size() + 1) * block_size_ > capacity_) {
+    Erase(blocks_.find(lru_.back()->key));
+    statistics_.evictions++;
+  }
+  Block* block = new Block;
+  block->key = key;
+  block->length = length;
+  block->data = new char[block_size_];
+  memcpy(block->data, data, length);
+  lru_.push_front(block);
+  block->lru = lru_.begin();
+  blocks_[key] = block;
+  state->blocks++;
+  if (length < block_size_)
+    state->last = key.second;
+  if (prefetched)
+    statistics_.bytes_prefetched += length;
+  statistics_.blocks = blocks_.size();
+  pthread_mutex_unlock(&mutex_);
+}
+
+void PageCache::Write(uint32_t file,
+                      off_t offset,
+                      const void* buf,
+                      size_t nbytes) {
+  pthread_mutex_lock(&mutex_);
+  File* state = GetFile(file);
+  if (!state) {
+    pthread_mutex_unlock(&mutex_);
+    return;
+  }
+  // Blocks being fetched may miss this data.
+  state->generation++;
+  const char* src = static_cast<const char*>(buf);
+  off_t end = offset + nbytes;
+  off_t first = offset / block_size_;
+  off_t last = (end + block_size_ - 1) / block_size_;
+  BlockMap::iterator it = blocks_.lower_bound(Key(file, first));
+  while (it != blocks_.end() && it->first < Key(file, last)) {
+    Block* block = it->second;
+    off_t base = block->key.second * block_size_;
+    off_t start = offset > base ? offset : base;
+    off_t stop = end < base + static_cast<off_t>(block_size_) ?
+        end : base + block_size_;
+    if (start - base > static_cast<off_t>(block->length)) {
+      // Leaves a hole after the cached end of the file.
+      Erase(it++);
+      continue;
+    }
+    memcpy(&block->data[start - base], &src[start - offset], stop - start);
+    if (static_cast<size_t>(stop - base) > block->length)
+      block->length = stop - base;
+    ++it;
+  }
+  // The block which ended the file no longer does if the write went past it.
+  if (state->last >= 0) {
+    it = blocks_.find(Key(file, state->last));
+    if (it == blocks_.end()) {
+      state->last = -1;
+    } else if (it->second->length == block_size_ ||
+               end > static_cast<off_t>((state->last + 1) * block_size_)) {
+      if (it->second->length != block_size_)
+        Erase(it);
+      state->last = -1;
+    }
+  }
+  statistics_.blocks = blocks_.size();
+  pthread_mutex_unlock(&mutex_);
+}
+
+void PageCache::Invalidate(uint32_t file, off_t offset, size_t nbytes) {
+  pthread_mutex_lock(&mutex_);
+  File* state = GetFile(file);
+  if (!state) {
+    pthread_mutex_unlock(&mutex_);
+    return;
+  }
+  state->generation++;
+  off_t first = offset / block_size_;
+  off_t last = (offset + nbytes + block_size_ - 1) / block_size_;
+  BlockMap::iterator it = blocks_.lower_bound(Key(file, first));
+  while (it != blocks_.end() && it->first < Key(file, last))
+    Erase(it++);
+  // A write past the cached end of the file makes the short block which
+  // ended it stale as well.
+  if (state->last >= 0) {
+    it = blocks_.find(Key(file, state->last));
+    if (it != blocks_.end())
+      Erase(it);
+    state->last = -1;
+  }
+  statistics_.blocks = blocks_.size();
+  pthread_mutex_unlock(&mutex_);
+}
+
+void PageCache::InvalidateFile(uint32_t file) {
+  pthread_mutex_lock(&mutex_);
+  File* state = GetFile(file);
+  if (!state) {
+    pthread_mutex_unlock(&mutex_);
+    return;
+  }
+  state->generation++;
+  state->last = -1;
+  BlockMap::iterator it = blocks_.lower_bound(Key(file, 0));
+  while (it != blocks_.end() && it->first.first == file)
+    Erase(it++);
+  statistics_.blocks = blocks_.size();
+  pthread_mutex_unlock(&mutex_);
+}
+
+void PageCache::Configure(size_t block_size,
+                          size_t capacity,
+                          size_t max_read_ahead) {
+  pthread_mutex_lock(&mutex_);
+  Clear();
+  block_size_ = block_size ? block_size : kDefaultBlockSize;
+  capacity_ = capacity;
+  max_read_ahead_ = max_read_ahead ? max_read_ahead : 1;
+  pthread_mutex_unlock(&mutex_);
+}
+
+void PageCache::GetStatistics(Statistics* statistics) {
+  pthread_mutex_lock(&mutex_);
+  *statistics = statistics_;
+  pthread_mutex_unlock(&mutex_);
+}
+
+PageCache::PageCache()
+    : next_id_(1),
+      block_size_(kDefaultBlockSize),
+      capacity_(kDefaultCapacity),
+      max_read_ahead_(kDefaultMaxReadAhead) {
+  memset(&statistics_, 0, sizeof(statistics_));
+  pthread_mutex_init(&mutex_, NULL);
+}
+
+PageCache::~PageCache() {
+  Clear();
+  pthread_mutex_destroy(&mutex_);
+}
+
+void PageCache::Create() {
+  instance_ = new PageCache();
+}
+
+PageCache::File* PageCache::GetFile(uint32_t file) {
+  FileMap::iterator it = files_.find(file);
+  return it == files_.end() ? NULL : &it->second;
+}
+
+void PageCache::MaybeDrop(FileMap::iterator it) {
+  if (it->second.references || it->second.blocks)
+    return;
+  ids_.erase(it->second.id);
+  files_.erase(it);
+}
+
+void PageCache::Erase(BlockMap::iterator it) {
+  Block* block = it->second;
+  FileMap::iterator file = files_.find(block->key.first);
+  lru_.erase(block->lru);
+  blocks_.erase(it);
+  delete [] block->data;
+  delete block;
+  // Files with open descriptors are kept, so callers may go on using the
+  // state of the file they are working on.
+  if (file != files_.end()) {
+    file->second.blocks--;
+    MaybeDrop(file);
+  }
+}
+
+void PageCache::Clear() {
+  while (!blocks_.empty())
+    Erase(blocks_.begin());
+  for (FileMap::iterator it = files_.begin(); it != files_.end(); ++it) {
+    it->second.generation++;
+    it->second.last = -1;
+  }
+  statistics_.blocks = 0;
+}
+
+}  // namespace naclfs
@@ -0,0 +1,162 @@
+//
+// Copyright (c) 2012, Takashi TOYOSHIMA <toyoshim@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// - Neither the name of the authors nor the names of its contributors may be
+//   used to endorse or promote products derived from this software with out
+//   specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUE
+// NTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+// GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.
+//
+
+#ifndef NACLFS_PAGE_CACHE_H_
+#define NACLFS_PAGE_CACHE_H_
+#pragma once
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <list>
+#include <map>
+#include <string>
+#include <utility>
+
+namespace naclfs {
+
+// Memory bounded cache of fixed size file blocks shared by all descriptors.
+// Files are identified by ids handed out per full path, so descriptors open
+// on the same file share its blocks. Blocks are evicted in LRU order, and a
+// file's id is forgotten once it has neither cached blocks nor open
+// descriptors.
+//
+// Each file has a generation which is bumped whenever its cached data is
+// dropped. A reader takes the generation before it fetches blocks and hands
+// it to Insert(), which discards data fetched across a concurrent write.
+class PageCache {
+ public:
+  struct Statistics {
+    uint32_t hits;
+    uint32_t misses;
+    uint64_t bytes_prefetched;
+    uint32_t evictions;
+    uint32_t blocks;
+  };
+
+  static const size_t kDefaultBlockSize = 64 * 1024;
+  static const size_t kDefaultCapacity = 16 * 1024 * 1024;
+  static const size_t kDefaultMaxReadAhead = 8;
+
+  static PageCache* GetInstance();
+
+  // Returns the id for the file at |fullpath|, and keeps it until
+  // ReleaseFileId() is called as many times. Ids are never 0.
+  uint32_t GetFileId(const char* fullpath);
+  void ReleaseFileId(uint32_t file);
+  uint32_t GetGeneration(uint32_t file);
+
+  // Copies data at |offset| of |file| from a cached block into |buf|, up to
+  // |nbytes| and never across a block boundary. Returns the number of bytes
+  // copied, 0 at the end of file, or -1 if the block is not cached.
+  ssize_t Read(uint32_t file, off_t offset, void* buf, size_t nbytes);
+  // Caches |length| bytes at the block aligned |offset| of |file|. A block
+  // shorter than block_size() ends the file. |prefetched| marks blocks read
+  // ahead of the request.
+  void Insert(uint32_t file,
+              uint32_t generation,
+              off_t offset,
+              const void* data,
+              size_t length,
+              bool prefetched);
+  // Copies |nbytes| written at |offset| of |file| into the cached blocks it
+  // overlaps, so that readers see data which is still being buffered.
+  // Blocks which can not be updated in place are dropped.
+  void Write(uint32_t file, off_t offset, const void* buf, size_t nbytes);
+  // Drops cached blocks overlapping |nbytes| at |offset|, and the last
+  // block of the file if the range may extend it.
+  void Invalidate(uint32_t file, off_t offset, size_t nbytes);
+  void InvalidateFile(uint32_t file);
+
+  // Drops all blocks and applies the new geometry. A |capacity| smaller
+  // than |block_size| disables the cache. |max_read_ahead| is in blocks.
+  void Configure(size_t block_size, size_t capacity, size_t max_read_ahead);
+  bool enabled() const { return capacity_ >= block_size_; }
+  size_t block_size() const { return block_size_; }
+  size_t max_read_ahead() const { return max_read_ahead_; }
+  void GetStatistics(Statistics* statistics);
+
+ private:
+  typedef std::pair<uint32_t, off_t> Key;
+  struct Block;
+  typedef std::list<Block*> BlockList;
+  typedef std::map<Key, Block*> BlockMap;
+  struct Block {
+    Key key;
+    size_t length;
+    char* data;
+    BlockList::iterator lru;
+  };
+  typedef std::map<std::string, uint32_t> IdMap;
+  struct File {
+    IdMap::iterator id;
+    // Open descriptors and cached blocks. The file is dropped when both
+    // are zero.
+    uint32_t references;
+    size_t blocks;
+    uint32_t generation;
+    // Index of the cached block which ends the file, or -1.
+    off_t last;
+  };
+  typedef std::map<uint32_t, File> FileMap;
+
+  PageCache();
+  ~PageCache();
+
+  static void Create();
+
+  // Returns NULL for a file which was dropped.
+  File* GetFile(uint32_t file);
+  // Drops |file| if nothing refers to it any more.
+  void MaybeDrop(FileMap::iterator it);
+  void Erase(BlockMap::iterator it);
+  void Clear();
+
+  static pthread_once_t once_;
+  static PageCache* instance_;
+
+  IdMap ids_;
+  FileMap files_;
+  uint32_t next_id_;
+  BlockMap blocks_;
+  // Most recently used first.
+  BlockList lru_;
+  size_t block_size_;
+  size_t capacity_;
+  size_t max_read_ahead_;
+  Statistics statistics_;
+  pthread_mutex_t mutex_;
+};
+
+}  // namespace naclfs
+
+#endif  // NACLFS_PAGE_CACHE_H_
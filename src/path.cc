@@ -0,0 +1,83 @@
+//
+// Copyright (c) 2012, Takashi TOYOSHIMA <toyoshim@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// - Neither the name of the authors nor the names of its contributors may be
+//   used to endorse or promote products derived from this software with out
+//   specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUE
+// NTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+// GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.
+//
+
+#include "path.h"
+
+#include <string.h>
+
+namespace naclfs {
+
+ssize_t NormalizePath(const char* base,
+                      size_t base_length,
+                      const char* path,
+                      char* buffer,
+                      size_t size) {
+  // |length| never counts a trailing slash, so the root is an empty string
+  // until the very end.
+  size_t length = 0;
+  if (*path != '/' && base_length > 1) {
+    if (base_length >= size)
+      return -1;
+    memcpy(buffer, base, base_length);
+    length = base_length;
+  }
+
+  while (*path) {
+    while (*path == '/')
+      path++;
+    const char* end = path;
+    while (*end && *end != '/')
+      end++;
+    size_t component = end - path;
+    if (component == 0 || (component == 1 && path[0] == '.')) {
+      // Nothing to append.
+    } else if (component == 2 && path[0] == '.' && path[1] == '.') {
+      while (length && buffer[--length] != '/');
+    } else {
+      if (length + 1 + component >= size)
+        return -1;
+      buffer[length++] = '/';
+      memcpy(&buffer[length], path, component);
+      length += component;
+    }
+    path = end;
+  }
+
+  if (!length) {
+    if (size < 2)
+      return -1;
+    buffer[length++] = '/';
+  }
+  buffer[length] = 0;
+  return length;
+}
+
+}  // namespace naclfs
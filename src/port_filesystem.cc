@@ -172,6 +172,47 @@ int PortFileSystem::Fcntl(int cmd, va_list* ap) {
   return 0;
 }
 
+void PortFileSystem::Execute(Arguments* arguments) {
+  // Ports never touch PPAPI, so asynchronous requests run in place.
+  switch (arguments->function) {
+    case OPEN:
+      arguments->result.open = Open(arguments->u.open.path,
+                                    arguments->u.open.oflag,
+                                    arguments->u.open.cmode);
+      break;
+    case STAT:
+      arguments->result.stat = Stat(arguments->u.stat.path,
+                                    arguments->u.stat.buf);
+      break;
+    case CLOSE:
+      arguments->result.close = Close();
+      break;
+    case FSTAT:
+      arguments->result.fstat = Fstat(arguments->u.fstat.buf);
+      break;
+    case READ:
+      // Do not block for input here; report it as a failed read instead.
+      arguments->result.read = Read(arguments->u.read.buf,
+                                    arguments->u.read.nbytes);
+      if (arguments->result.read == -2)
+        arguments->result.read = -1;
+      break;
+    case WRITE:
+      arguments->result.write = Write(arguments->u.write.buf,
+                                      arguments->u.write.nbytes);
+      break;
+    case FSYNC:
+      // Nothing is buffered.
+      arguments->result.fsync = 0;
+      break;
+    default:
+      naclfs_->Log("PortFileSystem::Execute not supported.\n");
+      arguments->result.callback = -1;
+      break;
+  }
+  Complete(arguments);
+}
+
 bool PortFileSystem::HandleMessage(const pp::Var& message) {
   if (!message.is_string())
     return false;
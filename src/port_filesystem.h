@@ -67,6 +67,9 @@ class PortFileSystem : public FileSystem::Delegate {
   virtual int CloseDir(DIR* dirp) { return -1; }
   static bool HandleMessage(const pp::Var& message);
 
+ protected:
+  virtual void Execute(Arguments* arguments);
+
  private:
   static std::vector<uint8_t> buffer_;
 
@@ -0,0 +1,509 @@
+//
+// Copyright (c) 2012, Takashi TOYOSHIMA <toyoshim@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// - Neither the name of the authors nor the names of its contributors may be
+//   used to endorse or promote products derived from this software with out
+//   specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUE
+// NTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+// GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.
+//
+
+#include "tree_walk.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include <deque>
+#include <vector>
+
+#include "filesystem.h"
+#include "naclfs.h"
+#include "negative_cache.h"
+#include "ppapi/cpp/core.h"
+#include "ppapi/cpp/module.h"
+
+namespace naclfs {
+
+typedef FileSystem::Delegate Delegate;
+
+struct TreeWalk::Context {
+  Delegate::Completion completion;
+  // Operations waiting for a slot in the window, oldest first.
+  std::deque<Operation*> queue;
+  size_t inflight;
+  // Nodes which exist, and whether the visitor stopped the walk.
+  size_t loaded;
+  bool canceled;
+};
+
+// An entry which was listed but not visited yet. A directory keeps its
+// children until they are visited.
+struct TreeWalk::Node {
+  Node() : type(UNKNOWN), error(0), stated(false), listed(false),
+           parked(NULL) {
+    memset(&stat, 0, sizeof(stat));
+  }
+  ~Node();
+
+  std::string name;
+  struct stat stat;
+  Type type;
+  int error;
+  bool stated;
+  bool listed;
+  // The operation which lists this directory once the visitor needs it, if
+  // it was not listed ahead.
+  Operation* parked;
+  std::vector<Node*> children;
+};
+
+// A STAT, OPENDIR or READDIR request for a node. The same operation moves
+// on from one request to the next as a directory is stat'ed, opened and
+// listed.
+struct TreeWalk::Operation : public Delegate::Arguments {
+  Node* node;
+  std::string fullpath;
+  DIR* dirp;
+};
+
+TreeWalk::Node::~Node() {
+  delete parked;
+  for (size_t i = 0; i < children.size(); ++i)
+    delete children[i];
+}
+
+namespace {
+
+// An entry handed from the walking thread to the WalkParallel() workers.
+struct ParallelEntry {
+  TreeWalk::Entry entry;
+  std::string path;
+  struct stat stat;
+};
+
+// Entries waiting for a WalkParallel() worker. The walking thread blocks
+// while |capacity| entries wait.
+struct ParallelWalk {
+  pthread_mutex_t mutex;
+  pthread_cond_t ready;
+  pthread_cond_t space;
+  std::deque<ParallelEntry> entries;
+  size_t capacity;
+  bool done;
+  int result;
+  TreeWalk::Visitor visitor;
+  void* context;
+};
+
+}  // namespace
+
+TreeWalk::TreeWalk(size_t window)
+    : context_(new Context),
+      window_(window ? window : 1) {
+  pthread_mutex_init(&context_->completion.mutex, NULL);
+  pthread_cond_init(&context_->completion.cond, NULL);
+  context_->completion.head = NULL;
+  context_->completion.tail = NULL;
+  context_->inflight = 0;
+  context_->loaded = 0;
+  context_->canceled = false;
+}
+
+TreeWalk::~TreeWalk() {
+  pthread_cond_destroy(&context_->completion.cond);
+  pthread_mutex_destroy(&context_->completion.mutex);
+  delete context_;
+}
+
+int TreeWalk::Walk(const char* root,
+                   bool post_order,
+                   Visitor visitor,
+                   void* context) {
+  if (!root) {
+    errno = EFAULT;
+    return -1;
+  }
+  if (!root[0]) {
+    errno = ENOENT;
+    return -1;
+  }
+  // Requests complete on the main thread, so it can not wait for them.
+  if (pp::Module::Get()->core()->IsMainThread()) {
+    errno = EIO;
+    return -1;
+  }
+  char fullpath[MAXPATHLEN];
+  if (NaClFs::GetFileSystem()->CreateFullpath(root, fullpath)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  Node* node = new Node;
+  node->name = root;
+  Operation* operation = new Operation;
+  operation->function = Delegate::STAT;
+  operation->node = node;
+  operation->fullpath = fullpath;
+  operation->dirp = NULL;
+  context_->queue.push_back(operation);
+  context_->loaded = 1;
+  context_->canceled = false;
+
+  int result;
+  while (!node->stated && Pump()) {}
+  if (node->type == UNKNOWN) {
+    errno = node->error;
+    result = -1;
+  } else {
+    std::string path(root);
+    result = Visit(node, &path, 0, post_order, visitor, context);
+  }
+  if (result)
+    Cancel();
+  delete node;
+  return result;
+}
+
+int TreeWalk::WalkParallel(const char* root,
+                           size_t threads,
+                           Visitor visitor,
+                           void* context) {
+  ParallelWalk walk;
+  pthread_mutex_init(&walk.mutex, NULL);
+  pthread_cond_init(&walk.ready, NULL);
+  pthread_cond_init(&walk.space, NULL);
+  walk.capacity = window_ * kLookahead;
+  walk.done = false;
+  walk.result = 0;
+  walk.visitor = visitor;
+  walk.context = context;
+
+  std::vector<pthread_t> workers;
+  for (size_t i = 0; i < (threads ? threads : 1); ++i) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, Worker, &walk))
+      break;
+    workers.push_back(thread);
+  }
+  int result = -1;
+  if (workers.empty())
+    errno = EAGAIN;
+  else
+    result = Walk(root, false, Enqueue, &walk);
+
+  pthread_mutex_lock(&walk.mutex);
+  walk.done = true;
+  pthread_cond_broadcast(&walk.ready);
+  pthread_mutex_unlock(&walk.mutex);
+  for (size_t i = 0; i < workers.size(); ++i)
+    pthread_join(workers[i], NULL);
+  pthread_cond_destroy(&walk.space);
+  pthread_cond_destroy(&walk.ready);
+  pthread_mutex_destroy(&walk.mutex);
+  // A visitor which stopped the walk wins over the walk's own result.
+  return walk.result ? walk.result : result;
+}
+
+bool TreeWalk::Pump() {
+  while (context_->inflight < window_ && !context_->queue.empty()) {
+    Operation* operation = context_->queue.front();
+    context_->queue.pop_front();
+    Start(operation);
+  }
+  if (!context_->inflight)
+    return !context_->queue.empty();
+
+  Delegate::Completion* completion = &context_->completion;
+  pthread_mutex_lock(&completion->mutex);
+  while (!completion->head)
+    pthread_cond_wait(&completion->cond, &completion->mutex);
+  Delegate::Arguments* list = completion->head;
+  completion->head = NULL;
+  completion->tail = NULL;
+  pthread_mutex_unlock(&completion->mutex);
+  while (list) {
+    Operation* operation = static_cast<Operation*>(list);
+    list = list->next;
+    context_->inflight--;
+    Finish(operation);
+  }
+  return true;
+}
+
+void TreeWalk::Start(Operation* operation) {
+  FileSystem* filesystem = NaClFs::GetFileSystem();
+  Delegate* delegate = NULL;
+  Node* node = operation->node;
+  const char* path = operation->fullpath.c_str();
+  switch (operation->function) {
+    case Delegate::STAT:
+      if (filesystem->negatives_->Lookup(path)) {
+        node->error = ENOENT;
+        node->stated = true;
+        break;
+      }
+      delegate = filesystem->CreateDelegate(path, NULL);
+      if (!delegate) {
+        node->error = ENODEV;
+        node->stated = true;
+        break;
+      }
+      // Entries a readdirplus prefetched need no request.
+      if (delegate->StatCached(path, &node->stat)) {
+        operation->delegate = delegate;
+        operation->result.stat = 0;
+        Finish(operation);
+        return;
+      }
+      operation->u.stat.path = path;
+      operation->u.stat.buf = &node->stat;
+      break;
+    case Delegate::OPENDIR:
+      delegate = filesystem->CreateDelegate(path, NULL);
+      if (!delegate) {
+        node->type = UNREADABLE;
+        node->listed = true;
+        break;
+      }
+      operation->u.opendir.dirname = path;
+      break;
+    case Delegate::READDIR:
+      // The delegate which opened the directory.
+      delegate = operation->delegate;
+      operation->u.readdir.dirp = operation->dirp;
+      break;
+    default:
+      break;
+  }
+  if (!delegate) {
+    delete operation;
+    return;
+  }
+  context_->inflight++;
+  delegate->Submit(operation, &context_->completion);
+}
+
+void TreeWalk::Finish(Operation* operation) {
+  FileSystem* filesystem = NaClFs::GetFileSystem();
+  Delegate* delegate = operation->delegate;
+  Node* node = operation->node;
+  switch (operation->function) {
+    case Delegate::STAT:
+      delegate->Release();
+      node->stated = true;
+      node->error = operation->result.stat;
+      if (node->error) {
+        if (node->error == ENOENT)
+          filesystem->negatives_->Insert(operation->fullpath.c_str());
+        break;
+      }
+      if (!S_ISDIR(node->stat.st_mode)) {
+        node->type = FILE;
+        break;
+      }
+      node->type = DIRECTORY;
+      operation->function = Delegate::OPENDIR;
+      if (context_->canceled)
+        break;
+      // List ahead of the visitor while few entries are loaded. Otherwise
+      // the listing waits until the visitor reaches the directory.
+      if (context_->loaded < window_ * kLookahead)
+        context_->queue.push_back(operation);
+      else
+        node->parked = operation;
+      return;
+    case Delegate::OPENDIR:
+      operation->dirp = operation->result.opendir;
+      if (!operation->dirp) {
+        delegate->Release();
+        node->type = UNREADABLE;
+        node->listed = true;
+        break;
+      }
+      if (context_->canceled) {
+        delegate->CloseDir(operation->dirp);
+        delegate->Release();
+        break;
+      }
+      operation->function = Delegate::READDIR;
+      context_->queue.push_back(operation);
+      return;
+    case Delegate::READDIR: {
+      // The first entry came through the main thread together with the
+      // whole listing. The rest are served from the fetched listing.
+      std::string prefix(operation->fullpath);
+      if (prefix[prefix.size() - 1] != '/')
+        prefix.push_back('/');
+      for (struct dirent* entry = operation->result.readdir;
+           entry && !context_->canceled;
+           entry = delegate->ReadDir(operation->dirp)) {
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+          continue;
+        Node* child = new Node;
+        child->name = entry->d_name;
+        node->children.push_back(child);
+        context_->loaded++;
+        Operation* stat = new Operation;
+        stat->function = Delegate::STAT;
+        stat->node = child;
+        stat->fullpath = prefix + child->name;
+        stat->dirp = NULL;
+        context_->queue.push_back(stat);
+      }
+      node->listed = true;
+      delegate->CloseDir(operation->dirp);
+      delegate->Release();
+      break;
+    }
+    default:
+      break;
+  }
+  delete operation;
+}
+
+void TreeWalk::Cancel() {
+  context_->canceled = true;
+  while (!context_->queue.empty()) {
+    Operation* operation = context_->queue.front();
+    context_->queue.pop_front();
+    // A queued READDIR holds the directory its OPENDIR opened.
+    if (operation->function == Delegate::READDIR) {
+      operation->delegate->CloseDir(operation->dirp);
+      operation->delegate->Release();
+    }
+    delete operation;
+  }
+  while (context_->inflight)
+    Pump();
+}
+
+int TreeWalk::Visit(Node* node,
+                    std::string* path,
+                    int level,
+                    bool post_order,
+                    Visitor visitor,
+                    void* context) {
+  while (!node->stated && Pump()) {}
+  if (node->type == DIRECTORY) {
+    // A directory is reported once it is listed, as it may turn out to be
+    // unreadable. Listings the lookahead skipped are needed first now.
+    if (node->parked) {
+      context_->queue.push_front(node->parked);
+      node->parked = NULL;
+    }
+    while (!node->listed && Pump()) {}
+  }
+
+  size_t length = path->size();
+  if (level) {
+    if ((*path)[length - 1] != '/')
+      path->push_back('/');
+    path->append(node->name);
+  }
+  Entry entry;
+  entry.path = path->c_str();
+  entry.stat = &node->stat;
+  entry.type = node->type;
+  entry.level = level;
+  entry.base = path->size() - node->name.size();
+  if (!level) {
+    // The root is reported as given, so find its last component.
+    size_t end = path->find_last_not_of('/');
+    size_t slash = end == std::string::npos ?
+        std::string::npos : path->rfind('/', end);
+    entry.base = slash == std::string::npos ? 0 : slash + 1;
+  }
+
+  int result = 0;
+  if (node->type != DIRECTORY || !post_order)
+    result = visitor(entry, context);
+  for (size_t i = 0; !result && node->type == DIRECTORY &&
+       i < node->children.size(); ++i) {
+    result = Visit(
+        node->children[i], path, level + 1, post_order, visitor, context);
+  }
+  if (!result && node->type == DIRECTORY && post_order) {
+    entry.path = path->c_str();
+    entry.type = DIRECTORY_POST;
+    result = visitor(entry, context);
+  }
+  path->resize(length);
+  if (result)
+    return result;
+
+  // Visited children have no children left and no requests in flight.
+  for (size_t i = 0; i < node->children.size(); ++i)
+    delete node->children[i];
+  context_->loaded -= node->children.size();
+  node->children.clear();
+  return 0;
+}
+
+int TreeWalk::Enqueue(const Entry& entry, void* param) {
+  ParallelWalk* walk = static_cast<ParallelWalk*>(param);
+  pthread_mutex_lock(&walk->mutex);
+  while (!walk->result && walk->entries.size() >= walk->capacity)
+    pthread_cond_wait(&walk->space, &walk->mutex);
+  int result = walk->result;
+  if (!result) {
+    walk->entries.push_back(ParallelEntry());
+    ParallelEntry& item = walk->entries.back();
+    item.entry = entry;
+    item.path = entry.path;
+    item.stat = *entry.stat;
+    pthread_cond_signal(&walk->ready);
+  }
+  pthread_mutex_unlock(&walk->mutex);
+  return result;
+}
+
+void* TreeWalk::Worker(void* param) {
+  ParallelWalk* walk = static_cast<ParallelWalk*>(param);
+  pthread_mutex_lock(&walk->mutex);
+  for (;;) {
+    while (!walk->result && !walk->done && walk->entries.empty())
+      pthread_cond_wait(&walk->ready, &walk->mutex);
+    if (walk->result || walk->entries.empty())
+      break;
+    ParallelEntry item = walk->entries.front();
+    walk->entries.pop_front();
+    pthread_cond_signal(&walk->space);
+    pthread_mutex_unlock(&walk->mutex);
+    item.entry.path = item.path.c_str();
+    item.entry.stat = &item.stat;
+    int result = walk->visitor(item.entry, walk->context);
+    pthread_mutex_lock(&walk->mutex);
+    if (result && !walk->result) {
+      walk->result = result;
+      pthread_cond_broadcast(&walk->ready);
+      pthread_cond_broadcast(&walk->space);
+    }
+  }
+  pthread_mutex_unlock(&walk->mutex);
+  return NULL;
+}
+
+}  // namespace naclfs
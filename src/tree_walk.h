@@ -0,0 +1,126 @@
+//
+// Copyright (c) 2012, Takashi TOYOSHIMA <toyoshim@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// - Neither the name of the authors nor the names of its contributors may be
+//   used to endorse or promote products derived from this software with out
+//   specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUE
+// NTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+// GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.
+//
+
+#ifndef NACLFS_TREE_WALK_H_
+#define NACLFS_TREE_WALK_H_
+#pragma once
+
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <string>
+
+namespace naclfs {
+
+// Walks a directory tree like nftw(), with up to |window| stat and
+// directory read requests in flight at once instead of one at a time.
+// Entries are visited in depth first order as soon as their requests
+// complete, while the requests for the entries after them are in flight.
+// Directories are listed ahead of the visitor only while fewer than
+// |window| * kLookahead entries are loaded, so memory stays bounded however
+// large the tree is. Stats are answered from metadata the delegates cache
+// on the calling thread when possible.
+//
+// A TreeWalk is used by one thread at a time. The visitor must not modify
+// the tree being walked.
+class TreeWalk {
+ public:
+  enum Type {
+    FILE,            // Anything which is not a directory.
+    DIRECTORY,       // A directory, before its entries.
+    DIRECTORY_POST,  // A directory, after its entries with |post_order|.
+    UNREADABLE,      // A directory which could not be listed.
+    UNKNOWN          // An entry which could not be stat'ed.
+  };
+
+  struct Entry {
+    // |path| starts with the root as given to Walk(), and its last
+    // component starts at |base|. The root has |level| 0.
+    const char* path;
+    const struct stat* stat;
+    Type type;
+    int level;
+    int base;
+  };
+
+  // Returns 0 to continue. Anything else stops the walk and is returned by
+  // Walk().
+  typedef int (*Visitor)(const Entry& entry, void* context);
+
+  static const size_t kDefaultWindow = 32;
+  static const size_t kLookahead = 64;
+
+  explicit TreeWalk(size_t window);
+  ~TreeWalk();
+
+  // Visits |root| and everything below it, directories before their
+  // entries, or after them with |post_order|. Returns 0 when all entries
+  // were visited, the result of a visitor which stopped the walk, or -1
+  // with errno set if |root| can not be stat'ed.
+  int Walk(const char* root, bool post_order, Visitor visitor, void* context);
+  // Visits every entry once, calling |visitor| on |threads| threads at once
+  // in no particular order, while the calling thread walks the tree.
+  // DIRECTORY_POST is never reported.
+  int WalkParallel(const char* root,
+                   size_t threads,
+                   Visitor visitor,
+                   void* context);
+
+ private:
+  struct Context;
+  struct Node;
+  struct Operation;
+
+  // Starts queued requests up to the window, and waits for and finishes
+  // completed ones. Returns false if nothing is queued or in flight.
+  bool Pump();
+  void Start(Operation* operation);
+  void Finish(Operation* operation);
+  // Drops queued requests and waits for the ones in flight, after the
+  // visitor stopped the walk.
+  void Cancel();
+  int Visit(Node* node,
+            std::string* path,
+            int level,
+            bool post_order,
+            Visitor visitor,
+            void* context);
+  static int Enqueue(const Entry& entry, void* param);
+  static void* Worker(void* param);
+
+  Context* context_;
+  size_t window_;
+};
+
+}  // namespace naclfs
+
+#endif  // NACLFS_TREE_WALK_H_
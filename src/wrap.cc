@@ -33,12 +33,16 @@
 
 #include <assert.h>
 #include <errno.h>
+#if defined(__GLIBC__)
+#  include <ftw.h>
+#endif  // defined(__GLIBC__)
 #include <irt.h>
 #if defined(__GLIBC__)
 #  include <irt_syscalls.h>
 #endif  // defined(__GLIBC__)
 #include <stdarg.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/param.h>
 #include <unistd.h>
 
@@ -46,6 +50,7 @@
 
 #include "filesystem.h"
 #include "naclfs.h"
+#include "tree_walk.h"
 
 int __wrap_open(const char* path, int oflag, mode_t cmode, int* newfd) {
   if (naclfs::NaClFs::trace()) {
@@ -278,6 +283,158 @@ extern "C" int __wrap_fcntl(int fildes, int cmd, ...) {
   return result;
 }
 
+extern "C" ssize_t pread(int fildes, void* buf, size_t nbytes, off_t offset) {
+  if (naclfs::NaClFs::trace()) {
+    std::stringstream ss;
+    ss << "enter pread:" << std::endl;
+    ss << " fildes=" << fildes << std::endl;
+    ss << " nbytes=" << nbytes << std::endl;
+    ss << " offset=" << offset << std::endl;
+    naclfs::NaClFs::Log(ss.str().c_str());
+  }
+  return naclfs::NaClFs::GetFileSystem()->PRead(fildes, buf, nbytes, offset);
+}
+
+extern "C" ssize_t pwrite(int fildes,
+                          const void* buf,
+                          size_t nbytes,
+                          off_t offset) {
+  if (naclfs::NaClFs::trace()) {
+    std::stringstream ss;
+    ss << "enter pwrite:" << std::endl;
+    ss << " fildes=" << fildes << std::endl;
+    ss << " nbytes=" << nbytes << std::endl;
+    ss << " offset=" << offset << std::endl;
+    naclfs::NaClFs::Log(ss.str().c_str());
+  }
+  return naclfs::NaClFs::GetFileSystem()->PWrite(fildes, buf, nbytes, offset);
+}
+
+extern "C" ssize_t readv(int fildes, const struct iovec* iov, int iovcnt) {
+  if (naclfs::NaClFs::trace()) {
+    std::stringstream ss;
+    ss << "enter readv:" << std::endl;
+    ss << " fildes=" << fildes << std::endl;
+    ss << " iovcnt=" << iovcnt << std::endl;
+    naclfs::NaClFs::Log(ss.str().c_str());
+  }
+  return naclfs::NaClFs::GetFileSystem()->ReadV(fildes, iov, iovcnt);
+}
+
+extern "C" ssize_t writev(int fildes, const struct iovec* iov, int iovcnt) {
+  if (naclfs::NaClFs::trace()) {
+    std::stringstream ss;
+    ss << "enter writev:" << std::endl;
+    ss << " fildes=" << fildes << std::endl;
+    ss << " iovcnt=" << iovcnt << std::endl;
+    naclfs::NaClFs::Log(ss.str().c_str());
+  }
+  return naclfs::NaClFs::GetFileSystem()->WriteV(fildes, iov, iovcnt);
+}
+
+extern "C" int fsync(int fildes) {
+  if (naclfs::NaClFs::trace()) {
+    std::stringstream ss;
+    ss << "enter fsync:" << std::endl;
+    ss << " fildes=" << fildes << std::endl;
+    naclfs::NaClFs::Log(ss.str().c_str());
+  }
+  int result = naclfs::NaClFs::GetFileSystem()->Fsync(fildes);
+  if (result) {
+    errno = result;
+    return -1;
+  }
+  return 0;
+}
+
+extern "C" int fdatasync(int fildes) {
+  // FileIO::Flush() can not skip metadata, so this is the same as fsync().
+  return fsync(fildes);
+}
+
+static int (*__nacl_irt_mmap_real)(void**, size_t, int, int, int, off_t);
+static int (*__nacl_irt_munmap_real)(void*, size_t);
+
+int __wrap_mmap(void** addr,
+                size_t len,
+                int prot,
+                int flags,
+                int fd,
+                off_t off) {
+  if (flags & MAP_ANONYMOUS)
+    return __nacl_irt_mmap_real(addr, len, prot, flags, fd, off);
+  if (naclfs::NaClFs::trace()) {
+    std::stringstream ss;
+    ss << "enter mmap:" << std::endl;
+    ss << " addr=" << *addr << std::endl;
+    ss << " len=" << len << std::endl;
+    ss << " prot=" << prot << std::endl;
+    ss << " flags=" << flags << std::endl;
+    ss << " fd=" << fd << std::endl;
+    ss << " off=" << off << std::endl;
+    naclfs::NaClFs::Log(ss.str().c_str());
+  }
+  // Files are mapped on anonymous memory which naclfs fills in.
+  if (flags & MAP_FIXED)
+    naclfs::FileSystem::MUnmap(*addr, len);
+  void* start = *addr;
+  int result = __nacl_irt_mmap_real(&start,
+                                    len,
+                                    prot | PROT_READ | PROT_WRITE,
+                                    (flags & MAP_FIXED) | MAP_PRIVATE |
+                                        MAP_ANONYMOUS,
+                                    -1,
+                                    0);
+  if (!result) {
+    result = naclfs::NaClFs::GetFileSystem()->MMap(
+        fd, start, len, prot, flags, off);
+    // The pages were writable to be filled in. Write back reads them, so
+    // writable pages stay readable.
+    int protection = (prot & PROT_WRITE) ? prot | PROT_READ : prot;
+    if (!result && protection != (PROT_READ | PROT_WRITE) &&
+        mprotect(start, len, protection)) {
+      result = errno;
+      naclfs::FileSystem::MUnmap(start, len);
+    }
+    if (result)
+      __nacl_irt_munmap_real(start, len);
+    else
+      *addr = start;
+  }
+  if (naclfs::NaClFs::trace()) {
+    std::stringstream ss;
+    ss << "leave mmap: " << result << std::endl;
+    ss << " addr=" << *addr << std::endl;
+    naclfs::NaClFs::Log(ss.str().c_str());
+  }
+  return result;
+}
+
+int __wrap_munmap(void* addr, size_t len) {
+  // The range is unmapped even if writing it back fails, and the failure is
+  // reported as munmap() failing.
+  int error = naclfs::FileSystem::MUnmap(addr, len);
+  int result = __nacl_irt_munmap_real(addr, len);
+  return error ? error : result;
+}
+
+extern "C" int msync(void* addr, size_t len, int flags) {
+  if (naclfs::NaClFs::trace()) {
+    std::stringstream ss;
+    ss << "enter msync:" << std::endl;
+    ss << " addr=" << addr << std::endl;
+    ss << " len=" << len << std::endl;
+    ss << " flags=" << flags << std::endl;
+    naclfs::NaClFs::Log(ss.str().c_str());
+  }
+  int result = naclfs::FileSystem::MSync(addr, len, flags);
+  if (result) {
+    errno = result;
+    return -1;
+  }
+  return 0;
+}
+
 extern "C" int mkdir(const char* path, mode_t mode) {
   if (naclfs::NaClFs::trace()) {
     std::stringstream ss;
@@ -347,18 +504,16 @@ extern "C" int readdir_r(DIR* dirp,
 }
 
 extern "C" long telldir(DIR* dirp) {
-  naclfs::NaClFs::Log("XXX not impl: telldir\n");
   if (naclfs::NaClFs::trace()) {
     std::stringstream ss;
     ss << "enter telldir:" << std::endl;
     ss << " dirp=" << dirp << std::endl;
     naclfs::NaClFs::Log(ss.str().c_str());
   }
-  return -1;
+  return naclfs::NaClFs::GetFileSystem()->TellDir(dirp);
 }
 
 extern "C" void seekdir(DIR* dirp, long offset) {
-  naclfs::NaClFs::Log("XXX not impl: seekdir\n");
   if (naclfs::NaClFs::trace()) {
     std::stringstream ss;
     ss << "enter seekdir:" << std::endl;
@@ -366,6 +521,7 @@ extern "C" void seekdir(DIR* dirp, long offset) {
     ss << " offset=" << offset << std::endl;
     naclfs::NaClFs::Log(ss.str().c_str());
   }
+  naclfs::NaClFs::GetFileSystem()->SeekDir(dirp, offset);
 }
 
 extern "C" int closedir(DIR* dirp) {
@@ -378,6 +534,42 @@ extern "C" int closedir(DIR* dirp) {
   return naclfs::NaClFs::GetFileSystem()->CloseDir(dirp);
 }
 
+#if defined(__GLIBC__)
+// newlib has no <ftw.h>. Its users can call naclfs::TreeWalk directly.
+typedef int (*NftwFunction)(const char*, const struct stat*, int, struct FTW*);
+
+static int NftwVisitor(const naclfs::TreeWalk::Entry& entry, void* context) {
+  static const int kTypes[] = { FTW_F, FTW_D, FTW_DP, FTW_DNR, FTW_NS };
+  struct FTW ftw;
+  ftw.base = entry.base;
+  ftw.level = entry.level;
+  return reinterpret_cast<NftwFunction>(context)(
+      entry.path, entry.stat, kTypes[entry.type], &ftw);
+}
+
+extern "C" int nftw(const char* path, NftwFunction fn, int nopenfd, int flags) {
+  if (naclfs::NaClFs::trace()) {
+    std::stringstream ss;
+    ss << "enter nftw:" << std::endl;
+    ss << " path=" << path << std::endl;
+    ss << " nopenfd=" << nopenfd << std::endl;
+    ss << " flags=" << flags << std::endl;
+    naclfs::NaClFs::Log(ss.str().c_str());
+  }
+  // There are no symbolic links or mount points to care about, so FTW_PHYS
+  // and FTW_MOUNT change nothing. Other flags, FTW_CHDIR among them, are
+  // not supported and fail rather than being ignored.
+  if (flags & ~(FTW_DEPTH | FTW_PHYS | FTW_MOUNT)) {
+    errno = EINVAL;
+    return -1;
+  }
+  // |nopenfd| bounds the directories read at once.
+  naclfs::TreeWalk walk(nopenfd > 0 ? nopenfd : 1);
+  return walk.Walk(path, flags & FTW_DEPTH, NftwVisitor,
+                   reinterpret_cast<void*>(fn));
+}
+#endif  // defined(__GLIBC__)
+
 extern "C" int chdir(const char* path) {
   if (naclfs::NaClFs::trace()) {
     std::stringstream ss;
@@ -417,6 +609,10 @@ __attribute__((constructor)) static void wrap() {
   __nacl_irt_write = __wrap_write;
   __nacl_irt_seek = __wrap_seek;
   __nacl_irt_fstat = __wrap_fstat;
+  __nacl_irt_mmap_real = __nacl_irt_mmap;
+  __nacl_irt_mmap = __wrap_mmap;
+  __nacl_irt_munmap_real = __nacl_irt_munmap;
+  __nacl_irt_munmap = __wrap_munmap;
 
   setvbuf(stdout, NULL, _IOLBF, 4096);
   setvbuf(stderr, NULL, _IOLBF, 4096);
@@ -426,6 +622,7 @@ __attribute__((constructor)) static void wrap() {
 // Use IRT structure overwriting for newlib.
 extern "C" struct nacl_irt_filename __libnacl_irt_dev_filename;
 extern "C" struct nacl_irt_fdio __libnacl_irt_fdio;
+extern "C" struct nacl_irt_memory __libnacl_irt_memory;
 __attribute__((constructor)) static void wrap() {
   __libnacl_irt_dev_filename.open = __wrap_open;
   __libnacl_irt_dev_filename.stat = __wrap_stat;
@@ -439,6 +636,11 @@ __attribute__((constructor)) static void wrap() {
   __libnacl_irt_fdio.seek = __wrap_seek;
   __libnacl_irt_fdio.fstat = __wrap_fstat;
   //__libnacl_irt_fdio.getdents = __wrap_getdents;
+
+  __nacl_irt_mmap_real = __libnacl_irt_memory.mmap;
+  __libnacl_irt_memory.mmap = __wrap_mmap;
+  __nacl_irt_munmap_real = __libnacl_irt_memory.munmap;
+  __libnacl_irt_memory.munmap = __wrap_munmap;
 }
 #endif  // defined(__GLIBC__)
 
@@ -0,0 +1,166 @@
+//
+// Copyright (c) 2012, Takashi TOYOSHIMA <toyoshim@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// - Neither the name of the authors nor the names of its contributors may be
+//   used to endorse or promote products derived from this software with out
+//   specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUE
+// NTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+// GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.
+//
+
+// Host side microbenchmark for NormalizePath(). It compares against the
+// previous implementation which split paths into a std::vector<std::string>,
+// and counts heap allocations made by each.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <sys/time.h>
+
+#include <new>
+#include <string>
+#include <vector>
+
+#include "path.h"
+
+static size_t g_allocations = 0;
+
+void* operator new(size_t size) {
+  g_allocations++;
+  void* p = malloc(size ? size : 1);
+  if (!p)
+    throw std::bad_alloc();
+  return p;
+}
+
+void operator delete(void* p) throw() {
+  free(p);
+}
+
+namespace {
+
+const char* kPaths[] = {
+  "hello",
+  "/test_path/hello",
+  "test_path/../test_path/hello",
+  "./include/../include/sys/stat.h",
+  "/usr/lib/../lib/naclfs/naclfs.js",
+  "../../a/b/c/d/e/f/g",
+};
+const size_t kPathCount = sizeof(kPaths) / sizeof(kPaths[0]);
+const char kCwd[] = "/home/user/src/project";
+const int kIterations = 1000000;
+
+// The vector based implementation which NormalizePath() replaced.
+void LegacyNormalize(const std::string& cwd,
+                     const char* path,
+                     std::string* fullpath) {
+  std::vector<std::string> paths;
+  if (*path != '/' && cwd.size()) {
+    size_t offset = 0;
+    for (;;) {
+      size_t next_offset = cwd.find("/", offset);
+      if (next_offset == std::string::npos) {
+        paths.push_back(cwd.substr(offset));
+        break;
+      }
+      paths.push_back(cwd.substr(offset, next_offset - offset));
+      offset = next_offset + 1;
+    }
+  }
+  for (const char* caret = path; *caret != 0; ) {
+    const char* delim = index(caret, '/');
+    if (NULL == delim) {
+      paths.push_back(std::string(caret));
+      break;
+    } else {
+      int size = delim - caret;
+      if (size != 0 && !(size == 1 && *caret == '.'))
+        paths.push_back(std::string(caret, size));
+      caret = delim + 1;
+    }
+  }
+  for (std::vector<std::string>::iterator iter = paths.begin();
+      iter != paths.end();
+      ++iter) {
+    if (iter->compare(".."))
+      continue;
+    if (iter != paths.begin())
+      paths.erase(iter--);
+    paths.erase(iter--);
+  }
+  if (!paths.size())
+    *fullpath = "/";
+  else for (std::vector<std::string>::iterator iter = paths.begin();
+      iter != paths.end();
+      ++iter) {
+    fullpath->append("/");
+    fullpath->append(*iter);
+  }
+}
+
+double Now() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+void Report(const char* name, double seconds, size_t allocations) {
+  double calls = static_cast<double>(kIterations) * kPathCount;
+  printf("%-14s %8.1f ns/call %8.2f allocations/call\n",
+         name, seconds * 1e9 / calls, allocations / calls);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  size_t checksum = 0;
+
+  std::string cwd(&kCwd[1]);  // The legacy code kept cwd without '/'.
+  size_t allocations = g_allocations;
+  double start = Now();
+  for (int i = 0; i < kIterations; ++i) {
+    for (size_t j = 0; j < kPathCount; ++j) {
+      std::string fullpath;
+      LegacyNormalize(cwd, kPaths[j], &fullpath);
+      checksum += fullpath.size();
+    }
+  }
+  Report("legacy", Now() - start, g_allocations - allocations);
+
+  allocations = g_allocations;
+  start = Now();
+  for (int i = 0; i < kIterations; ++i) {
+    for (size_t j = 0; j < kPathCount; ++j) {
+      char fullpath[MAXPATHLEN];
+      checksum += naclfs::NormalizePath(
+          kCwd, sizeof(kCwd) - 1, kPaths[j], fullpath, sizeof(fullpath));
+    }
+  }
+  Report("NormalizePath", Now() - start, g_allocations - allocations);
+
+  printf("checksum %lu\n", static_cast<unsigned long>(checksum));
+  return 0;
+}
@@ -32,16 +32,30 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <sstream>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#include <string>
 #include <vector>
 
+#include "dentry_cache.h"
+#include "directory_index.h"
+#include "filesystem.h"
+#include "io_queue.h"
+#include "mem_filesystem.h"
+#include "naclfs.h"
+#include "pack_builder.h"
+#include "pack_filesystem.h"
+#include "tree_walk.h"
+
 #if !defined(__GLIBC__)
 extern "C" void rewinddir(DIR*);
 #endif  // !defined(__GLIBC__)
@@ -233,6 +247,111 @@ bool test_POSIX_DirectoryEnumeration() {
   return true;
 }
 
+bool test_POSIX_DirectoryPosition() {
+  DIR* dir = opendir("/test_path");
+  if (NULL == dir)
+    ERROR("can not opendir /test_path");
+
+  if (0 != telldir(dir))
+    ERROR("telldir does not start from 0");
+  struct dirent* ent = readdir(dir);
+  if (NULL == ent)
+    ERROR("readdir returns no entry");
+  char first[256];
+  strcpy(first, ent->d_name);
+  long position = telldir(dir);
+  if (1 != position)
+    ERROR("telldir does not count the returned entry");
+  if (NULL == (ent = readdir(dir)))
+    ERROR("readdir returns no second entry");
+  char second[256];
+  strcpy(second, ent->d_name);
+  if (NULL != readdir(dir))
+    ERROR("readdir returns more entries than expected");
+
+  seekdir(dir, position);
+  if (NULL == (ent = readdir(dir)) || strcmp(second, ent->d_name))
+    ERROR("seekdir does not restore the position");
+  seekdir(dir, 0);
+  if (NULL == (ent = readdir(dir)) || strcmp(first, ent->d_name))
+    ERROR("seekdir does not rewind");
+
+  if (closedir(dir))
+    ERROR("closedir fails");
+
+  return true;
+}
+
+bool test_POSIX_DirectoryEntryTypes() {
+#if defined(_DIRENT_HAVE_D_TYPE)
+  DIR* dir = opendir("/test_path");
+  if (NULL == dir)
+    ERROR("can not opendir /test_path");
+
+  struct dirent* ent;
+  while (NULL != (ent = readdir(dir))) {
+    if (!strcmp("child_dir", ent->d_name) && DT_DIR != ent->d_type)
+      ERROR("d_type of child_dir is not DT_DIR");
+    if (!strcmp("hello", ent->d_name) && DT_REG != ent->d_type)
+      ERROR("d_type of hello is not DT_REG");
+  }
+
+  if (closedir(dir))
+    ERROR("closedir fails");
+#endif  // defined(_DIRENT_HAVE_D_TYPE)
+
+  return true;
+}
+
+bool test_POSIX_DirectoryPrefetch() {
+  // The file is left behind, so it gets a directory of its own which the
+  // enumeration tests do not list.
+  mkdir("/test_prefetch", S_IRUSR | S_IWUSR);
+  const char* fname = "/test_prefetch/prefetched";
+  int fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC);
+  if (fd < 0)
+    ERROR("can not create /test_prefetch/prefetched");
+  if (5 != write(fd, "@@@@@", 5))
+    ERROR("can not write to /test_prefetch/prefetched");
+  if (close(fd))
+    ERROR("close /test_prefetch/prefetched failed");
+
+  // Listing the directory fetches metadata of its entries, so that stat()
+  // on them is answered by the dentry cache.
+  naclfs::NaClFs::SetReadDirPlus(64);
+  DIR* dir = opendir("/test_prefetch");
+  if (NULL == dir)
+    ERROR("can not opendir /test_prefetch");
+  bool found = false;
+  struct dirent* ent;
+  while (NULL != (ent = readdir(dir))) {
+    if (strcmp("prefetched", ent->d_name))
+      continue;
+    found = true;
+#if defined(_DIRENT_HAVE_D_TYPE)
+    if (DT_REG != ent->d_type)
+      ERROR("d_type of prefetched is not DT_REG");
+#endif  // defined(_DIRENT_HAVE_D_TYPE)
+  }
+  if (closedir(dir))
+    ERROR("closedir fails");
+  naclfs::NaClFs::SetReadDirPlus(0);
+  if (!found)
+    ERROR("readdir does not list prefetched");
+
+  naclfs::DentryCache::Statistics before;
+  naclfs::DentryCache::GetInstance()->GetStatistics(&before);
+  struct stat buf;
+  if (stat(fname, &buf) || 5 != buf.st_size)
+    ERROR("stat on /test_prefetch/prefetched failed");
+  naclfs::DentryCache::Statistics after;
+  naclfs::DentryCache::GetInstance()->GetStatistics(&after);
+  if (after.hits != before.hits + 1 || after.misses != before.misses)
+    ERROR("stat after readdir is not served by the dentry cache");
+
+  return true;
+}
+
 bool test_SystemCall_StatStandards() {
   struct stat buf;
   mode_t expected_mode = S_IFCHR | S_IRUSR | S_IWUSR;
@@ -326,6 +445,311 @@ bool test_SystemCall_ReadLseekAndWriteFile() {
   return true;
 }
 
+bool test_SystemCall_AppendAndSeekEnd() {
+  const char* fname = "/test_append";
+  int fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC);
+  if (fd < 0)
+    ERROR("can not create /test_append");
+  if (3 != write(fd, "abc", 3))
+    ERROR("can not write to /test_append");
+  if (close(fd))
+    ERROR("close /test_append failed");
+
+  fd = open(fname, O_WRONLY | O_APPEND);
+  if (fd < 0)
+    ERROR("can not open /test_append to append");
+  if (3 != write(fd, "def", 3))
+    ERROR("can not append to /test_append");
+  if (close(fd))
+    ERROR("close /test_append failed");
+
+  // Plain opens do not fetch the size until SEEK_END needs it.
+  fd = open(fname, O_RDONLY);
+  if (fd < 0)
+    ERROR("can not open /test_append to read");
+  if (6 != lseek(fd, 0, SEEK_END))
+    ERROR("seek with SEEK_END failed");
+  if (3 != lseek(fd, -3, SEEK_END))
+    ERROR("second seek with SEEK_END failed");
+  char buf[4];
+  if (3 != read(fd, buf, 4) || memcmp(buf, "def", 3))
+    ERROR("appended data is not found");
+  if (close(fd))
+    ERROR("close /test_append failed");
+
+  return true;
+}
+
+bool test_SystemCall_CachedSequentialRead() {
+  const char* fname = "/test_cached_read";
+  const int size = 300 * 1024;
+  std::vector<char> data(size);
+  for (int i = 0; i < size; ++i)
+    data[i] = i % 251;
+  int fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC);
+  if (fd < 0)
+    ERROR("can not create /test_cached_read");
+  if (size != write(fd, &data[0], size))
+    ERROR("can not write to /test_cached_read");
+  if (close(fd))
+    ERROR("close /test_cached_read failed");
+
+  // Small sequential reads are served from read-ahead blocks.
+  fd = open(fname, O_RDONLY);
+  if (fd < 0)
+    ERROR("can not open /test_cached_read");
+  char buf[1000];
+  for (int offset = 0; offset < size; offset += sizeof(buf)) {
+    int expected = size - offset;
+    if (expected > static_cast<int>(sizeof(buf)))
+      expected = sizeof(buf);
+    if (expected != read(fd, buf, sizeof(buf)))
+      ERROR("sequential read returns unexpected size");
+    if (memcmp(buf, &data[offset], expected))
+      ERROR("sequential read returns unexpected data");
+  }
+  if (0 != read(fd, buf, sizeof(buf)))
+    ERROR("read at the end of file returns data");
+
+  // Cached blocks must not survive writes through another descriptor.
+  int wfd = open(fname, O_WRONLY);
+  if (wfd < 0)
+    ERROR("can not open /test_cached_read to write");
+  if (100000 != lseek(wfd, 100000, SEEK_SET) || 5 != write(wfd, "@@@@@", 5))
+    ERROR("can not overwrite /test_cached_read");
+  if (close(wfd))
+    ERROR("close /test_cached_read failed");
+  if (99998 != lseek(fd, 99998, SEEK_SET))
+    ERROR("seek with SEEK_SET failed");
+  if (9 != read(fd, buf, 9) || memcmp(&buf[2], "@@@@@", 5) ||
+      memcmp(buf, &data[99998], 2) || memcmp(&buf[7], &data[100005], 2))
+    ERROR("read after write returns stale data");
+  if (close(fd))
+    ERROR("close /test_cached_read failed");
+
+  return true;
+}
+
+bool test_SystemCall_CoalescedWrites() {
+  const char* fname = "/test_coalesce";
+  int fd = open(fname, O_RDWR | O_CREAT | O_TRUNC);
+  if (fd < 0)
+    ERROR("can not create /test_coalesce");
+  const char line[] = "0123456789abcdef";
+  for (int i = 0; i < 100; ++i) {
+    if (16 != write(fd, line, 16))
+      ERROR("can not write to /test_coalesce");
+  }
+
+  // Buffered data is visible to reads on this and other descriptors.
+  int rfd = open(fname, O_RDONLY);
+  if (rfd < 0)
+    ERROR("can not open /test_coalesce to read");
+  char buf[32];
+  if (1584 != lseek(rfd, 1584, SEEK_SET) || 16 != read(rfd, buf, 32) ||
+      memcmp(buf, line, 16))
+    ERROR("buffered data is not visible to another descriptor");
+  if (close(rfd))
+    ERROR("close /test_coalesce failed");
+  if (8 != lseek(fd, 8, SEEK_SET) || 8 != write(fd, "@@@@@@@@", 8))
+    ERROR("can not overwrite /test_coalesce");
+  if (0 != lseek(fd, 0, SEEK_SET) || 32 != read(fd, buf, 32) ||
+      memcmp(buf, "01234567@@@@@@@@0123456789abcdef", 32))
+    ERROR("buffered data is not visible to the writer");
+
+  struct stat st;
+  if (fstat(fd, &st) || 1600 != st.st_size)
+    ERROR("fstat does not count buffered data");
+  if (close(fd))
+    ERROR("close /test_coalesce failed");
+  if (stat(fname, &st) || 1600 != st.st_size)
+    ERROR("stat after close returns unexpected size");
+
+  return true;
+}
+
+bool test_SystemCall_LargeTransfers() {
+  const char* fname = "/test_large";
+  int fd = open(fname, O_RDWR | O_CREAT | O_TRUNC);
+  if (fd < 0)
+    ERROR("can not create /test_large");
+
+  // Larger than several chunks, and not a multiple of the chunk size.
+  const size_t size = 5 * 1024 * 1024 / 2 + 3;
+  std::vector<char> data(size);
+  for (size_t i = 0; i < size; ++i)
+    data[i] = static_cast<char>(i * 7 + (i >> 16));
+  if (static_cast<ssize_t>(size) != write(fd, &data[0], size))
+    ERROR("can not write to /test_large");
+
+  std::vector<char> buf(size + 16);
+  if (0 != lseek(fd, 0, SEEK_SET) ||
+      static_cast<ssize_t>(size) != read(fd, &buf[0], buf.size()) ||
+      memcmp(&buf[0], &data[0], size))
+    ERROR("large read returns unexpected data");
+  if (static_cast<ssize_t>(size - 12345) !=
+          pread(fd, &buf[0], buf.size(), 12345) ||
+      memcmp(&buf[0], &data[12345], size - 12345))
+    ERROR("large pread returns unexpected data");
+
+  if (close(fd))
+    ERROR("close /test_large failed");
+
+  return true;
+}
+
+bool test_SystemCall_MapFile() {
+  const char* fname = "/test_mmap";
+  int fd = open(fname, O_RDWR | O_CREAT | O_TRUNC);
+  if (fd < 0)
+    ERROR("can not create /test_mmap");
+  if (10 != write(fd, "0123456789", 10))
+    ERROR("can not write to /test_mmap");
+
+  char* shared = static_cast<char*>(
+      mmap(NULL, 10, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0));
+  if (shared == MAP_FAILED)
+    ERROR("can not map /test_mmap shared");
+  char* copy = static_cast<char*>(
+      mmap(NULL, 10, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0));
+  if (copy == MAP_FAILED)
+    ERROR("can not map /test_mmap private");
+  if (memcmp(shared, "0123456789", 10) || memcmp(copy, "0123456789", 10))
+    ERROR("mapped data does not match the file");
+
+  // Only shared mappings reach the file, and never past its end.
+  char buf[16];
+  copy[0] = 'p';
+  shared[1] = 's';
+  shared[10] = '!';
+  if (msync(shared, 10, MS_SYNC))
+    ERROR("msync failed");
+  if (10 != pread(fd, buf, sizeof(buf), 0) || memcmp(buf, "0s23456789", 10))
+    ERROR("msync did not write back the shared mapping");
+
+  // The mapping outlives the descriptor and is written back on munmap.
+  if (close(fd))
+    ERROR("close /test_mmap failed");
+  shared[9] = 'z';
+  if (munmap(shared, 10) || munmap(copy, 10))
+    ERROR("munmap failed");
+  fd = open(fname, O_RDONLY);
+  if (fd < 0 || 10 != read(fd, buf, sizeof(buf)) ||
+      memcmp(buf, "0s2345678z", 10))
+    ERROR("munmap did not write back the shared mapping");
+
+  // A read only descriptor can not back a shared writable mapping.
+  if (MAP_FAILED !=
+      mmap(NULL, 10, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) ||
+      EACCES != errno)
+    ERROR("EACCES is expected on a shared writable mapping of O_RDONLY");
+  char* readonly = static_cast<char*>(
+      mmap(NULL, 10, PROT_READ, MAP_SHARED, fd, 0));
+  if (readonly == MAP_FAILED || memcmp(readonly, "0s2345678z", 10))
+    ERROR("can not map /test_mmap read only");
+  if (munmap(readonly, 10))
+    ERROR("munmap failed");
+  if (close(fd))
+    ERROR("close /test_mmap failed");
+
+  return true;
+}
+
+bool test_SystemCall_Fsync() {
+  const char* fname = "/test_fsync";
+  int fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC);
+  if (fd < 0)
+    ERROR("can not create /test_fsync");
+  if (5 != write(fd, "@@@@@", 5))
+    ERROR("can not write to /test_fsync");
+  if (fsync(fd))
+    ERROR("fsync failed");
+  if (3 != write(fd, "@@@", 3))
+    ERROR("can not write to /test_fsync");
+  if (fdatasync(fd))
+    ERROR("fdatasync failed");
+
+  struct stat buf;
+  if (stat(fname, &buf) || 8 != buf.st_size)
+    ERROR("synced data is not in the file");
+  if (close(fd))
+    ERROR("close /test_fsync failed");
+
+  if (fsync(STDOUT_FILENO))
+    ERROR("fsync on STDOUT failed");
+  if (-1 != fsync(fd) || EBADF != errno)
+    ERROR("EBADF is expected on fsync for a closed descriptor");
+
+  return true;
+}
+
+bool test_SystemCall_PositionalAndVectoredIO() {
+  const char* fname = "/test_vectored";
+  int fd = open(fname, O_RDWR | O_CREAT | O_TRUNC);
+  if (fd < 0)
+    ERROR("can not create /test_vectored");
+
+  struct iovec iov[3];
+  iov[0].iov_base = const_cast<char*>("abc");
+  iov[0].iov_len = 3;
+  iov[1].iov_base = const_cast<char*>("");
+  iov[1].iov_len = 0;
+  iov[2].iov_base = const_cast<char*>("defgh");
+  iov[2].iov_len = 5;
+  if (8 != writev(fd, iov, 3))
+    ERROR("writev failed");
+  if (2 != pwrite(fd, "XY", 2, 3))
+    ERROR("pwrite failed");
+  if (8 != lseek(fd, 0, SEEK_CUR))
+    ERROR("pwrite moved the file offset");
+
+  char buf[8];
+  if (4 != pread(fd, buf, 4, 2) || memcmp(buf, "cXYf", 4))
+    ERROR("pread returns unexpected data");
+  if (8 != lseek(fd, 0, SEEK_CUR))
+    ERROR("pread moved the file offset");
+
+  char head[2];
+  char tail[8];
+  iov[0].iov_base = head;
+  iov[0].iov_len = sizeof(head);
+  iov[1].iov_base = tail;
+  iov[1].iov_len = sizeof(tail);
+  if (0 != lseek(fd, 0, SEEK_SET) || 8 != readv(fd, iov, 2))
+    ERROR("readv failed");
+  if (memcmp(head, "ab", 2) || memcmp(tail, "cXYfgh", 6))
+    ERROR("readv returns unexpected data");
+  if (8 != lseek(fd, 0, SEEK_CUR))
+    ERROR("readv did not move the file offset");
+
+  iov[0].iov_len = SSIZE_MAX;
+  iov[1].iov_len = SSIZE_MAX;
+  if (-1 != readv(fd, iov, 2) || EINVAL != errno)
+    ERROR("EINVAL is expected on readv overflowing ssize_t");
+  if (-1 != writev(fd, iov, 2) || EINVAL != errno)
+    ERROR("EINVAL is expected on writev overflowing ssize_t");
+
+  if (close(fd))
+    ERROR("close /test_vectored failed");
+  if (-1 != pread(fd, buf, 1, 0) || EBADF != errno)
+    ERROR("EBADF is expected on pread for a closed descriptor");
+
+  // Errors the file system reports are kept.
+  fd = open("/tmp/test_vectored", O_WRONLY | O_CREAT | O_TRUNC);
+  if (fd < 0)
+    ERROR("can not create /tmp/test_vectored");
+  if (-1 != pread(fd, buf, 1, 0) || EBADF != errno)
+    ERROR("EBADF is expected on pread for a write only descriptor");
+  iov[0].iov_len = sizeof(head);
+  iov[1].iov_len = sizeof(tail);
+  if (-1 != readv(fd, iov, 2) || EBADF != errno)
+    ERROR("EBADF is expected on readv for a write only descriptor");
+  if (close(fd))
+    ERROR("close /tmp/test_vectored failed");
+
+  return true;
+}
+
 bool test_SystemCall_CreateAndStatFile() {
   const char* fname = "/test_create";
   int fd = open(fname, O_RDWR | O_CREAT | O_TRUNC);
@@ -367,6 +791,86 @@ bool test_SystemCall_CreateAndStatFile() {
   return true;
 }
 
+bool test_SystemCall_StatAfterWrite() {
+  const char* fname = "/test_restat";
+  int fd = open(fname, O_RDWR | O_CREAT | O_TRUNC);
+  if (fd < 0)
+    ERROR("can not create /test_restat");
+  struct stat buf;
+  if (stat(fname, &buf) || 0 != buf.st_size)
+    ERROR("empty /test_restat has unexpected size");
+
+  // Cached metadata must not survive writes.
+  if (5 != write(fd, "@@@@@", 5))
+    ERROR("can not write to /test_restat");
+  if (stat(fname, &buf) || 5 != buf.st_size)
+    ERROR("stat after write returns stale size");
+  if (3 != write(fd, "@@@", 3))
+    ERROR("can not write to /test_restat");
+  if (close(fd))
+    ERROR("close /test_restat failed");
+  if (stat(fname, &buf) || 8 != buf.st_size)
+    ERROR("stat after close returns stale size");
+  if (stat(fname, &buf) || 8 != buf.st_size)
+    ERROR("repeated stat returns unexpected size");
+
+  return true;
+}
+
+bool test_SystemCall_CreateAfterMissingStat() {
+  const char* fname = "/test_probe";
+  struct stat buf;
+  // The second probe is answered from the negative lookup cache.
+  for (int i = 0; i < 2; ++i) {
+    if (-1 != stat(fname, &buf))
+      ERROR("unexpected successful stat on /test_probe");
+    if (ENOENT != errno)
+      ERROR("ENOENT is expected on stat");
+    if (-1 != open(fname, O_RDONLY))
+      ERROR("unexpected successful open on /test_probe");
+    if (ENOENT != errno)
+      ERROR("ENOENT is expected on open");
+  }
+
+  int fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC);
+  if (fd < 0)
+    ERROR("can not create /test_probe");
+  if (close(fd))
+    ERROR("close /test_probe failed");
+  if (stat(fname, &buf))
+    ERROR("created /test_probe is still reported as missing");
+
+  const char* dname = "/test_probe_dir";
+  if (-1 != stat(dname, &buf))
+    ERROR("unexpected successful stat on /test_probe_dir");
+  mkdir(dname, 0777);
+  if (stat(dname, &buf) || !S_ISDIR(buf.st_mode))
+    ERROR("created /test_probe_dir is still reported as missing");
+
+  return true;
+}
+
+bool test_SystemCall_ReuseLowestDescriptor() {
+  const char* fname = "/test_create";
+  int fd1 = open(fname, O_RDWR | O_CREAT | O_TRUNC);
+  if (fd1 < 0)
+    ERROR("can not create /test_create");
+  int fd2 = open(fname, O_RDONLY);
+  if (fd2 < 0)
+    ERROR("can not open /test_create");
+  if (close(fd1))
+    ERROR("close failed");
+  int fd3 = open(fname, O_RDONLY);
+  if (fd3 != fd1)
+    ERROR("the lowest free descriptor is not reused");
+  if (close(fd2) || close(fd3))
+    ERROR("close failed");
+  if (!close(fd3) || errno != EBADF)
+    ERROR("close on a closed descriptor doesn't set EBADF");
+
+  return true;
+}
+
 bool test_SystemCall_CreateAndStatDirectory() {
   const char* fpath1 = "/test_path";
   const char* fpath2 = "/test_path/child_dir";
@@ -478,6 +982,154 @@ bool test_SystemCall_Chdir() {
   return true;
 }
 
+bool test_SystemCall_TmpFileSystem() {
+  mkdir("/tmp/test_dir", S_IRUSR | S_IWUSR);
+  struct stat buf;
+  if (stat("/tmp/test_dir", &buf) || !S_ISDIR(buf.st_mode))
+    ERROR("stat on /tmp/test_dir failed");
+  if (!mkdir("/tmp/test_dir", S_IRUSR | S_IWUSR) || errno != EEXIST)
+    ERROR("mkdir on an existing /tmp directory doesn't set EEXIST");
+
+  const char* fname = "/tmp/test_dir/scratch";
+  int fd = open(fname, O_RDWR | O_CREAT | O_TRUNC);
+  if (fd < 0)
+    ERROR("can not create /tmp/test_dir/scratch");
+  if (5 != write(fd, "hello", 5))
+    ERROR("can not write to /tmp/test_dir/scratch");
+  // Leave a hole which reads as zeros.
+  if (5 != pwrite(fd, "world", 5, 100000))
+    ERROR("can not pwrite to /tmp/test_dir/scratch");
+  char data[8];
+  if (5 != pread(fd, data, 5, 0) || memcmp(data, "hello", 5) ||
+      8 != pread(fd, data, 8, 99996) || memcmp(data, "\0\0\0\0worl", 8))
+    ERROR("read returns unexpected data");
+  if (fstat(fd, &buf) || buf.st_size != 100005 || !S_ISREG(buf.st_mode))
+    ERROR("fstat returns unexpected metadata");
+  if (fcntl(fd, F_GETFD) || fcntl(fd, F_SETFD, FD_CLOEXEC) ||
+      FD_CLOEXEC != fcntl(fd, F_GETFD) || fcntl(fd, F_SETFD, 0) ||
+      fcntl(fd, F_GETFD))
+    ERROR("F_SETFD does not change what F_GETFD returns");
+  // The chunk index up to a far offset would not fit the capacity either.
+  if (-1 != pwrite(fd, "x", 1, static_cast<off_t>(1) << 40) ||
+      errno != ENOSPC || fstat(fd, &buf) || buf.st_size != 100005)
+    ERROR("pwrite at a huge offset doesn't set ENOSPC");
+  if (close(fd))
+    ERROR("close /tmp/test_dir/scratch failed");
+
+  DIR* dir = opendir("/tmp/test_dir");
+  if (!dir)
+    ERROR("opendir on /tmp/test_dir failed");
+  struct dirent* entry = readdir(dir);
+  if (!entry || strcmp(entry->d_name, "scratch") || readdir(dir))
+    ERROR("readdir on /tmp/test_dir returns unexpected entries");
+  closedir(dir);
+
+  // Writes beyond the capacity fail with ENOSPC.
+  naclfs::NaClFs::SetTmpCapacity(256 * 1024);
+  fd = open("/tmp/test_full", O_WRONLY | O_CREAT | O_TRUNC);
+  if (fd < 0)
+    ERROR("can not create /tmp/test_full");
+  std::vector<char> chunk(64 * 1024, 'x');
+  ssize_t total = 0;
+  ssize_t result;
+  while ((result = write(fd, &chunk[0], chunk.size())) > 0)
+    total += result;
+  bool full = result < 0 && errno == ENOSPC;
+  close(fd);
+  close(open("/tmp/test_full", O_WRONLY | O_TRUNC));
+  naclfs::NaClFs::SetTmpCapacity(64 * 1024 * 1024);
+  if (!full || !total || total > 256 * 1024)
+    ERROR("write beyond the capacity doesn't set ENOSPC");
+
+  return true;
+}
+
+bool test_SystemCall_MountTable() {
+  naclfs::FileSystem* filesystem = naclfs::NaClFs::GetFileSystem();
+  naclfs::MemVolume* volume = new naclfs::MemVolume(1024 * 1024);
+  if (filesystem->Mount("/test_mount", volume, 0))
+    ERROR("can not mount a volume at /test_mount");
+  naclfs::MemVolume* busy = new naclfs::MemVolume(1024 * 1024);
+  if (EBUSY != filesystem->Mount("/test_mount/", busy, 0))
+    ERROR("mount over a mount point doesn't fail with EBUSY");
+  if (filesystem->Mount("/test_mount/ro", busy,
+                        naclfs::FileSystem::MOUNT_READ_ONLY))
+    ERROR("can not mount a read-only volume at /test_mount/ro");
+
+  close(open("/test_mount/file", O_WRONLY | O_CREAT));
+  struct stat buf;
+  if (stat("/test_mount/file", &buf) || volume->usage())
+    ERROR("stat on /test_mount/file failed");
+  if (open("/test_mount/ro/file", O_WRONLY | O_CREAT) >= 0 || errno != EROFS)
+    ERROR("open for write on a read-only mount doesn't set EROFS");
+  if (!mkdir("/test_mount/ro/dir", S_IRUSR | S_IWUSR) || errno != EROFS)
+    ERROR("mkdir on a read-only mount doesn't set EROFS");
+  if (stat("/test_mount/ro", &buf) || !S_ISDIR(buf.st_mode))
+    ERROR("stat on a read-only mount point failed");
+
+  if (filesystem->Unmount("/test_mount/ro") ||
+      filesystem->Unmount("/test_mount"))
+    ERROR("can not unmount /test_mount");
+  if (EINVAL != filesystem->Unmount("/test_mount"))
+    ERROR("unmount of an unmounted path doesn't fail with EINVAL");
+  if (!stat("/test_mount/file", &buf))
+    ERROR("/test_mount/file is still visible after unmount");
+
+  return true;
+}
+
+bool test_SystemCall_PackFileSystem() {
+  naclfs::PackBuilder builder;
+  builder.AddFile("hello.txt", "hello", 5);
+  builder.AddFile("images/b.png", "png", 3);
+  builder.AddFile("images/a.png", "", 0);
+  std::vector<char> image;
+  if (!builder.Build(&image))
+    ERROR("can not build a packed image");
+  naclfs::PackVolume* volume = new naclfs::PackVolume;
+  if (volume->Attach(&image))
+    ERROR("can not attach the packed image");
+  if (naclfs::NaClFs::GetFileSystem()->Mount(
+          "/test_pack", volume, naclfs::FileSystem::MOUNT_READ_ONLY))
+    ERROR("can not mount the packed image at /test_pack");
+
+  char data[8];
+  int fd = open("/test_pack/hello.txt", O_RDONLY);
+  if (fd < 0)
+    ERROR("can not open /test_pack/hello.txt");
+  if (5 != read(fd, data, sizeof(data)) || memcmp(data, "hello", 5) ||
+      3 != pread(fd, data, 3, 2) || memcmp(data, "llo", 3) ||
+      5 != lseek(fd, 0, SEEK_END))
+    ERROR("read returns unexpected data");
+  if (fcntl(fd, F_SETFD, FD_CLOEXEC) || FD_CLOEXEC != fcntl(fd, F_GETFD))
+    ERROR("F_SETFD does not change what F_GETFD returns");
+  close(fd);
+  if (open("/test_pack/hello.txt", O_RDWR) >= 0 || errno != EROFS)
+    ERROR("open for write doesn't set EROFS");
+  if (open("/test_pack/missing", O_RDONLY) >= 0 || errno != ENOENT)
+    ERROR("open on a missing path doesn't set ENOENT");
+
+  struct stat buf;
+  if (stat("/test_pack/images", &buf) || !S_ISDIR(buf.st_mode) ||
+      stat("/test_pack/images/b.png", &buf) || buf.st_size != 3)
+    ERROR("stat returns unexpected metadata");
+  DIR* dir = opendir("/test_pack/images");
+  if (!dir)
+    ERROR("opendir on /test_pack/images failed");
+  struct dirent* first = readdir(dir);
+  if (!first || strcmp(first->d_name, "a.png"))
+    ERROR("readdir doesn't list entries in name order");
+  struct dirent* second = readdir(dir);
+  if (!second || strcmp(second->d_name, "b.png") || readdir(dir))
+    ERROR("readdir returns unexpected entries");
+  closedir(dir);
+
+  if (naclfs::NaClFs::GetFileSystem()->Unmount("/test_pack"))
+    ERROR("can not unmount /test_pack");
+
+  return true;
+}
+
 bool test_POSIX_Arguments() {
   if (g_argc != 3)
     ERROR("invalid argc");
@@ -556,6 +1208,255 @@ bool test_Internal_PathNormalization() {
   return true;
 }
 
+bool test_Internal_DirectoryIndex() {
+  naclfs::DirectoryIndex index;
+  const char* names[] = { "pear", "apple", "fig" };
+  for (int i = 0; i < 3; ++i)
+    index.Add(names[i], strlen(names[i]), i);
+  if (3 != index.size() || index.sorted())
+    ERROR("unexpected index state after Add");
+  if (1 != index.Find("apple") || -1 != index.Find("app"))
+    ERROR("Find fails on an unsorted index");
+
+  index.Sort();
+  const char* sorted[] = { "apple", "fig", "pear" };
+  const uint8_t types[] = { 1, 2, 0 };
+  for (int i = 0; i < 3; ++i) {
+    if (strcmp(sorted[i], index.name(i)) ||
+        strlen(sorted[i]) != index.length(i) || types[i] != index.type(i))
+      ERROR("Sort does not order entries by name");
+    if (i != index.Find(sorted[i]))
+      ERROR("Find fails on a sorted index");
+  }
+  if (-1 != index.Find("banana") || -1 != index.Find("zebra"))
+    ERROR("Find returns a missing name");
+
+  return true;
+}
+
+struct WalkLog {
+  std::vector<std::string> paths;
+  std::vector<int> types;
+  volatile uint32_t count;
+};
+
+static int LogWalk(const naclfs::TreeWalk::Entry& entry, void* context) {
+  WalkLog* log = static_cast<WalkLog*>(context);
+  log->paths.push_back(entry.path);
+  log->types.push_back(entry.type);
+  if (strcmp(&entry.path[entry.base], strrchr(entry.path, '/') + 1))
+    return -2;
+  return 0;
+}
+
+static int CountWalk(const naclfs::TreeWalk::Entry& entry, void* context) {
+  __sync_fetch_and_add(&static_cast<WalkLog*>(context)->count, 1);
+  return 0;
+}
+
+static int StopWalk(const naclfs::TreeWalk::Entry& entry, void* context) {
+  static_cast<WalkLog*>(context)->count++;
+  return entry.level ? 7 : 0;
+}
+
+bool test_Internal_TreeWalk() {
+  mkdir("/test_walk", S_IRUSR | S_IWUSR);
+  mkdir("/test_walk/dir", S_IRUSR | S_IWUSR);
+  fclose(fopen("/test_walk/dir/file", "a+"));
+  fclose(fopen("/test_walk/file", "a+"));
+
+  naclfs::TreeWalk walk(4);
+  WalkLog pre;
+  if (walk.Walk("/test_walk", false, LogWalk, &pre))
+    ERROR("pre-order walk failed");
+  if (4 != pre.paths.size() || "/test_walk" != pre.paths[0] ||
+      naclfs::TreeWalk::DIRECTORY != pre.types[0])
+    ERROR("pre-order walk does not start from the root");
+  for (size_t i = 1; i < pre.paths.size(); ++i) {
+    if ("/test_walk/dir/file" == pre.paths[i] &&
+        "/test_walk/dir" != pre.paths[i - 1])
+      ERROR("pre-order walk visits an entry before its directory");
+  }
+
+  WalkLog post;
+  if (walk.Walk("/test_walk", true, LogWalk, &post))
+    ERROR("post-order walk failed");
+  if (4 != post.paths.size() || "/test_walk" != post.paths[3] ||
+      naclfs::TreeWalk::DIRECTORY_POST != post.types[3])
+    ERROR("post-order walk does not end with the root");
+
+  WalkLog parallel;
+  parallel.count = 0;
+  if (walk.WalkParallel("/test_walk", 3, CountWalk, &parallel) ||
+      4 != parallel.count)
+    ERROR("parallel walk does not visit every entry once");
+
+  WalkLog stopped;
+  stopped.count = 0;
+  if (7 != walk.Walk("/test_walk", false, StopWalk, &stopped) ||
+      2 != stopped.count)
+    ERROR("a visitor can not stop the walk");
+
+  WalkLog missing;
+  if (-1 != walk.Walk("/test_walk_ng", false, LogWalk, &missing) ||
+      ENOENT != errno)
+    ERROR("ENOENT is expected for a missing root");
+
+  return true;
+}
+
+bool test_Async_SubmitAndReap() {
+  const char* fname = "/test_async";
+  int fd = open(fname, O_RDWR | O_CREAT | O_TRUNC);
+  if (fd < 0)
+    ERROR("can not create /test_async");
+  if (10 != write(fd, "0123456789", 10))
+    ERROR("can not write to /test_async");
+  if (close(fd))
+    ERROR("close /test_async failed");
+
+  naclfs::IoQueue queue(4);
+  naclfs::IoQueue::Request* completions[4];
+  naclfs::IoQueue::Request open_request;
+  memset(&open_request, 0, sizeof(open_request));
+  open_request.opcode = naclfs::IoQueue::OPEN;
+  open_request.path = fname;
+  open_request.oflag = O_RDONLY;
+  struct stat buf;
+  naclfs::IoQueue::Request stat_request;
+  memset(&stat_request, 0, sizeof(stat_request));
+  stat_request.opcode = naclfs::IoQueue::STAT;
+  stat_request.path = fname;
+  stat_request.stat = &buf;
+  naclfs::IoQueue::Request* requests[] = { &open_request, &stat_request };
+  if (2 != queue.Submit(requests, 2))
+    ERROR("can not submit open and stat");
+  if (2 != queue.Reap(completions, 4, 2))
+    ERROR("can not reap open and stat");
+  if (open_request.result < 0)
+    ERROR("asynchronous open failed");
+  if (stat_request.result || 10 != buf.st_size)
+    ERROR("asynchronous stat failed");
+
+  // Reads on the same descriptor run in submission order.
+  char data[2][5];
+  naclfs::IoQueue::Request read_requests[2];
+  for (int i = 0; i < 2; ++i) {
+    memset(&read_requests[i], 0, sizeof(read_requests[i]));
+    read_requests[i].opcode = naclfs::IoQueue::READ;
+    read_requests[i].fildes = open_request.result;
+    read_requests[i].buf = data[i];
+    read_requests[i].nbytes = 5;
+    requests[i] = &read_requests[i];
+  }
+  if (2 != queue.Submit(requests, 2))
+    ERROR("can not submit reads");
+  if (2 != queue.Reap(completions, 4, 2))
+    ERROR("can not reap reads");
+  if (5 != read_requests[0].result || memcmp(data[0], "01234", 5))
+    ERROR("first asynchronous read returns unexpected data");
+  if (5 != read_requests[1].result || memcmp(data[1], "56789", 5))
+    ERROR("second asynchronous read returns unexpected data");
+
+  naclfs::IoQueue::Request close_request;
+  memset(&close_request, 0, sizeof(close_request));
+  close_request.opcode = naclfs::IoQueue::CLOSE;
+  close_request.fildes = open_request.result;
+  requests[0] = &close_request;
+  if (1 != queue.Submit(requests, 1) || 1 != queue.Reap(completions, 4, 1))
+    ERROR("can not close asynchronously");
+  if (close_request.result)
+    ERROR("asynchronous close failed");
+
+  return true;
+}
+
+bool test_Async_CloseAfterWrite() {
+  const char* fname = "/test_async_close";
+  int fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC);
+  if (fd < 0)
+    ERROR("can not create /test_async_close");
+  if (10 != write(fd, "0123456789", 10))
+    ERROR("can not write to /test_async_close");
+
+  // Buffered data reaches the file before requests on the descriptor run.
+  naclfs::IoQueue queue(4);
+  naclfs::IoQueue::Request* completions[4];
+  struct stat buf;
+  naclfs::IoQueue::Request fstat_request;
+  memset(&fstat_request, 0, sizeof(fstat_request));
+  fstat_request.opcode = naclfs::IoQueue::FSTAT;
+  fstat_request.fildes = fd;
+  fstat_request.stat = &buf;
+  naclfs::IoQueue::Request* requests[] = { &fstat_request };
+  if (1 != queue.Submit(requests, 1) || 1 != queue.Reap(completions, 4, 1))
+    ERROR("can not fstat asynchronously");
+  if (fstat_request.result || 10 != buf.st_size)
+    ERROR("asynchronous fstat returns a stale size");
+
+  if (5 != write(fd, "abcde", 5))
+    ERROR("can not write to /test_async_close");
+  naclfs::IoQueue::Request close_request;
+  memset(&close_request, 0, sizeof(close_request));
+  close_request.opcode = naclfs::IoQueue::CLOSE;
+  close_request.fildes = fd;
+  requests[0] = &close_request;
+  if (1 != queue.Submit(requests, 1) || 1 != queue.Reap(completions, 4, 1))
+    ERROR("can not close asynchronously");
+  if (close_request.result)
+    ERROR("asynchronous close failed");
+  if (!close(fd) || errno != EBADF)
+    ERROR("asynchronous close leaves the descriptor bound");
+  if (stat(fname, &buf) || 15 != buf.st_size)
+    ERROR("asynchronous close loses buffered data");
+
+  return true;
+}
+
+bool test_Async_ConcurrentPositionalReads() {
+  const char* fname = "/test_async_pread";
+  int fd = open(fname, O_RDWR | O_CREAT | O_TRUNC);
+  if (fd < 0)
+    ERROR("can not create /test_async_pread");
+  // The data is still buffered, and must be written out before the
+  // requests read the file.
+  if (16 != write(fd, "0123456789abcdef", 16))
+    ERROR("can not write to /test_async_pread");
+
+  // Positional reads on one descriptor may be in flight at once, and each
+  // still lands in its own buffer.
+  naclfs::IoQueue queue(4);
+  naclfs::IoQueue::Request* completions[4];
+  naclfs::IoQueue::Request* requests[4];
+  naclfs::IoQueue::Request read_requests[4];
+  char data[4][4];
+  for (int i = 0; i < 4; ++i) {
+    memset(&read_requests[i], 0, sizeof(read_requests[i]));
+    read_requests[i].opcode = naclfs::IoQueue::PREAD;
+    read_requests[i].fildes = fd;
+    read_requests[i].buf = data[i];
+    read_requests[i].nbytes = 4;
+    read_requests[i].offset = (3 - i) * 4;
+    requests[i] = &read_requests[i];
+  }
+  if (4 != queue.Submit(requests, 4))
+    ERROR("can not submit reads");
+  if (4 != queue.Reap(completions, 4, 4))
+    ERROR("can not reap reads");
+  const char* expected[] = { "cdef", "89ab", "4567", "0123" };
+  for (int i = 0; i < 4; ++i) {
+    if (4 != read_requests[i].result || memcmp(data[i], expected[i], 4))
+      ERROR("asynchronous pread returns unexpected data");
+  }
+  if (16 != lseek(fd, 0, SEEK_CUR))
+    ERROR("asynchronous pread moved the file offset");
+
+  if (close(fd))
+    ERROR("close /test_async_pread failed");
+
+  return true;
+}
+
 extern "C" int naclfs_main(int argc, char** argv) {
   g_argc = argc;
   g_argv = argv;
@@ -568,16 +1469,37 @@ extern "C" int naclfs_main(int argc, char** argv) {
   REGISTER_TEST(SystemCall, FcntlGetFlStandards);
   REGISTER_TEST(SystemCall, ReadLseekAndWriteFile);
   REGISTER_TEST(SystemCall, CreateAndStatFile);
+  REGISTER_TEST(SystemCall, AppendAndSeekEnd);
+  REGISTER_TEST(SystemCall, CachedSequentialRead);
+  REGISTER_TEST(SystemCall, CoalescedWrites);
+  REGISTER_TEST(SystemCall, LargeTransfers);
+  REGISTER_TEST(SystemCall, MapFile);
+  REGISTER_TEST(SystemCall, Fsync);
+  REGISTER_TEST(SystemCall, PositionalAndVectoredIO);
+  REGISTER_TEST(SystemCall, StatAfterWrite);
+  REGISTER_TEST(SystemCall, CreateAfterMissingStat);
+  REGISTER_TEST(SystemCall, ReuseLowestDescriptor);
   REGISTER_TEST(SystemCall, CreateAndStatDirectory);
   REGISTER_TEST(SystemCall, CreateAndAccessFile);
   REGISTER_TEST(SystemCall, Chdir);
+  REGISTER_TEST(SystemCall, TmpFileSystem);
+  REGISTER_TEST(SystemCall, MountTable);
+  REGISTER_TEST(SystemCall, PackFileSystem);
   // TODO: OpenAndUnlink, OpenWithVariousModes, MkdirAndRmdir
   REGISTER_TEST(POSIX, Arguments);
   REGISTER_TEST(POSIX, OpenAndCloseStandards);
   REGISTER_TEST(POSIX, WriteStandards);
   // TODO: fstat, fcntl
   REGISTER_TEST(POSIX, DirectoryEnumeration);
+  REGISTER_TEST(POSIX, DirectoryPosition);
+  REGISTER_TEST(POSIX, DirectoryEntryTypes);
+  REGISTER_TEST(POSIX, DirectoryPrefetch);
+  REGISTER_TEST(Async, SubmitAndReap);
+  REGISTER_TEST(Async, CloseAfterWrite);
+  REGISTER_TEST(Async, ConcurrentPositionalReads);
   REGISTER_TEST(Internal, PathNormalization);
+  REGISTER_TEST(Internal, DirectoryIndex);
+  REGISTER_TEST(Internal, TreeWalk);
 
   return run_tests();
 }